@@ -18,6 +18,8 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <climits>
 #include <iostream>
 #include <iomanip>
 #include <fstream>
@@ -240,6 +242,17 @@ typedef double (*ExtraPropFunc)(double, double, double&);
 #define UNBINDNUM 150
 #define POTPPCALCNUM 150
 #define POTOMPCALCNUM 1000
+///number of particles in the tiles of the direct summation potential calculation \ref PotentialPP
+#define POTPPTILESIZE 64
+///groups larger than this do not keep the scratch buffers of the potential calculation (see \ref PotentialScratch) once done
+#define POTSCRATCHMAXNUM 100000
+///\name tree potential calculation types, see \ref UnbindInfo.treepotentialtype
+//@{
+///Barnes-Hut tree walk per particle using monopole moments of cells
+#define POTTREEMONOPOLE 0
+///dual tree walk (fast multipole method) using quadrupole moments of cells and local expansions, see \ref PotentialFMM
+#define POTTREEFMM 1
+//@}
 ///when unbinding check to see if system is bound and least bound particle is also bound
 #define USYSANDPART 0
 ///when unbinding check to see if least bound particle is also bound
@@ -330,6 +343,15 @@ struct UnbindInfo
     Double_t TreeThetaOpen;
     ///softening length
     Double_t eps;
+    ///type of tree potential calculation (\ref POTTREEMONOPOLE or \ref POTTREEFMM)
+    int treepotentialtype;
+    ///minimum number of particles in a group for it to use the fast multipole method if selected
+    Int_t fmmminsize;
+    ///keep a tree of large groups while unbinding them, removing unbound particles from it and refreshing potentials with it rather than rebuilding
+    int iincrementalpotential;
+    ///maximum number of particles in a group for which potential is calculated by direct summation rather than a tree,
+    ///if <0 determined at start up from timings (see \ref CalibratePotentialPPCrossover)
+    Int_t potppcalcnum;
     //@}
     UnbindInfo(){
         icalculatepotential=true;
@@ -343,6 +365,10 @@ struct UnbindInfo
         BucketSize=8;
         TreeThetaOpen=0.5;
         eps=0.0;
+        treepotentialtype=POTTREEMONOPOLE;
+        fmmminsize=100000;
+        potppcalcnum=POTPPCALCNUM;
+        iincrementalpotential=0;
         Npotref=20;
         fracpotref=1.0;
         maxunbindfrac=0.5;
@@ -351,6 +377,77 @@ struct UnbindInfo
     }
 };
 
+/*!
+    Tree used to calculate the gravitational potential of a group with a dual tree walk (see \ref PotentialFMM).
+    Particle positions and masses are stored in tree order along with the index of each particle in the group.
+    Cells are stored in depth first order so a cell's children always follow it. Each cell stores its mass, centre of mass,
+    the radius of a sphere about its centre of mass enclosing all its particles and its traceless quadrupole moment, along with
+    the local expansion (value, gradient and hessian) of the potential of the distant cells about its centre of mass.
+    Symmetric tensors are stored as xx,xy,xz,yy,yz,zz.
+*/
+struct FMMTree
+{
+    Int_t nbodies, ncell;
+    vector<Double_t> pos, mass;
+    vector<Int_t> index;
+    ///particle range of each cell and its children, which are -1 for leaf cells
+    vector<Int_t> start, end, left, right;
+    vector<Double_t> cmass, crmax, cquad;
+    vector<Coordinate> ccm;
+    vector<Double_t> l0, l2;
+    vector<Coordinate> l1;
+};
+
+/*!
+    Scratch buffers of the tree potential calculation (\ref Potential) and direct summation (\ref PotentialPP). One is kept per thread
+    and grown to the largest group seen so potentials of many groups do not repeatedly allocate and free these arrays. The arrays
+    used by each thread walking the tree are stored as consecutive blocks of ncell entries.
+*/
+struct PotentialScratch
+{
+    vector<Int_t> start, end, marktreecell, markleafcell;
+    vector<Double_t> cmtot, cBmax, cR2max, r2val, ppdata;
+    vector<Coordinate> cellcm;
+    vector<Node*> nodelist, npomp;
+
+    template<typename T> void Grow(vector<T> &v, size_t n){
+        if (v.size()<n) v.resize(max(n,v.size()+v.size()/2));
+    }
+    ///ensure arrays can store ncell cells walked by nthreads threads
+    void Reserve(Int_t ncell, int nthreads){
+        Grow(start,ncell);
+        Grow(end,ncell);
+        Grow(cmtot,ncell);
+        Grow(cBmax,ncell);
+        Grow(cR2max,ncell);
+        Grow(cellcm,ncell);
+        Grow(nodelist,ncell);
+        Grow(npomp,nthreads);
+        Grow(marktreecell,(size_t)ncell*nthreads);
+        Grow(markleafcell,(size_t)ncell*nthreads);
+        Grow(r2val,(size_t)ncell*nthreads);
+    }
+    ///ensure the positions, masses and potentials of n particles can be stored for direct summation
+    void ReservePP(Int_t n){
+        Grow(ppdata,(size_t)5*n);
+    }
+    ///release all memory
+    void Free(){
+        vector<Int_t>().swap(start);
+        vector<Int_t>().swap(end);
+        vector<Int_t>().swap(marktreecell);
+        vector<Int_t>().swap(markleafcell);
+        vector<Double_t>().swap(cmtot);
+        vector<Double_t>().swap(cBmax);
+        vector<Double_t>().swap(cR2max);
+        vector<Double_t>().swap(r2val);
+        vector<Double_t>().swap(ppdata);
+        vector<Coordinate>().swap(cellcm);
+        vector<Node*>().swap(nodelist);
+        vector<Node*>().swap(npomp);
+    }
+};
+
 /// Structure stores information used when calculating bulk (sub)structure properties
 /// which is used in \ref substructureproperties.cxx
 struct PropInfo
@@ -423,6 +520,8 @@ struct Options
     int icosmologicalin;
     /// input buffer size when reading data
     long long inputbufsize;
+    /// reorder particles after reading so that particles close in space are also close in memory (Morton order)
+    int iSortInputMorton;
     /// mpi paritcle buffer size when sending input particle information
     long long mpiparticletotbufsize,mpiparticlebufsize;
     /// mpi factor by which to multiple the memory allocated, ie: buffer region
@@ -430,6 +529,8 @@ struct Options
     Double_t mpipartfac;
     /// if using parallel output, number of mpi threads to group together
     int mpinprocswritesize;
+    /// in single halo mode, only exchange the background grid cells neighbouring the particles of an mpi process rather than gathering the full grid
+    int impigridhaloexchange;
 
     /// run FOF using OpenMP
     int iopenmpfof;
@@ -463,6 +564,14 @@ struct Options
     ///\name parameters that control the local and average volumes used to calculate the local velocity density and the mean field, also the size of the leafnode in the kd-tree used when searching the tree for fof neighbours
     //@{
     int iLocalVelDenApproxCalcFlag;
+    ///flag to find the physical neighbours of all particles in a leaf node together when calculating the exact local velocity density
+    int iLocalVelDenBatchedNN;
+    ///flag to have each particle in a leaf node select its own physical neighbours from candidates shared by the leaf in the approximative local velocity density
+    int iLocalVelDenLeafCandidates;
+    ///flag to calculate distances and select physical neighbours in single precision when finding neighbours using candidates shared by a leaf node
+    int iLocalVelDenSinglePrecision;
+    ///flag to reuse the local velocity density of particles whose neighbours are unchanged when searching substructures of substructures (with \ref HALOONLYDEN)
+    int iSubVelDenReuse;
     int Nvel, Nsearch, Bsize;
     Int_t Ncell;
     Double_t Ncellfac;
@@ -476,6 +585,10 @@ struct Options
 
     ///whether to search for substructures at all
     int iSubSearch;
+    ///when searching an object for substructure, copy only the particle quantities used by the search rather than the full particle including hydro, star and black hole properties
+    int iSubSearchLeanCopy;
+    ///skip searching substructures for further substructure if the outlier values their particles had in their parent show no significant contrast
+    int iSubSearchPrescreen;
     ///type of search
     int foftype,fofbgtype;
     ///grid type, physical, physical+entropy splitting criterion, phase+entropy splitting criterion. Note that this parameter should not be changed from the default value
@@ -525,6 +638,11 @@ struct Options
     Double_t ellhalo3dxfac;
     Double_t ellhalo6dxfac;
     Double_t ellhalo6dvfac;
+    ///flag to cache the physical neighbours found with the 3DFOF tree and use these in the 6DFOF search
+    ///instead of building a phase-space tree for every 3DFOF group
+    int iFOF6DCachedNeighbours;
+    ///list of factors of the halo 3D linking length for which 3DFOF groups are also found, using a single tree and neighbour search
+    vector<Double_t> ellhalo3dsweepfacs;
     int iKeepFOF;
     Int_t num3dfof;
     //@}
@@ -945,6 +1063,8 @@ struct Options
         Ncellfac=0.01;
 
         iSubSearch=1;
+        iSubSearchLeanCopy=0;
+        iSubSearchPrescreen=0;
         partsearchtype=PSTALL;
         for (int i=0;i<NPARTTYPES;i++)numpart[i]=0;
         foftype=FOFSTPROB;
@@ -955,6 +1075,10 @@ struct Options
         icmrefadjust=1;
         iIterateCM = 1;
         iLocalVelDenApproxCalcFlag = 2 ;
+        iLocalVelDenBatchedNN = 0;
+        iLocalVelDenLeafCandidates = 0;
+        iLocalVelDenSinglePrecision = 0;
+        iSubVelDenReuse = 0;
 
         Neff=-1;
 
@@ -971,6 +1095,7 @@ struct Options
         ellhalophysfac=ellhalovelfac=1.0;
         ellhalo6dxfac=1.0;
         ellhalo6dvfac=1.25;
+        iFOF6DCachedNeighbours=0;
         ellhalo3dxfac=-1.0;
 
         iiterflag=0;
@@ -1050,6 +1175,7 @@ struct Options
         iScaleLengths=0;
 
         inputbufsize=1000000;
+        iSortInputMorton=0;
 
         mpiparticletotbufsize=-1;
         mpiparticlebufsize=-1;
@@ -1075,6 +1201,7 @@ struct Options
         iSphericalOverdensityExtraFieldCalculations = false;
 
         mpipartfac=0.1;
+        impigridhaloexchange=1;
 #if USEHDF
         ihdfnameconvention=-1;
 #endif
@@ -1334,6 +1461,124 @@ struct GridCell
     }
 };
 
+/*!
+    Weighted histogram of the logarithmic ratio of the measured to background velocity density (see \ref DetermineDenVRatioDistribution).
+    Histograms filled by different threads or mpi processes are combined by summing the bins.
+*/
+struct DenVRatioHistogram
+{
+    Double_t xmin, delta;
+    int nbins;
+    ///sum of weights and squared weights in each bin
+    vector<Double_t> w, w2;
+    ///total weight in bins
+    Double_t wtot;
+    void Initialize(Double_t x0, Double_t dx, int n){
+        xmin=x0;
+        delta=dx;
+        nbins=n;
+        w.assign(nbins,0.);
+        w2.assign(nbins,0.);
+        wtot=0.;
+    }
+    void Add(Double_t x, Double_t wt){
+        if (nbins==0) return;
+        unsigned int ir=(unsigned int)((x-xmin)/delta);
+        if (ir>=nbins) return;
+        w[ir]+=wt;
+        w2[ir]+=wt*wt;
+        wtot+=wt;
+    }
+    void Merge(const DenVRatioHistogram &h){
+        for (int i=0;i<nbins;i++) {w[i]+=h.w[i];w2[i]+=h.w2[i];}
+        wtot+=h.wtot;
+    }
+};
+
+/*!
+    Mass weighted phase-space centre and second moments about the centre accumulated in a single pass. Moments accumulated
+    by different threads are combined with \ref Merge (see \ref CalcPhaseMoments and \ref CalcGroupPhaseMoments).
+*/
+struct PhaseMoments
+{
+    Double_t mass;
+    Double_t mean[6];
+    ///sum of m (x-mean)(x-mean)^T, with only the diagonal accumulated if the full tensor is not required
+    Double_t cov[6][6];
+    PhaseMoments(){
+        mass=0;
+        for (int j=0;j<6;j++) {mean[j]=0; for (int k=0;k<6;k++) cov[j][k]=0;}
+    }
+    void Add(const Double_t *x, Double_t m, bool itensor=false){
+        if (m<=0) return;
+        Double_t d[6], f;
+        mass+=m;
+        f=m/mass;
+        for (int j=0;j<6;j++) {d[j]=x[j]-mean[j]; mean[j]+=d[j]*f;}
+        if (itensor) {
+            for (int j=0;j<6;j++) for (int k=0;k<6;k++) cov[j][k]+=m*d[j]*(x[k]-mean[k]);
+        }
+        else for (int j=0;j<6;j++) cov[j][j]+=m*d[j]*(x[j]-mean[j]);
+    }
+    void Merge(const PhaseMoments &b){
+        if (b.mass==0) return;
+        if (mass==0) {*this=b; return;}
+        Double_t d[6], mtot=mass+b.mass, f=mass*b.mass/mtot;
+        for (int j=0;j<6;j++) d[j]=b.mean[j]-mean[j];
+        for (int j=0;j<6;j++) for (int k=0;k<6;k++) cov[j][k]+=b.cov[j][k]+d[j]*d[k]*f;
+        for (int j=0;j<6;j++) mean[j]+=d[j]*b.mass/mtot;
+        mass=mtot;
+    }
+    ///mean square distance from the centre in position and velocity
+    Double_t SigmaX2() const {return (mass>0)?(cov[0][0]+cov[1][1]+cov[2][2])/mass:0;}
+    Double_t SigmaV2() const {return (mass>0)?(cov[3][3]+cov[4][4]+cov[5][5])/mass:0;}
+};
+
+/*!
+    Occupancy of a coarse grid of cells at least rcell wide by a set of particles. A point whose cell and neighbouring cells are all empty
+    has no particle within rcell, so searches only interested in particles within rcell can be skipped (see \ref SearchBaryons).
+    Cell indices are packed into a single key, collisions only make the test conservative.
+*/
+struct NeighbourCellMask
+{
+    Double_t cellsize, period;
+    long long ncell;
+    unordered_set<long long> occupied;
+    long long CellIndex(Double_t x) const {
+        long long ix=(long long)floor(x/cellsize);
+        if (period>0) {ix%=ncell; if (ix<0) ix+=ncell;}
+        return ix;
+    }
+    long long Key(long long ix, long long iy, long long iz) const {
+        if (period>0) {ix=(ix+ncell)%ncell; iy=(iy+ncell)%ncell; iz=(iz+ncell)%ncell;}
+        const long long mask=(1LL<<21)-1;
+        return ((ix&mask)<<42)|((iy&mask)<<21)|(iz&mask);
+    }
+    void Initialize(Int_t nbodies, Particle *Part, Double_t rcell, Double_t p=0){
+        period=p;
+        ncell=0;
+        cellsize=rcell;
+        if (period>0) {
+            ncell=max((long long)1,(long long)floor(period/rcell));
+            cellsize=period/(Double_t)ncell;
+        }
+        occupied.clear();
+        occupied.reserve(nbodies);
+        for (Int_t i=0;i<nbodies;i++) occupied.insert(Key(CellIndex(Part[i].GetPosition(0)),CellIndex(Part[i].GetPosition(1)),CellIndex(Part[i].GetPosition(2))));
+    }
+    long long GetKey(Particle &p) const {
+        return Key(CellIndex(p.GetPosition(0)),CellIndex(p.GetPosition(1)),CellIndex(p.GetPosition(2)));
+    }
+    ///returns whether any particle may lie within rcell of p
+    bool HasNeighbours(Particle &p) const {
+        if (cellsize<=0) return true;
+        long long ix=CellIndex(p.GetPosition(0)), iy=CellIndex(p.GetPosition(1)), iz=CellIndex(p.GetPosition(2));
+        for (int i=-1;i<=1;i++) for (int j=-1;j<=1;j++) for (int k=-1;k<=1;k++)
+            if (occupied.count(Key(ix+i,iy+j,iz+k))) return true;
+        return false;
+    }
+};
+
 /*! structure stores bulk properties like
     \f$ m,\ (x,y,z)_{\rm cm},\ (vx,vy,vz)_{\rm cm},\ V_{\rm max},\ R_{\rm max}, \f$
     which is calculated in \ref substructureproperties.cxx
@@ -2679,7 +2924,10 @@ struct StrucLevelData
     ///allowing for multiple structure types at a given level in the hierarchy
     Int_t *stypeinlevel;
     StrucLevelData *nextlevel;
+    ///single block holding all the arrays of the level
+    char *arena;
     StrucLevelData(Int_t numgroups=-1){
+        arena=NULL;
         if (numgroups<=0) {
             Phead=NULL;
             Pparenthead=NULL;
@@ -2692,15 +2940,18 @@ struct StrucLevelData
         }
         else Allocate(numgroups);
     }
-    ///just allocate memory
+    ///just allocate memory, with all arrays placed in a single block
     void Allocate(Int_t numgroups){
+        size_t n=numgroups+1;
+        if (arena!=NULL) delete[] arena;
         nsinlevel=numgroups;
-        Phead=new Particle*[numgroups+1];
-        Pparenthead=new Particle*[numgroups+1];
-        gidhead=new Int_t*[numgroups+1];
-        gidparenthead=new Int_t*[numgroups+1];
-        giduberparenthead=new Int_t*[numgroups+1];
-        stypeinlevel=new Int_t[numgroups+1];
+        arena=new char[n*(2*sizeof(Particle*)+3*sizeof(Int_t*)+sizeof(Int_t))];
+        Phead=(Particle**)arena;
+        Pparenthead=Phead+n;
+        gidhead=(Int_t**)(Pparenthead+n);
+        gidparenthead=gidhead+n;
+        giduberparenthead=gidparenthead+n;
+        stypeinlevel=(Int_t*)(giduberparenthead+n);
         nextlevel=NULL;
     }
     ///initialize
@@ -2710,15 +2961,26 @@ struct StrucLevelData
     ~StrucLevelData(){
         if (nextlevel!=NULL) delete nextlevel;
         nextlevel=NULL;
-        delete[] Phead;
-        delete[] Pparenthead;
-        delete[] gidhead;
-        delete[] gidparenthead;
-        delete[] giduberparenthead;
-        delete[] stypeinlevel;
+        if (arena!=NULL) delete[] arena;
     }
 };
 
+/*!
+    Flat copy of the structure hierarchy stored in the \ref StrucLevelData levels with the group ids resolved from the pfof pointers
+    (see \ref BuildStrucHierarchy). Parents are stored as index arrays so that hierarchy queries are a single pass over the groups
+    rather than walks over the levels.
+*/
+struct StrucHierarchy
+{
+    Int_t ngroups;
+    int nlevels;
+    ///direct parent and uber parent (field structure) of each group, GROUPNOPARENT if none
+    vector<Int_t> parent, uparent;
+    ///structure type, level in the hierarchy (-1 if not in the hierarchy) and total number of (sub)substructures of each group
+    vector<Int_t> stype, nsub;
+    vector<int> level;
+};
+
 #if defined(USEHDF)||defined(USEADIOS)
 ///store the names of datasets in catalog output
 struct DataGroupNames {
@@ -3044,6 +3306,164 @@ struct leaf_node_info{
 #endif
 };
 
+/*!
+    Velocity densities and physical neighbours of particles calculated when searching a (sub)structure, stored by the particle's index in the
+    set searched for substructure (see \ref SearchSubSub). A particle in a child structure whose neighbours all belong to the child has the
+    same neighbours and hence the same velocity density, so these are reused rather than recalculated.
+    Neighbours are stored as nsearch consecutive entries per particle. Structures at the same level can be processed concurrently, so
+    marks of particles, which may belong to another structure, must be accessed atomically.
+*/
+struct velden_sub_cache{
+    ///velocity density
+    vector<Double_t> density;
+    ///physical neighbours used to calculate the density, with the first entry of a particle -1 if not calculated
+    vector<int> nnlist;
+    ///key (based on level and first particle) of the structure a particle was last in, used to check if neighbours are in the same structure
+    vector<long long> mark;
+    int nsearch;
+    void Initialize(Int_t n, int ns) {
+        nsearch=ns;
+        density.resize(n);
+        nnlist.assign((size_t)n*nsearch,-1);
+        mark.assign(n,-1);
+    }
+    ///neighbours of particle index
+    int *Neighbours(Int_t index) {return &nnlist[(size_t)index*nsearch];}
+    bool HasNeighbours(Int_t index) {return nnlist[(size_t)index*nsearch]>=0;}
+    ///neighbours of particle index are no longer needed
+    void ClearNeighbours(Int_t index) {nnlist[(size_t)index*nsearch]=-1;}
+    long long StructureKey(int sublevel, Int_t firstindex) {
+        return (long long)sublevel*(long long)mark.size()+(long long)firstindex;
+    }
+    size_t MemUsage() {return density.size()*sizeof(Double_t)+nnlist.size()*sizeof(int)+mark.size()*sizeof(long long);}
+};
+
+///\name reasons a (sub)structure is not fully searched for substructure (see \ref SearchSubSubObject)
+//@{
+///too few outliers for a substructure to be grown
+#define SUBSEARCHNOOUTLIERS 1
+///failed the pre-screen based on the outlier values of its particles in its parent
+#define SUBSEARCHPRESCREEN 2
+//@}
+
+/*!
+    Result of searching a (sub)structure for substructure in \ref SearchSubSub. Small objects are searched as OpenMP tasks that go on to search
+    the substructures they find, so results of objects at later levels may be available before the level is reached (see \ref SearchSubSubObject).
+*/
+struct SubSearchResult{
+    ///number of substructures found and number of these that are cores
+    Int_t ngroup, numcores;
+    ///if not 0, the reason the structure was not fully searched (\ref SUBSEARCHNOOUTLIERS or \ref SUBSEARCHPRESCREEN)
+    int iskipped;
+    ///size and particles (as indices of the global subset) of substructures
+    Int_t *numingroup, **pglist;
+    ///results of searching the substructures, NULL if not searched
+    vector<SubSearchResult*> children;
+    SubSearchResult(){
+        ngroup=numcores=0;
+        iskipped=0;
+        numingroup=NULL;
+        pglist=NULL;
+    }
+};
+
+/*!
+    The few \ref Options fields changed when a (sub)structure is searched for substructure (see \ref PreCalcSearchSubSet and \ref SearchSubset).
+    Threads searching objects concurrently each keep one copy of the options for the whole search and only restore these fields from
+    this context before searching an object rather than copying all the options for every object.
+*/
+struct SubSearchContext{
+    Int_t Ncell;
+    int MinSize, HaloMinSize, idenvflag;
+    Double_t HaloSigmaV, HaloLocalSigmaV, HaloVelDispScale;
+    void Save(const Options &opt) {
+        Ncell=opt.Ncell;
+        MinSize=opt.MinSize;
+        HaloMinSize=opt.HaloMinSize;
+        idenvflag=opt.idenvflag;
+        HaloSigmaV=opt.HaloSigmaV;
+        HaloLocalSigmaV=opt.HaloLocalSigmaV;
+        HaloVelDispScale=opt.HaloVelDispScale;
+    }
+    void Restore(Options &opt) const {
+        opt.Ncell=Ncell;
+        opt.MinSize=MinSize;
+        opt.HaloMinSize=HaloMinSize;
+        opt.idenvflag=idenvflag;
+        opt.HaloSigmaV=HaloSigmaV;
+        opt.HaloLocalSigmaV=HaloLocalSigmaV;
+        opt.HaloVelDispScale=HaloVelDispScale;
+    }
+};
+
+///identifier and version of the local velocity density file written by \ref WriteLocalVelocityDensity
+#define LOCALDENMAGIC "VRLOCDEN"
+#define LOCALDENVERSION 2
+
+/*!
+    Header of a local velocity density file. It is followed by \ref LocalDenRecord entries sorted by particle id so that a file can be memory
+    mapped and densities found by id, allowing files written with a different number of mpi processes to be read (see \ref ReadLocalVelocityDensity).
+*/
+struct LocalDenHeader{
+    char magic[8];
+    int version;
+    ///parameters used to calculate the velocity density
+    int Nsearch, Nvel, iapprox, isingle, partsearchtype;
+    ///how neighbours are found (see \ref Options.iLocalVelDenBatchedNN and \ref Options.iLocalVelDenLeafCandidates)
+    int ibatched, ileafcand;
+    ///number of files written (ie: mpi processes) and index of this file
+    int numfiles, ifile;
+    ///number of particles in this file and in all files
+    long long nlocal, ntotal;
+
+    void SetParameters(Options &opt) {
+        memset(this,0,sizeof(LocalDenHeader));
+        memcpy(magic,LOCALDENMAGIC,8);
+        version=LOCALDENVERSION;
+        Nsearch=opt.Nsearch;
+        Nvel=opt.Nvel;
+        iapprox=opt.iLocalVelDenApproxCalcFlag;
+        isingle=opt.iLocalVelDenSinglePrecision;
+        partsearchtype=opt.partsearchtype;
+        ibatched=opt.iLocalVelDenBatchedNN;
+        ileafcand=opt.iLocalVelDenLeafCandidates;
+    }
+    bool SameParameters(const LocalDenHeader &h) const {
+        return (Nsearch==h.Nsearch && Nvel==h.Nvel && iapprox==h.iapprox && isingle==h.isingle && partsearchtype==h.partsearchtype &&
+            ibatched==h.ibatched && ileafcand==h.ileafcand);
+    }
+};
+///Local velocity density of a particle stored in a local velocity density file
+struct LocalDenRecord{
+    long long id;
+    double density;
+};
+
+///if the number of candidate neighbours of a leaf node exceeds this factor times the number of neighbours searched for, the tree is searched per particle instead
+#define NNLEAFBATCHMAXFAC 16
+///when finding neighbours in single precision, the densities of particles in one of this many leaf nodes are also calculated in double precision to report the accuracy
+#define NNSINGLECHECKSTRIDE 100
+///if the relative difference between the single and double precision velocity density of a checked particle exceeds this, its leaf node is recalculated in double precision
+#define NNSINGLEMAXDIFF 1e-3
+
+///Per-thread buffers used to find the nearest neighbours of particles in a leaf node from a single set of candidates (see \ref GetLeafNNCandidates)
+struct leaf_nn_buffer{
+    ///tree index of candidates
+    vector<Int_t> cand;
+    ///candidate positions relative to the leaf centre stored as structure of arrays
+    vector<Double_t> x, y, z;
+    ///squared distances to candidates
+    vector<Double_t> d2;
+    ///single precision candidate positions and squared distances, used if isingle
+    vector<float> xf, yf, zf, d2f;
+    bool isingle=false;
+    ///bounded max-heap of (squared distance, index) of the nearest neighbours
+    vector<pair<Double_t, Int_t> > heap;
+    ///centre of the leaf and radius about the centre containing the candidates
+    Coordinate cm;
+    Double_t radius;
+};
+
 ///if using MPI API
 #ifdef USEMPI
 #include <mpi.h>
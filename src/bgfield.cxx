@@ -74,68 +74,58 @@ private(i,vel) if (nbodies > ompsubsearchnum)
     return tree;
 }
 
-///Fills the GridCell struct using KD-Tree initialized by \ref InitializeTreeGrid
+///Fills the GridCell struct using KD-Tree initialized by \ref InitializeTreeGrid. Each leaf node is a cell and cells are filled in parallel.
 void FillTreeGrid(Options &opt, const Int_t nbodies, const Int_t ngrid, KDTree *&tree, Particle *Part, GridCell* &grid)
 //void FillTreeGrid(Options &opt, const Int_t nbodies, const Int_t ngrid, KDTree *tree, Particle *Part, GridCell* grid, PartCellNum *pglist)
 {
-    Int_t gridcount=0,ncount=0;
-    //this is used to create tree and search for near neighbours
-    Particle *ptemp=new Particle[ngrid];
+    Int_t i;
     int treetype=tree->GetTreeType();
     int ND;
     if (treetype==tree->TPHYS) ND=3;
     else if (treetype==tree->TPHS) ND=6;
+    vector<leaf_node_info> leafnodes;
 
     if (opt.iverbose>=2) cout<<"Filling KD-Tree Grid"<<endl;
 
-    //this loop works well for large cells but for small cells may have to replace this with a for loop which goes through every particle
-    //and stores nid and size of node, then builds grid based on these values and then places the particles in the cells.
     //for leaf nodes, use starts and ends indices (ie what particles in the system are in the node)
-    while (ncount<nbodies) {
-        //check if particle is within start and end, if not just means that splitting is not perfect
-        //and this particle is left alone. Go to the next particle
-        Node *np=(tree->FindLeafNode((Int_t)ncount));
-        Int_t start=((LeafNode*)np)->GetStart();
-        Int_t end=((LeafNode*)np)->GetEnd();
-        //this while loop ensures that if there is a particle out of place, one still proceeds to move through
-        //the tree appropriately.
-        while (!(ncount>=start&&ncount<end))
-        {
-            ncount++;
-            np=(tree->FindLeafNode((Int_t)ncount));
-            start=((LeafNode*)np)->GetStart();
-            end=((LeafNode*)np)->GetEnd();
-        }
-
-        grid[gridcount].ndim=ND;
+    GetLeafNodeRanges(tree, nbodies, leafnodes);
+#ifdef USEOPENMP
+#pragma omp parallel default(shared) \
+private(i) if (nbodies > ompsubsearchnum)
+{
+#pragma omp for schedule(dynamic)
+#endif
+    for (i=0;i<ngrid;i++) {
+        Node *np=tree->FindLeafNode(leafnodes[i].istart);
+        Int_t start=leafnodes[i].istart;
+        Int_t end=leafnodes[i].iend;
+        grid[i].ndim=ND;
         //get center of mass and boundaries of grid cell
         for (int j=0;j<ND;j++) {
-            grid[gridcount].xm[j]=0.;
-            grid[gridcount].xbl[j]=np->GetBoundary(j,0);
-            grid[gridcount].xbu[j]=np->GetBoundary(j,1);
+            grid[i].xm[j]=0.;
+            grid[i].xbl[j]=np->GetBoundary(j,0);
+            grid[i].xbu[j]=np->GetBoundary(j,1);
         }
-        grid[gridcount].nparts=np->GetCount();
-        grid[gridcount].gid=np->GetID();
-        grid[gridcount].nindex=new Int_t[grid[gridcount].nparts];
+        grid[i].nparts=end-start;
+        grid[i].gid=np->GetID();
+        grid[i].nindex=new Int_t[grid[i].nparts];
 
         Double_t mtot=0.;
         for (Int_t k=start,l=0;k<end;k++,l++){
-            Int_t id=Part[k].GetID();
-            grid[gridcount].nindex[l]=id;
+            grid[i].nindex[l]=Part[k].GetID();
             for (int j=0;j<ND;j++)
-                grid[gridcount].xm[j]+=Part[k].GetPosition(j)*Part[k].GetMass();
+                grid[i].xm[j]+=Part[k].GetPosition(j)*Part[k].GetMass();
             mtot+=Part[k].GetMass();
         }
-        grid[gridcount].mass=mtot;
-        ptemp[gridcount].SetMass(mtot);
+        grid[i].mass=mtot;
         mtot=1.0/mtot;
-        for (int j=0;j<ND;j++) grid[gridcount].xm[j]=grid[gridcount].xm[j]*mtot;
-        for (int j=0;j<ND;j++) ptemp[gridcount].SetPhase(j,grid[gridcount].xm[j]);
-        gridcount++; ncount=end;
+        for (int j=0;j<ND;j++) grid[i].xm[j]=grid[i].xm[j]*mtot;
     }
+#ifdef USEOPENMP
+}
+#endif
     //resets particle order
     delete tree;
-    delete[] ptemp;
     if (opt.iverbose>=2) cout<<"Done."<<endl;
 }
 
@@ -202,4 +192,55 @@ private(i,mtot) if (nbodies > ompsubsearchnum)
     return gveldisp;
 }
 
+/*!
+    Inverts the velocity dispersion tensors of cells in place using a Cholesky decomposition, which is cheaper and better behaved than a general
+    inverse for symmetric positive definite matrices. Tensors that are not positive definite (for instance cells with a single particle) are
+    inverted with the general \ref Matrix::Inverse as before.
+    \return number of tensors that were not positive definite
+*/
+Int_t InvertCellVelDisp(const Int_t ngrid, Matrix *gveldisp, bool runomp)
+{
+    Int_t i, nnotspd=0;
+    Double_t l00,l10,l20,l11,l21,l22,i00,i10,i20,i11,i21,i22;
+#ifdef USEOPENMP
+#pragma omp parallel for default(shared) \
+private(i,l00,l10,l20,l11,l21,l22,i00,i10,i20,i11,i21,i22) \
+reduction(+:nnotspd) schedule(static) if (runomp)
+#endif
+    for (i=0;i<ngrid;i++) {
+        Matrix &m=gveldisp[i];
+        //decompose m = L L^T
+        l00=m(0,0);
+        if (l00>0) {
+            l00=sqrt(l00);
+            l10=m(1,0)/l00;
+            l20=m(2,0)/l00;
+            l11=m(1,1)-l10*l10;
+        }
+        if (l00>0 && l11>0) {
+            l11=sqrt(l11);
+            l21=(m(2,1)-l20*l10)/l11;
+            l22=m(2,2)-l20*l20-l21*l21;
+        }
+        if (!(l00>0 && l11>0 && l22>0)) {
+            m=m.Inverse();
+            nnotspd++;
+            continue;
+        }
+        l22=sqrt(l22);
+        //invert L and then m^-1 = L^-T L^-1
+        i00=1.0/l00;i11=1.0/l11;i22=1.0/l22;
+        i10=-l10*i00*i11;
+        i21=-l21*i11*i22;
+        i20=-(l20*i00+l21*i10)*i22;
+        m(0,0)=i00*i00+i10*i10+i20*i20;
+        m(1,1)=i11*i11+i21*i21;
+        m(2,2)=i22*i22;
+        m(0,1)=m(1,0)=i10*i11+i20*i21;
+        m(0,2)=m(2,0)=i20*i22;
+        m(1,2)=m(2,1)=i21*i22;
+    }
+    return nnotspd;
+}
+
 //@}
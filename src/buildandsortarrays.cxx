@@ -7,96 +7,148 @@
 /// \name Simple group id based array building and group id reordering routines
 //@{
 
+/*!
+    Number of threads used when building group arrays. Arrays are built in parallel using per-thread group counts, so
+    serial building is used if there are too few particles or if the per-thread counts would use more memory than the particle based arrays.
+*/
+inline int GroupArrayNumThreads(const Int_t nbodies, const Int_t numgroups){
+    int nthreads=1;
+#ifdef USEOPENMP
+    if (nbodies > ompsortsize) {
+        nthreads=omp_get_max_threads();
+        if ((numgroups+1)*(Int_t)nthreads > nbodies) nthreads=max((Int_t)1,nbodies/(numgroups+1));
+    }
+#endif
+    return nthreads;
+}
+
+/*!
+    Counts the number of particles in each group, where groupid(i) returns the group of particle i (or 0 if the particle is not to be counted).
+    In parallel each thread counts its own particles and the counts are then summed.
+*/
+template<class GroupFunc> void CountGroupMembers(const Int_t nbodies, const Int_t numgroups, Int_t *numingroup, GroupFunc groupid)
+{
+    int nthreads=GroupArrayNumThreads(nbodies, numgroups);
+    for (Int_t i=0;i<=numgroups;i++) numingroup[i]=0;
+    if (nthreads==1) {
+        for (Int_t i=0;i<nbodies;i++) numingroup[groupid(i)]++;
+        numingroup[0]=0;
+        return;
+    }
+#ifdef USEOPENMP
+    vector<Int_t> counts((numgroups+1)*(Int_t)nthreads,0);
+#pragma omp parallel default(shared) num_threads(nthreads)
+    {
+    Int_t *c=&counts[(numgroups+1)*(Int_t)omp_get_thread_num()];
+#pragma omp for schedule(static)
+    for (Int_t i=0;i<nbodies;i++) c[groupid(i)]++;
+#pragma omp for schedule(static)
+    for (Int_t j=1;j<=numgroups;j++) for (int t=0;t<nthreads;t++) numingroup[j]+=counts[(numgroups+1)*(Int_t)t+j];
+    }
+#endif
+}
+
+/*!
+    Fills the group particle lists, storing value(i) for every particle i with groupid(i)>0 (groups without a list are ignored).
+    The order within each group is the order of the particles, as in a serial loop. In parallel, each thread counts the members of each group
+    in its (static) range of particles, which gives the offset at which each thread writes its members.
+    On return numingroup contains the number of particles stored in each group with a list.
+*/
+template<class GroupFunc, class ValueFunc> void FillPGList(const Int_t nbodies, const Int_t numgroups, Int_t *numingroup, Int_t **pglist,
+    GroupFunc groupid, ValueFunc value)
+{
+    int nthreads=GroupArrayNumThreads(nbodies, numgroups);
+    Int_t pid;
+    if (nthreads==1) {
+        for (Int_t i=1;i<=numgroups;i++) if (pglist[i]!=NULL) numingroup[i]=0;
+        for (Int_t i=0;i<nbodies;i++) {
+            pid = groupid(i);
+            if (pid == 0 || pglist[pid] == NULL) continue;
+            pglist[pid][numingroup[pid]++]=value(i);
+        }
+        return;
+    }
+#ifdef USEOPENMP
+    vector<Int_t> counts((numgroups+1)*(Int_t)nthreads,0);
+#pragma omp parallel default(shared) private(pid) num_threads(nthreads)
+    {
+    Int_t *c=&counts[(numgroups+1)*(Int_t)omp_get_thread_num()];
+#pragma omp for schedule(static)
+    for (Int_t i=0;i<nbodies;i++) {
+        pid = groupid(i);
+        if (pid == 0 || pglist[pid] == NULL) continue;
+        c[pid]++;
+    }
+    //convert counts to per thread offsets
+#pragma omp for schedule(static)
+    for (Int_t j=1;j<=numgroups;j++) {
+        if (pglist[j] == NULL) continue;
+        Int_t offset=0, n;
+        for (int t=0;t<nthreads;t++) {
+            n=counts[(numgroups+1)*(Int_t)t+j];
+            counts[(numgroups+1)*(Int_t)t+j]=offset;
+            offset+=n;
+        }
+        numingroup[j]=offset;
+    }
+    //same static schedule so threads process the same particles
+#pragma omp for schedule(static)
+    for (Int_t i=0;i<nbodies;i++) {
+        pid = groupid(i);
+        if (pid == 0 || pglist[pid] == NULL) continue;
+        pglist[pid][c[pid]++]=value(i);
+    }
+    }
+#endif
+}
+
+///allocate the group particle index lists based on the number in each group
+inline Int_t **AllocatePGList(const Int_t numgroups, Int_t *numingroup){
+    Int_t **pglist=new Int_t*[numgroups+1];
+    pglist[0]=NULL;
+    for (Int_t i=1;i<=numgroups;i++) {
+        pglist[i] = NULL;
+        if (numingroup[i]<=0) continue;
+        pglist[i]=new Int_t[numingroup[i]];
+    }
+    return pglist;
+}
+
 ///build group size array
 Int_t *BuildNumInGroup(const Int_t nbodies, const Int_t numgroups, Int_t *pfof){
     Int_t *numingroup=new Int_t[numgroups+1];
-    for (Int_t i=0;i<=numgroups;i++) numingroup[i]=0;
-    for (Int_t i=0;i<nbodies;i++) if (pfof[i]>0) numingroup[pfof[i]]++;
+    CountGroupMembers(nbodies, numgroups, numingroup, [pfof](Int_t i){return pfof[i];});
     return numingroup;
 }
 ///build group size array for specific type
 Int_t *BuildNumInGroupTyped(const Int_t nbodies, const Int_t numgroups, Int_t *pfof, Particle *P, int type){
     Int_t *numingroup=new Int_t[numgroups+1];
-    for (Int_t i=0;i<=numgroups;i++) numingroup[i]=0;
-    for (Int_t i=0;i<nbodies;i++) if (pfof[i]>0 && P[i].GetType()==type) numingroup[pfof[i]]++;
+    CountGroupMembers(nbodies, numgroups, numingroup, [pfof,P,type](Int_t i){return pfof[i]*(P[i].GetType()==type);});
     return numingroup;
 }
 
 ///build the group particle index list (assumes particles are in ID order)
 Int_t **BuildPGList(const Int_t nbodies, const Int_t numgroups, Int_t *numingroup, Int_t *pfof){
-    Int_t **pglist=new Int_t*[numgroups+1];
-    Int_t pid;
-    pglist[0]=NULL;
-    for (Int_t i=1;i<=numgroups;i++) {
-        pglist[i] = NULL;
-        if (numingroup[i]<=0) continue;
-        pglist[i]=new Int_t[numingroup[i]];
-        numingroup[i]=0;
-    }
-    for (Int_t i=0;i<nbodies;i++) {
-        pid = pfof[i];
-        if (pid == 0) continue;
-        if (numingroup[pid]<0) continue;
-        pglist[pid][numingroup[pid]++]=i;
-    }
+    Int_t **pglist=AllocatePGList(numgroups, numingroup);
+    FillPGList(nbodies, numgroups, numingroup, pglist, [pfof](Int_t i){return pfof[i];}, [](Int_t i){return i;});
     return pglist;
 }
 ///build the group particle index list for particles of a specific type (assumes particles are in ID order)
 Int_t **BuildPGListTyped(const Int_t nbodies, const Int_t numgroups, Int_t *numingroup, Int_t *pfof, Particle *P, int type){
-    Int_t **pglist=new Int_t*[numgroups+1];
-    Int_t pid;
-    pglist[0]=NULL;
-    for (Int_t i=1;i<=numgroups;i++) {
-        pglist[i] = NULL;
-        if (numingroup[i]<=0) continue;
-        pglist[i]=new Int_t[numingroup[i]];
-        numingroup[i]=0;
-    }
-    for (Int_t i=0;i<nbodies;i++) {
-        pid = pfof[i];
-        if (pid == 0 || P[i].GetType() != type) continue;
-        if (numingroup[pid]<0) continue;
-        pglist[pid][numingroup[pid]++]=i;
-    }
+    Int_t **pglist=AllocatePGList(numgroups, numingroup);
+    FillPGList(nbodies, numgroups, numingroup, pglist, [pfof,P,type](Int_t i){return pfof[i]*(P[i].GetType()==type);}, [](Int_t i){return i;});
     return pglist;
 }
 ///build the group particle index list (doesn't assume particles are in ID order and stores index of particle)
 Int_t **BuildPGList(const Int_t nbodies, const Int_t numgroups, Int_t *numingroup, Int_t *pfof, Particle *Part){
-    Int_t **pglist=new Int_t*[numgroups+1];
-    Int_t pid, index;
-    pglist[0]=NULL;
-    for (Int_t i=1;i<=numgroups;i++) {
-        pglist[i] = NULL;
-        if (numingroup[i]<=0) continue;
-        pglist[i]=new Int_t[numingroup[i]];
-        numingroup[i]=0;
-    }
-    for (Int_t i=0;i<nbodies;i++) {
-        index = Part[i].GetID();
-        pid = pfof[index];
-        if (pid == 0) continue;
-        if (numingroup[pid]<0) continue;
-        pglist[pid][numingroup[pid]++]=i;
-    }
+    Int_t **pglist=AllocatePGList(numgroups, numingroup);
+    FillPGList(nbodies, numgroups, numingroup, pglist, [pfof,Part](Int_t i){return pfof[Part[i].GetID()];}, [](Int_t i){return i;});
     return pglist;
 }
 ///build the group particle index list (doesn't assumes particles are in ID order)
 Int_t **BuildPGList(const Int_t nbodies, const Int_t numgroups, Int_t *numingroup, Int_t *pfof, Int_t *ids){
-    Int_t **pglist=new Int_t*[numgroups+1];
-    Int_t pid;
-    pglist[0]=NULL;
-    for (Int_t i=1;i<=numgroups;i++) {
-        pglist[i] = NULL;
-        if (numingroup[i]<=0) continue;
-        pglist[i]=new Int_t[numingroup[i]];
-        numingroup[i]=0;
-    }
-    for (Int_t i=0;i<nbodies;i++) {
-        pid = pfof[i];
-        if (pid == 0) continue;
-        if (numingroup[pid]<0) continue;
-        pglist[pid][numingroup[pid]++]=ids[i];
-    }
+    Int_t **pglist=AllocatePGList(numgroups, numingroup);
+    FillPGList(nbodies, numgroups, numingroup, pglist, [pfof](Int_t i){return pfof[i];}, [ids](Int_t i){return ids[i];});
     return pglist;
 }
 ///build the Head array which points to the head of the group a particle belongs to
@@ -191,6 +243,27 @@ Particle *BuildPart(Int_t numingroup, Int_t *pglist, Particle* Part,
     return gPart;
 }
 
+///fill a particle list subset using array of indices, copying only the quantities used when searching for substructure so that
+///hydro, star, black hole and extra dark matter properties are neither copied nor allocated
+void FillPartLean(Int_t numingroup, Int_t *pglist, Particle *Part, Particle *gPart)
+{
+    for (auto j=0;j<numingroup;j++) {
+        Particle &p=Part[pglist[j]];
+        gPart[j]=Particle(p.GetMass(),
+            p.GetPosition(0),p.GetPosition(1),p.GetPosition(2),
+            p.GetVelocity(0),p.GetVelocity(1),p.GetVelocity(2),
+            p.GetID());
+        gPart[j].SetPID(p.GetPID());
+        gPart[j].SetType(p.GetType());
+        gPart[j].SetDensity(p.GetDensity());
+        gPart[j].SetPotential(p.GetPotential());
+#ifdef GASON
+        gPart[j].SetU(p.GetU());
+        gPart[j].SetSPHDen(p.GetSPHDen());
+#endif
+    }
+}
+
 ///sort particles according to some quantity which is stored in particle type and build an array for a sorted particle list
 ///remember this reorders the particle array!
 Int_t *BuildNoffset(const Int_t nbodies, Particle *Part, Int_t numgroups,Int_t *numingroup, Int_t *sortval, Int_t ioffset) {
@@ -212,27 +285,44 @@ Int_t *BuildNoffset(const Int_t nbodies, Particle *Part, Int_t numgroups,Int_t *
 ///reorder groups from largest to smallest
 ///\todo must alter so that after pfof is reorderd, so is numingroup array and pglist so that do not have to reconstruct this list
 ///after reordering if numgroups==newnumgroups (ie, list has not shrunk)
+///The order of the groups is determined serially and the group ids are then updated in parallel if there are many particles in groups.
 void ReorderGroupIDs(const Int_t numgroups, const Int_t newnumgroups, Int_t *numingroup, Int_t *pfof, Int_t **pglist)
 {
     PriorityQueue *pq=new PriorityQueue(newnumgroups);
-    Int_t groupid,size;
+    vector<Int_t> groupid(newnumgroups+1), size(newnumgroups+1);
+    Int_t ntot=0;
     for (Int_t i = 1; i <=numgroups; i++) if (numingroup[i]>0) pq->Push(i, numingroup[i]);
     for (Int_t i = 1; i<=newnumgroups; i++) {
-        groupid=pq->TopQueue();size=pq->TopPriority();pq->Pop();
-        for (Int_t j=0;j<size;j++) pfof[pglist[groupid][j]]=i;
+        groupid[i]=pq->TopQueue();size[i]=pq->TopPriority();pq->Pop();
+        ntot+=size[i];
     }
     delete pq;
+#ifdef USEOPENMP
+#pragma omp parallel for \
+default(shared) schedule(dynamic) if (ntot > ompsortsize)
+#endif
+    for (Int_t i = 1; i<=newnumgroups; i++) {
+        for (Int_t j=0;j<size[i];j++) pfof[pglist[groupid[i]][j]]=i;
+    }
 }
 void ReorderGroupIDs(const Int_t numgroups, const Int_t newnumgroups, Int_t *numingroup, Int_t *pfof, Int_t **pglist, Particle *Partsubset)
 {
     PriorityQueue *pq=new PriorityQueue(newnumgroups);
-    Int_t groupid,size;
+    vector<Int_t> groupid(newnumgroups+1), size(newnumgroups+1);
+    Int_t ntot=0;
     for (Int_t i = 1; i <=numgroups; i++) if (numingroup[i]>0) pq->Push(i, numingroup[i]);
     for (Int_t i = 1; i<=newnumgroups; i++) {
-        groupid=pq->TopQueue();size=pq->TopPriority();pq->Pop();
-        for (Int_t j=0;j<size;j++) pfof[Partsubset[pglist[groupid][j]].GetID()]=i;
+        groupid[i]=pq->TopQueue();size[i]=pq->TopPriority();pq->Pop();
+        ntot+=size[i];
     }
     delete pq;
+#ifdef USEOPENMP
+#pragma omp parallel for \
+default(shared) schedule(dynamic) if (ntot > ompsortsize)
+#endif
+    for (Int_t i = 1; i<=newnumgroups; i++) {
+        for (Int_t j=0;j<size[i];j++) pfof[Partsubset[pglist[groupid[i]][j]].GetID()]=i;
+    }
 }
 
 ///similar to \ref ReorderGroupIDs but weight by value
@@ -327,3 +417,86 @@ void ReorderGroupIDsAndHaloDatabyValue(const Int_t numgroups, const Int_t newnum
     delete[] ptemp;
 }
 //@}
+
+/// \name Routines that reorder the particle array in memory
+//@{
+
+///spread the lower 21 bits of a value so that there are two empty bits between each bit, used to interleave coordinates
+inline unsigned long long MortonSpreadBits(unsigned long long x)
+{
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffffULL;
+    x = (x | x << 16) & 0x1f0000ff0000ffULL;
+    x = (x | x << 8) & 0x100f00f00f00f00fULL;
+    x = (x | x << 4) & 0x10c30c30c30c30c3ULL;
+    x = (x | x << 2) & 0x1249249249249249ULL;
+    return x;
+}
+
+/*!
+    Sort particles according to their Morton (Z-order) key so that particles close in space are also close in memory.
+    Keys are 21 bits per dimension, based on the periodic box if periodic, otherwise on the bounding box of the particles.
+    Particles are permuted in place following the cycles of the sorted index so only the keys and indices need extra memory.
+    Particle ids are reset to their new index so afterwards particles are in "index order".
+    remember this reorders the particle array!
+*/
+void SortParticlesByMortonKey(Options &opt, const Int_t nbodies, Particle *Part)
+{
+    if (nbodies<=1) return;
+    Int_t i;
+    Double_t xmin[3],xmax[3],scale[3];
+    const Double_t keymax=(Double_t)((1<<21)-1);
+    vector<pair<unsigned long long, Int_t> > keys(nbodies);
+    vector<bool> imoved(nbodies,false);
+    Particle ptemp;
+
+    if (opt.p>0) {
+        for (int j=0;j<3;j++) {xmin[j]=0;xmax[j]=opt.p;}
+    }
+    else {
+        for (int j=0;j<3;j++) xmin[j]=xmax[j]=Part[0].GetPosition(j);
+        for (i=1;i<nbodies;i++) {
+            for (int j=0;j<3;j++) {
+                if (Part[i].GetPosition(j)<xmin[j]) xmin[j]=Part[i].GetPosition(j);
+                if (Part[i].GetPosition(j)>xmax[j]) xmax[j]=Part[i].GetPosition(j);
+            }
+        }
+    }
+    for (int j=0;j<3;j++) scale[j]=(xmax[j]>xmin[j])?keymax/(xmax[j]-xmin[j]):0.;
+
+#ifdef USEOPENMP
+#pragma omp parallel for \
+default(shared) private(i) schedule(static) if (nbodies > ompsortsize)
+#endif
+    for (i=0;i<nbodies;i++) {
+        unsigned long long key=0, ix;
+        Double_t x;
+        for (int j=0;j<3;j++) {
+            x=(Part[i].GetPosition(j)-xmin[j])*scale[j];
+            //particles outside periodic box are placed at the edges
+            if (x<0) x=0;
+            else if (x>keymax) x=keymax;
+            ix=(unsigned long long)x;
+            key|=MortonSpreadBits(ix)<<j;
+        }
+        keys[i]=make_pair(key,i);
+    }
+    sort(keys.begin(), keys.end());
+
+    //now permute particles in place, keys[i].second is the current index of the particle that should be at i
+    for (i=0;i<nbodies;i++) {
+        if (imoved[i]) continue;
+        if (keys[i].second==i) {imoved[i]=true;continue;}
+        ptemp=Part[i];
+        Int_t j=i,k;
+        while (true) {
+            k=keys[j].second;
+            imoved[j]=true;
+            if (k==i) {Part[j]=ptemp;break;}
+            Part[j]=Part[k];
+            j=k;
+        }
+    }
+    for (i=0;i<nbodies;i++) Part[i].SetID(i);
+}
+//@}
@@ -16,6 +16,8 @@
 #ifdef USEXDR
 #endif
 #include "nchiladaitems.h"
+#include <fcntl.h>
+#include <sys/mman.h>
 #ifdef USEADIOS
 #include "adios.h"
 #endif
@@ -185,40 +187,120 @@ void AdjustBHQuantities(Options &opt, vector<Particle> &Part, const Int_t nbodie
 ///\name Read STF data files
 //@{
 
-///Read local velocity density
-void ReadLocalVelocityDensity(Options &opt, const Int_t nbodies, vector<Particle> &Part){
-    Int_t tempi;
-    Double_t tempd;
-    fstream Fin;
-    char fname[1000];
-    //set filename appropriate to mpi thread if necessary
+///Memory maps a local velocity density file written by \ref WriteLocalVelocityDensity, returning NULL if it cannot be mapped or is not a valid file.
+///On success, header is copied from the file and the mapping must be released with munmap(map,maplength)
+LocalDenRecord *MapLocalVelocityDensityFile(const char *fname, LocalDenHeader &header, void *&map, size_t &maplength){
+    int fd;
+    struct stat st;
+    fd=open(fname,O_RDONLY);
+    if (fd<0) return NULL;
+    if (fstat(fd,&st)!=0 || st.st_size<(off_t)sizeof(LocalDenHeader)) {close(fd);return NULL;}
+    maplength=st.st_size;
+    map=mmap(NULL,maplength,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if (map==MAP_FAILED) return NULL;
+    memcpy(&header,map,sizeof(LocalDenHeader));
+    if (memcmp(header.magic,LOCALDENMAGIC,8)!=0 || header.version!=LOCALDENVERSION || header.nlocal<0 ||
+        maplength!=sizeof(LocalDenHeader)+(size_t)header.nlocal*sizeof(LocalDenRecord)) {
+        munmap(map,maplength);
+        return NULL;
+    }
+    return (LocalDenRecord*)((char*)map+sizeof(LocalDenHeader));
+}
+
+/*!
+    Read local velocity density. Files store (id, density) records sorted by particle id along with the parameters used to calculate the densities
+    and the number of files written. Densities are only read if the parameters and total number of particles match. Each file is memory mapped and
+    densities are found by id, starting with the file written by this task so that if the mpi decomposition is unchanged only that file is accessed.
+    \return whether densities of all particles were read. If not, the densities must be calculated.
+*/
+bool ReadLocalVelocityDensity(Options &opt, const Int_t nbodies, vector<Particle> &Part){
+    char fname[1000], fbase[1000];
+    LocalDenHeader header, refheader;
+    LocalDenRecord *records, *rstart;
+    void *map;
+    size_t maplength;
+    int numfiles=0, iflag=1, ifile, isuffix;
+    long long ntotal=nbodies;
+    vector<pair<long long, Int_t> > pids;
+    Int_t nleft;
+
+    refheader.SetParameters(opt);
 #ifdef USEMPI
-    sprintf(fname,"%s.%d",opt.smname,ThisTask);
-#else
-    sprintf(fname,"%s",opt.smname);
+    MPI_Allreduce(MPI_IN_PLACE,&ntotal,1,MPI_LONG_LONG,MPI_SUM,MPI_COMM_WORLD);
 #endif
+    //files written by more than one process have the file index appended
+    sprintf(fbase,"%s.0",opt.smname);
+    isuffix=FileExists(fbase);
+    if (isuffix==0) sprintf(fbase,"%s",opt.smname);
 
-    cout<<"Reading smooth density data from "<<fname<<endl;
-    if (opt.ibinaryout==OUTBINARY) {
-        Fin.open(fname,ios::in| ios::binary);
-        Fin.read((char*)&tempi,sizeof(Int_t));
-        if (tempi!=nbodies) {
-            cerr<<"File "<<fname<<" contains incorrect number of particles. Exiting\n";
-            exit(9);
-        }
-        for(Int_t i=0;i<nbodies;i++) {Fin.read((char*)&tempd,sizeof(Double_t));Part[i].SetDensity(tempd);}
-    }
+    if (FileExists(fbase)==false) iflag=0;
     else {
-        Fin.open(fname,ios::in);
-        Fin>>tempi;
-        if (tempi!=nbodies) {
-            cerr<<"File "<<fname<<" contains incorrect number of particles. Exiting\n";
-            exit(9);
+        cout<<"Reading smooth density data from "<<fbase<<endl;
+        records=MapLocalVelocityDensityFile(fbase,header,map,maplength);
+        if (records==NULL) {
+            cerr<<"WARNING: "<<fbase<<" is not a valid local velocity density file of version "<<LOCALDENVERSION<<". Densities will be recalculated"<<endl;
+            iflag=0;
+        }
+        else {
+            munmap(map,maplength);
+            numfiles=header.numfiles;
+            if (refheader.SameParameters(header)==false) {
+                cerr<<"WARNING: "<<fbase<<" was calculated with different parameters (Nsearch, Nvel, approximation, neighbour search, precision or particle type). Densities will be recalculated"<<endl;
+                iflag=0;
+            }
+            else if (header.ntotal!=ntotal) {
+                cerr<<"WARNING: "<<fbase<<" contains "<<header.ntotal<<" particles rather than "<<ntotal<<". Densities will be recalculated"<<endl;
+                iflag=0;
+            }
+            else if ((numfiles>1 && isuffix==0) || numfiles<1) iflag=0;
         }
-        for(Int_t i=0;i<nbodies;i++) {Fin>>tempd;Part[i].SetDensity(tempd);}
     }
-    cout<<"Done"<<endl;
-    Fin.close();
+#ifdef USEMPI
+    MPI_Allreduce(MPI_IN_PLACE,&iflag,1,MPI_INT,MPI_MIN,MPI_COMM_WORLD);
+#endif
+    if (iflag==0) return false;
+
+    //find densities by id, keeping a sorted list of particles yet to be found
+    pids.resize(nbodies);
+    for (Int_t i=0;i<nbodies;i++) pids[i]=make_pair((long long)Part[i].GetPID(),i);
+    sort(pids.begin(),pids.end());
+    nleft=nbodies;
+    for (int k=0;k<numfiles && nleft>0;k++) {
+#ifdef USEMPI
+        ifile=(ThisTask+k)%numfiles;
+#else
+        ifile=k;
+#endif
+        if (isuffix) sprintf(fname,"%s.%d",opt.smname,ifile);
+        else sprintf(fname,"%s",opt.smname);
+        records=MapLocalVelocityDensityFile(fname,header,map,maplength);
+        if (records==NULL || refheader.SameParameters(header)==false || header.numfiles!=numfiles) {
+            if (records!=NULL) munmap(map,maplength);
+            cerr<<"WARNING: "<<fname<<" is missing or inconsistent with the other local velocity density files"<<endl;
+            break;
+        }
+        rstart=records;
+        Int_t nkeep=0;
+        for (Int_t i=0;i<nleft;i++) {
+            //as ids are sorted, search from the last match
+            rstart=lower_bound(rstart,records+header.nlocal,pids[i].first,
+                [](const LocalDenRecord &r, long long id){return r.id<id;});
+            if (rstart!=records+header.nlocal && rstart->id==pids[i].first) Part[pids[i].second].SetDensity(rstart->density);
+            else pids[nkeep++]=pids[i];
+        }
+        nleft=nkeep;
+        munmap(map,maplength);
+    }
+    if (nleft>0) {
+        cerr<<"WARNING: densities of "<<nleft<<" particles not found in local velocity density files. Densities will be recalculated"<<endl;
+        iflag=0;
+    }
+#ifdef USEMPI
+    MPI_Allreduce(MPI_IN_PLACE,&iflag,1,MPI_INT,MPI_MIN,MPI_COMM_WORLD);
+#endif
+    if (iflag) cout<<"Done"<<endl;
+    return (iflag==1);
 }
 
 //@}
@@ -226,29 +308,40 @@ void ReadLocalVelocityDensity(Options &opt, const Int_t nbodies, vector<Particle
 /// \name Write STF data files for intermediate steps
 //@{
 
-///Writes local velocity density of each particle to a file
+///Writes local velocity density of each particle to a file as (id, density) records sorted by id, preceded by a \ref LocalDenHeader
 void WriteLocalVelocityDensity(Options &opt, const Int_t nbodies, vector<Particle> &Part){
     fstream Fout;
     char fname[1000];
+    LocalDenHeader header;
+    vector<LocalDenRecord> records(nbodies);
+    long long ntotal=nbodies;
 #ifdef USEMPI
     if(opt.smname==NULL) sprintf(fname,"%s.smdata.%d",opt.outname,ThisTask);
     else sprintf(fname,"%s.%d",opt.smname,ThisTask);
+    MPI_Allreduce(MPI_IN_PLACE,&ntotal,1,MPI_LONG_LONG,MPI_SUM,MPI_COMM_WORLD);
 #else
     if(opt.smname==NULL) sprintf(fname,"%s.smdata",opt.outname);
     else sprintf(fname,"%s",opt.smname);
 #endif
-    if (opt.ibinaryout==OUTBINARY) {
-        Fout.open(fname,ios::out|ios::binary);
-        Fout.write((char*)&nbodies,sizeof(Int_t));
-        Double_t tempd;
-        for(Int_t i=0;i<nbodies;i++) {tempd=Part[i].GetDensity();Fout.write((char*)&tempd,sizeof(Double_t));}
-    }
-    if (opt.ibinaryout==OUTBINARY) {
-        Fout.open(fname,ios::out);
-        Fout<<nbodies<<endl;
-        Fout<<scientific<<setprecision(10);
-        for(Int_t i=0;i<nbodies;i++)Fout<<Part[i].GetDensity()<<endl;
+    header.SetParameters(opt);
+#ifdef USEMPI
+    header.numfiles=NProcs;
+    header.ifile=ThisTask;
+#else
+    header.numfiles=1;
+    header.ifile=0;
+#endif
+    header.nlocal=nbodies;
+    header.ntotal=ntotal;
+    //stored by id as particles may still be in the order of a tree kept for reuse and may be distributed differently when read
+    for(Int_t i=0;i<nbodies;i++) {
+        records[i].id=Part[i].GetPID();
+        records[i].density=Part[i].GetDensity();
     }
+    sort(records.begin(),records.end(),[](const LocalDenRecord &a, const LocalDenRecord &b){return a.id<b.id;});
+    Fout.open(fname,ios::out|ios::binary);
+    Fout.write((char*)&header,sizeof(LocalDenHeader));
+    Fout.write((char*)records.data(),sizeof(LocalDenRecord)*nbodies);
     Fout.close();
 }
 
@@ -261,9 +354,14 @@ void WriteLocalVelocityDensity(Options &opt, const Int_t nbodies, vector<Particl
     group zero is untagged particles. \n
 */
 void WriteFOF(Options &opt, const Int_t nbodies, Int_t *pfof){
-    fstream Fout;
     char fname[1000];
     sprintf(fname,"%s.fof.grp",opt.outname);
+    WriteFOF(opt, nbodies, pfof, fname);
+}
+
+///Writes a tipsy style group array to the file fname
+void WriteFOF(Options &opt, const Int_t nbodies, Int_t *pfof, const char *fname){
+    fstream Fout;
     cout<<"saving fof data to "<<fname<<endl;
     Fout.open(fname,ios::out);
     if (opt.partsearchtype==PSTALL) {
@@ -5,7 +5,116 @@
 
 #include "stf.h"
 
+///Calculates the log ratio of the velocity density of a particle to that expected from the background interpolated from the nearest grid cells
+///using inverse distance weighting (Shepard's method). nn are the tree indices of the cells in ptemp and dist the squared distances, which are altered.
+inline void CalcDenVRatioFromCells(Options &opt, Particle &p, Int_t *nn, Double_t *dist, Particle *ptemp, Coordinate *gvel, Matrix *gveldisp, Double_t norm)
+{
+    Double_t w,wsum,maxdist,sv,vsv,fbg,tempdenv;
+    Coordinate vp,vmweighted;
+    Matrix isvweighted;
+    tempdenv=p.GetDensity()/opt.Nsearch;
+    fbg=0.;
+    wsum=0.;
+    maxdist=0.;
+    vmweighted[0]=vmweighted[1]=vmweighted[2]=0.;
+    for (int j=0;j<3;j++) for (int k=0;k<3;k++) isvweighted(j,k)=0.0;
+    for (int j=0;j<=MAXNGRID;j++) {
+       dist[j]=sqrt(dist[j]+1e-16);
+       if (dist[j]>maxdist)maxdist=dist[j];
+    }
+    for (int j=0;j<=MAXNGRID;j++) {
+        w=(maxdist-dist[j])/(maxdist*dist[j]);w=w*w;
+        //w=1.0/dist[j];
+        wsum+=w;
+        vmweighted=vmweighted+gvel[ptemp[nn[j]].GetID()]*w;
+        isvweighted=isvweighted+gveldisp[ptemp[nn[j]].GetID()]*w;
+    }
+    vmweighted=vmweighted*(1.0/wsum);
+    isvweighted=isvweighted*(1.0/wsum);
+    sv=sqrt(abs(isvweighted.Det()));
+    for (int m=0;m<3;m++) vp[m]=p.GetVelocity(m)-vmweighted[m];
+    vsv=0.;for (int m=0;m<3;m++) for (int n=0;n<3;n++) vsv+=vp[m]*vp[n]*isvweighted(m,n);
+    fbg=log(sv)-0.5*vsv;
+    p.SetPotential(log(tempdenv)-log(norm)-fbg);
+}
+
+#ifdef USEMPI
+/*! Determines the box (lower and upper bounds for each dimension) that contains the MAXNGRID+1 nearest grid cells across all mpi processes
+    of every local particle. The distance to the nearest local cells bounds the distance to the nearest cells overall, so the nearest cells of a
+    particle in a local cell lie within \f$ R_k+2d \f$ of the cell centre (see \ref GetDenVRatio). Particles not in a local cell are bounded individually.
+*/
+void GetDenVRatioGridRequest(const Int_t nbodies, Particle *Part, const Int_t nlocalgrid, vector<Int_t> &celloffset, vector<Int_t> &cellparts,
+    vector<Coordinate> &cellxm, Double_t xreq[6])
+{
+    Int_t i;
+    const int nngrid=MAXNGRID+1;
+    Double_t x0=MAXVALUE,y0=MAXVALUE,z0=MAXVALUE,x1=-MAXVALUE,y1=-MAXVALUE,z1=-MAXVALUE;
+    Particle *ptemp;
+    KDTree *tree;
+    vector<char> iincell(nbodies,0);
+
+    //without enough local cells, all cells are needed
+    if (nlocalgrid<nngrid) {
+        for (int k=0;k<3;k++) {xreq[2*k]=-MAXVALUE;xreq[2*k+1]=MAXVALUE;}
+        return;
+    }
+    ptemp=new Particle[nlocalgrid];
+    for (i=0;i<nlocalgrid;i++) ptemp[i]=Particle(1.0,cellxm[i][0],cellxm[i][1],cellxm[i][2],0.0,0.0,0.0,i);
+    tree=new KDTree(ptemp,nlocalgrid,1,tree->TPHYS, tree->KEPAN,100,0,0,0,NULL,NULL,false);
+    for (i=0;i<celloffset[nlocalgrid];i++) iincell[cellparts[i]]=1;
+#ifdef USEOPENMP
+#pragma omp parallel default(shared) \
+private(i) if (nbodies > ompsubsearchnum)
+{
+#endif
+    Int_t nn[nngrid];
+    Double_t dist[nngrid], r, r2;
+    Coordinate xc;
+#ifdef USEOPENMP
+#pragma omp for schedule(dynamic) reduction(min:x0,y0,z0) reduction(max:x1,y1,z1)
+#endif
+    for (i=0;i<nlocalgrid+nbodies;i++)
+    {
+        if (i<nlocalgrid) {
+            if (celloffset[i+1]==celloffset[i]) continue;
+            xc=cellxm[i];
+            tree->FindNearestPos(xc,nn,dist,nngrid);
+            r=0;
+            for (Int_t j=celloffset[i];j<celloffset[i+1];j++) {
+                r2=0;
+                for (int k=0;k<3;k++) r2+=(Part[cellparts[j]].GetPosition(k)-xc[k])*(Part[cellparts[j]].GetPosition(k)-xc[k]);
+                if (r2>r) r=r2;
+            }
+            r=sqrt(dist[nngrid-1])+2.0*sqrt(r);
+        }
+        else {
+            if (iincell[i-nlocalgrid]) continue;
+            xc=Coordinate(Part[i-nlocalgrid].GetPosition());
+            tree->FindNearestPos(xc,nn,dist,nngrid);
+            r=sqrt(dist[nngrid-1]);
+        }
+        if (xc[0]-r<x0) x0=xc[0]-r;
+        if (xc[1]-r<y0) y0=xc[1]-r;
+        if (xc[2]-r<z0) z0=xc[2]-r;
+        if (xc[0]+r>x1) x1=xc[0]+r;
+        if (xc[1]+r>y1) y1=xc[1]+r;
+        if (xc[2]+r>z1) z1=xc[2]+r;
+    }
+#ifdef USEOPENMP
+}
+#endif
+    xreq[0]=x0;xreq[1]=x1;
+    xreq[2]=y0;xreq[3]=y1;
+    xreq[4]=z0;xreq[5]=z1;
+    delete tree;
+    delete[] ptemp;
+}
+#endif
+
 /*! This calculates the logarithmic ratio of the measured velocity density and the expected velocity density assuming a bg muiltivariate gaussian distribution
+    The nearest cells of all particles in a (local) cell are found from a single set of candidate cells, those within \f$ R_k+2d \f$ of the cell centre,
+    where \f$ R_k \f$ is the distance to the centre's MAXNGRID+1 nearest cell and \f$ d \f$ the largest distance of a particle from the centre.
+    This contains the nearest cells of every particle in the cell so the result is the same as searching the grid tree for each particle.
     \todo must adjust interpolation scheme so that if NN has cells in a neighbouring MPI domain, the information is stored locally. This may require a rewrite
     of the grid cell structure or the near neighbour list so that if grid cell has NN in another processor, actually physically store the information cm, cmvel, veldisp
     locally to that grid cell. Another option is to determine all cells that are NN of a cell in another mpi's domain, build a grid export list that contains the relevant information
@@ -14,37 +123,56 @@
 void GetDenVRatio(Options &opt, const Int_t nbodies, Particle *Part, Int_t ngrid, GridCell *grid, Coordinate *gvel, Matrix *gveldisp)
 {
     Int_t i;
-    int nthreads,tid;
 #ifndef USEMPI
     int ThisTask=0;
 #endif
-    Double_t **dist;
     Double_t norm=pow(2.0*M_PI,-1.5);
-    Int_t **nn;
-
-    Double_t w,wsum,maxdist,sv,vsv,fbg,tempdenv;
-    Coordinate vp,vmweighted;
-    Matrix isvweighted;
     Particle *ptemp;
     KDTree *tree;
+    bool runomp=(nbodies > ompsubsearchnum);
+    const int nngrid=MAXNGRID+1;
+    Int_t nlocalgrid=ngrid, nnotspd;
+    vector<Int_t> celloffset, cellparts;
+    vector<Coordinate> cellxm;
+    vector<char> idone;
 
     if (opt.iverbose>=2) cout<<ThisTask<<" Now calculate denvratios using grid"<<endl;
     //take inverse for interpolation
-#ifdef USEOPENMP
-#pragma omp parallel default(shared) \
-private(i) if (nbodies > ompsubsearchnum)
-{
-#pragma omp for schedule(static)
-#endif
-    for (i=0;i<ngrid;i++) gveldisp[i]=gveldisp[i].Inverse();
-#ifdef USEOPENMP
-}
-#endif
+    nnotspd=InvertCellVelDisp(ngrid,gveldisp,runomp);
+    if (opt.iverbose>=2 && nnotspd>0) cout<<ThisTask<<" "<<nnotspd<<" of "<<ngrid<<" cell dispersion tensors are not positive definite"<<endl;
+
+    //store the particles in each local cell so that the nearest cells can be found per cell
+    celloffset.resize(nlocalgrid+1);
+    cellxm.resize(nlocalgrid);
+    celloffset[0]=0;
+    for (i=0;i<nlocalgrid;i++) {
+        celloffset[i+1]=celloffset[i]+grid[i].nparts;
+        cellxm[i]=Coordinate(grid[i].xm);
+    }
+    cellparts.resize(celloffset[nlocalgrid]);
+    for (i=0;i<nlocalgrid;i++) for (Int_t j=0;j<grid[i].nparts;j++) cellparts[celloffset[i]+j]=grid[i].nindex[j];
 
     //build grid tree so that one can find nearest cells for each particle
-    //if using MPI since number of cells is far fewer than number of particles, simple gather collect all the data so that each processor has access to it
+    //if using MPI, either exchange the cells neighbouring the local particles or, since number of cells is far fewer than number of particles,
+    //simple gather collect all the data so that each processor has access to it
 #ifdef USEMPI
-    if(opt.iSingleHalo) {
+    //unless requested, import only the cells of other processes that can be among the nearest cells of local particles
+    if(opt.iSingleHalo && opt.impigridhaloexchange) {
+    Double_t xreq[6];
+    GridCell *halogrid;
+    Coordinate *halogvel;
+    Matrix *halogveldisp;
+    GetDenVRatioGridRequest(nbodies, Part, nlocalgrid, celloffset, cellparts, cellxm, xreq);
+    ngrid=MPIBuildGridHalo(ngrid, grid, gvel, gveldisp, xreq, halogrid, halogvel, halogveldisp);
+    if (opt.iverbose>=2) cout<<ThisTask<<" imported "<<ngrid-nlocalgrid<<" neighbouring grid cells"<<endl;
+    delete[] grid;
+    delete[] gvel;
+    delete[] gveldisp;
+    grid=halogrid;
+    gvel=halogvel;
+    gveldisp=halogveldisp;
+    }
+    else if(opt.iSingleHalo) {
     Ngridlocal=ngrid;
     MPI_Allreduce(&ngrid,&Ngridtotal,1,MPI_Int_t,MPI_SUM,MPI_COMM_WORLD);
     mpi_grid=new GridCell[Ngridtotal];
@@ -64,70 +192,63 @@ private(i) if (nbodies > ompsubsearchnum)
     for (i=0;i<ngrid;i++) ptemp[i]=Particle(1.0,grid[i].xm[0],grid[i].xm[1],grid[i].xm[2],0.0,0.0,0.0,i);
     tree=new KDTree(ptemp,ngrid,1,tree->TPHYS, tree->KEPAN,100,0,0,0,NULL,NULL,false);
 
-#ifndef USEOPENMP
-    nthreads=1;
-#else
-#pragma omp parallel
-    {
-            if (omp_get_thread_num()==0) nthreads=omp_get_num_threads();
-    }
-#endif
-    dist=new Double_t*[nthreads];
-    for (int j=0;j<nthreads;j++)dist[j]=new Double_t[MAXNGRID+1];
-    nn=new Int_t*[nthreads];
-    for (int j=0;j<nthreads;j++)nn[j]=new Int_t[MAXNGRID+1];
-
+    idone.resize(nbodies,0);
 #ifdef USEOPENMP
 #pragma omp parallel default(shared) \
-private(i,w,wsum,sv,vsv,fbg,vp,maxdist,vmweighted,isvweighted,tid,tempdenv) \
-if (nbodies > ompsubsearchnum)
+private(i) if (runomp)
 {
-#pragma omp for schedule(static)
 #endif
-    for (i=0;i<nbodies;i++)
-    {
-        tempdenv=Part[i].GetDensity()/opt.Nsearch;
+    Int_t nn[nngrid];
+    Double_t dist[nngrid], rcell, r2;
+    vector<Int_t> cand;
+    vector<pair<Double_t, Int_t> > d2cand;
 #ifdef USEOPENMP
-        tid=omp_get_thread_num();
-#else
-        tid=0;
+#pragma omp for schedule(dynamic)
 #endif
-
-        //try inverse distance weighting scheme based using Shepard's method.
-        fbg=0.;
-        wsum=0.;
-        maxdist=0.;
-        vmweighted[0]=vmweighted[1]=vmweighted[2]=0.;
-        for (int j=0;j<3;j++) for (int k=0;k<3;k++) isvweighted(j,k)=0.0;
-        Coordinate xpos(Part[i].GetPosition());
-        tree->FindNearestPos(xpos,nn[tid],dist[tid],MAXNGRID+1);
-        for (int j=0;j<=MAXNGRID;j++) {
-           dist[tid][j]=sqrt(dist[tid][j]+1e-16);
-           if (dist[tid][j]>maxdist)maxdist=dist[tid][j];
+    for (i=0;i<nlocalgrid;i++)
+    {
+        if (celloffset[i+1]==celloffset[i]) continue;
+        //candidates are cells within R_k+2d of the cell centre
+        tree->FindNearestPos(cellxm[i],nn,dist,nngrid);
+        rcell=0;
+        for (Int_t j=celloffset[i];j<celloffset[i+1];j++) {
+            r2=0;
+            for (int k=0;k<3;k++) r2+=(Part[cellparts[j]].GetPosition(k)-cellxm[i][k])*(Part[cellparts[j]].GetPosition(k)-cellxm[i][k]);
+            if (r2>rcell) rcell=r2;
         }
-        for (int j=0;j<=MAXNGRID;j++) {
-            w=(maxdist-dist[tid][j])/(maxdist*dist[tid][j]);w=w*w;
-            //w=1.0/dist[tid][j];
-            wsum+=w;
-            vmweighted=vmweighted+gvel[ptemp[nn[tid][j]].GetID()]*w;
-            isvweighted=isvweighted+gveldisp[ptemp[nn[tid][j]].GetID()]*w;
+        rcell=sqrt(dist[nngrid-1])+2.0*sqrt(rcell);
+        cand=tree->SearchBallPosTagged(cellxm[i],rcell*rcell);
+        //if too many candidates, searching the tree for each particle is faster
+        if ((Int_t)cand.size()>NNLEAFBATCHMAXFAC*nngrid || (Int_t)cand.size()<nngrid) continue;
+        d2cand.resize(cand.size());
+        for (Int_t j=celloffset[i];j<celloffset[i+1];j++) {
+            Particle &p=Part[cellparts[j]];
+            for (size_t n=0;n<cand.size();n++) {
+                r2=0;
+                for (int k=0;k<3;k++) r2+=(p.GetPosition(k)-ptemp[cand[n]].GetPosition(k))*(p.GetPosition(k)-ptemp[cand[n]].GetPosition(k));
+                d2cand[n]=make_pair(r2,cand[n]);
+            }
+            partial_sort(d2cand.begin(),d2cand.begin()+nngrid,d2cand.end());
+            for (int n=0;n<nngrid;n++) {dist[n]=d2cand[n].first;nn[n]=d2cand[n].second;}
+            CalcDenVRatioFromCells(opt, p, nn, dist, ptemp, gvel, gveldisp, norm);
+            idone[cellparts[j]]=1;
         }
-        vmweighted=vmweighted*(1.0/wsum);
-        isvweighted=isvweighted*(1.0/wsum);
-        sv=sqrt(abs(isvweighted.Det()));
-        for (int m=0;m<3;m++) vp[m]=Part[i].GetVelocity(m)-vmweighted[m];
-        vsv=0.;for (int m=0;m<3;m++) for (int n=0;n<3;n++) vsv+=vp[m]*vp[n]*isvweighted(m,n);
-        fbg=log(sv)-0.5*vsv;
-        Part[i].SetPotential(log(tempdenv)-log(norm)-fbg);
+    }
+    //remaining particles search the grid tree
+#ifdef USEOPENMP
+#pragma omp for schedule(dynamic,1000)
+#endif
+    for (i=0;i<nbodies;i++)
+    {
+        if (idone[i]) continue;
+        Coordinate xpos(Part[i].GetPosition());
+        tree->FindNearestPos(xpos,nn,dist,nngrid);
+        CalcDenVRatioFromCells(opt, Part[i], nn, dist, ptemp, gvel, gveldisp, norm);
     }
 #ifdef USEOPENMP
 }
 #endif
     if (opt.iverbose>=2) cout<<ThisTask<<" Done"<<endl;
-    for (int j=0;j<nthreads;j++) delete[] dist[j];
-    delete[] dist;
-    for (int j=0;j<nthreads;j++) delete[] nn[j];
-    delete[] nn;
     delete[] gvel;
     delete[] gveldisp;
     delete tree;
@@ -136,29 +257,95 @@ if (nbodies > ompsubsearchnum)
 }
 
 
+/*! Fills a histogram of the log ratios (stored as the potential) of particles within [wmin,wmax) and counts the number of particles within
+    [cmin,cmax), used to set the binning of the next histogram. Each thread fills its own histogram and these are merged. If impi is set,
+    the histogram and count are also combined across mpi processes so that all processes share the same distribution.
+*/
+void FillDenVRatioHistogram(const Int_t nbodies, Particle *Part, DenVRatioHistogram &hist, Double_t wmin, Double_t wmax,
+    Double_t cmin, Double_t cmax, Int_t &ncount, bool impi)
+{
+    Int_t i, nc=0;
+    Double_t x, w;
+    int nthreads=1;
+#ifdef USEOPENMP
+    if (nbodies > ompperiodnum) nthreads=omp_get_max_threads();
+#endif
+    vector<DenVRatioHistogram> threadhist(nthreads);
+    for (int j=0;j<nthreads;j++) threadhist[j].Initialize(hist.xmin,hist.delta,hist.nbins);
+#ifdef USEOPENMP
+#pragma omp parallel default(shared) \
+private(i,x,w) num_threads(nthreads) if (nthreads>1)
+{
+#endif
+    DenVRatioHistogram *h=&threadhist[0];
+#ifdef USEOPENMP
+    h=&threadhist[omp_get_thread_num()];
+#pragma omp for schedule(static) reduction(+:nc)
+#endif
+    for (i=0;i<nbodies;i++) {
+        x=Part[i].GetPotential();
+        if (x>=cmin && x<cmax) nc++;
+        if (x<wmin || x>=wmax) continue;
+        //mass weighted
+#ifdef NOMASSWEIGHT
+        w=1.0;
+#else
+        w=Part[i].GetMass();
+#endif
+        h->Add(x,w);
+    }
+#ifdef USEOPENMP
+}
+#endif
+    for (int j=0;j<nthreads;j++) hist.Merge(threadhist[j]);
+    ncount=nc;
+#ifdef USEMPI
+    if (impi) {
+        MPI_Allreduce(MPI_IN_PLACE,hist.w.data(),hist.nbins,MPI_Real_t,MPI_SUM,MPI_COMM_WORLD);
+        MPI_Allreduce(MPI_IN_PLACE,hist.w2.data(),hist.nbins,MPI_Real_t,MPI_SUM,MPI_COMM_WORLD);
+        MPI_Allreduce(MPI_IN_PLACE,&hist.wtot,1,MPI_Real_t,MPI_SUM,MPI_COMM_WORLD);
+        MPI_Allreduce(MPI_IN_PLACE,&ncount,1,MPI_Int_t,MPI_SUM,MPI_COMM_WORLD);
+    }
+#endif
+}
+
+/*! Determines the most probable value and the dispersions below and above it of the log ratio distribution.
+    The distribution is binned with mergeable histograms (see \ref FillDenVRatioHistogram) filled in parallel. The number of particles
+    in the next, wider window about the peak is counted while binning the current window so that each rebinning needs a single pass.
+    For the background (sublevel==0) under mpi, the histograms are combined across all processes.
+*/
 void DetermineDenVRatioDistribution(Options &opt,const Int_t nbodies, Particle *Part, Double_t &meanr,Double_t &sdlow,Double_t &sdhigh, int sublevel)
 {
-    Int_t i,nbins,iprob,jprob;
+    Int_t i,nbins,iprob,jprob,npeak,ntot=nbodies;
     Double_t mtot,mtotpeak,deltar,maxprob,minprob,rmin,rmax;
     vector<Double_t> rbin;
     vector<Double_t> xbin;
-    int nthreads=1,tid;
-    Double_t w;
-    unsigned int ir;
-    //to determine initial number of bins using modified Sturges' formula
-    nbins = ceil(log10((Double_t)nbodies)/log10(2.0)+1)*4;
+    DenVRatioHistogram hist;
+    bool impi=false;
+#ifdef USEMPI
+    impi=(sublevel==0);
+#endif
 
     //deterrmine average, rmin,rmax and variance about mean
-    rmin=rmax=Part[0].GetPotential();
+    rmin=MAXVALUE;rmax=-MAXVALUE;
 #ifdef USEOPENMP
     #pragma omp parallel for default(shared) \
-    private(i,tid) schedule(static) \
+    private(i) schedule(static) \
     reduction(min:rmin) reduction(max:rmax) if (nbodies > ompperiodnum)
 #endif
-    for (i=1;i<nbodies;i++) {
+    for (i=0;i<nbodies;i++) {
         if (rmin>Part[i].GetPotential())rmin=Part[i].GetPotential();
         if (rmax<Part[i].GetPotential())rmax=Part[i].GetPotential();
     }
+#ifdef USEMPI
+    if (impi) {
+        MPI_Allreduce(MPI_IN_PLACE,&rmin,1,MPI_Real_t,MPI_MIN,MPI_COMM_WORLD);
+        MPI_Allreduce(MPI_IN_PLACE,&rmax,1,MPI_Real_t,MPI_MAX,MPI_COMM_WORLD);
+        MPI_Allreduce(MPI_IN_PLACE,&ntot,1,MPI_Int_t,MPI_SUM,MPI_COMM_WORLD);
+    }
+#endif
+    //to determine initial number of bins using modified Sturges' formula
+    nbins = ceil(log10((Double_t)ntot)/log10(2.0)+1)*4;
 
     //now bin data and find initial estimates for most probable value and the FWHM on either side of the most probable value
     //deltar=(rmax-rmin)/(Double_t)nbins;
@@ -166,20 +353,10 @@ void DetermineDenVRatioDistribution(Options &opt,const Int_t nbodies, Particle *
     rmin-=deltar*0.025;
     deltar*=1.05;
 
-    rbin.resize(nbins);
-    mtot=0;
-    for (i=0;i<nbodies;i++) {
-        ir=(unsigned int)((Part[i].GetPotential()-rmin)/deltar);
-        if (ir >= nbins) continue;
-        //mass weighted
-#ifdef NOMASSWEIGHT
-        w=1.0;
-#else
-        w=Part[i].GetMass();
-#endif
-        rbin[ir]+=w;
-        mtot+=w;
-    }
+    hist.Initialize(rmin,deltar,nbins);
+    FillDenVRatioHistogram(nbodies,Part,hist,-MAXVALUE,MAXVALUE,0,0,npeak,impi);
+    rbin=hist.w;
+    mtot=hist.wtot;
 
     maxprob=0.;
     for (i=0;i<nbins;i++) {
@@ -213,44 +390,33 @@ void DetermineDenVRatioDistribution(Options &opt,const Int_t nbodies, Particle *
     }
 
     //if object is small or bg search (ie sublevel==-1, then to keep statistics high, use preliminary determination of the variance and mean.
-    if (nbodies<2*MINSUBSIZE) {
+    if (ntot<2*MINSUBSIZE) {
         if (opt.iverbose>=2) printf("Using meanr=%e sdlow=%e sdhigh=%e\n",meanr,sdlow,sdhigh);
         return;
     }
     //now rebin around most probable over sl in either direction to be used to estimate dispersion
     //and gradually increase region till region encompases over 50% of the mass or particle numbers
-    GMatrix W(nbins,nbins);
-    rbin.resize(nbins);
+    //the number in the first region is counted here, subsequent regions are counted when binning the previous one
+    hist.Initialize(0,1,0);
+    FillDenVRatioHistogram(nbodies,Part,hist,0,0,meanr-sl*sdlow,meanr+sl*sdhigh,npeak,impi);
     do {
         mtotpeak=0;
         rmin=(meanr-sl*sdlow);
         rmax=(meanr+sl*sdhigh);
-        int npeak=0;
-        for (i=0;i<nbodies;i++) if (Part[i].GetPotential()>=rmin&&Part[i].GetPotential()<rmax) npeak++;
         //once have initial estimates of variance bin using Scott's formula
         //deltar=3.5*sdlow/pow(nbodies,1./3.);
         deltar=3.5*sqrt(sdlow*sdlow+sdhigh*sdhigh)/pow(npeak,1./3.);
         //nbins=ceil((rmax-rmin)/deltar+1);
         nbins=round((rmax-rmin)/deltar+1);
-        W=GMatrix(nbins,nbins);
-        rbin.resize(nbins);
-        for (i=0;i<nbins;i++)rbin[i]=0;
-        for (int j=0;j<nbins;j++) for (int k=0;k<nbins;k++) W(j,k)=0.;
-        for (i=0;i<nbodies;i++) {
-            if (Part[i].GetPotential()>=rmin && Part[i].GetPotential()<rmax) {
-                ir=(unsigned int)((Part[i].GetPotential()-rmin)/deltar);
-#ifdef NOMASSWEIGHT
-                w=1.0;
-#else
-                w=Part[i].GetMass();
-#endif
-                rbin[ir]+=w;
-                W(ir,ir)+=w*w;
-                mtotpeak+=w;
-            }
-        }
+        hist.Initialize(rmin,deltar,nbins);
+        FillDenVRatioHistogram(nbodies,Part,hist,rmin,rmax,meanr-1.25*sl*sdlow,meanr+1.25*sl*sdhigh,npeak,impi);
+        mtotpeak=hist.wtot;
         sl*=1.25;
     }while (mtotpeak/mtot<0.2);
+    rbin=hist.w;
+    GMatrix W(nbins,nbins);
+    for (int j=0;j<nbins;j++) for (int k=0;k<nbins;k++) W(j,k)=0.;
+    for (i=0;i<nbins;i++) W(i,i)=hist.w2[i];
 
     GMatrix covar(nbins,nbins);
     //add bins together
@@ -290,7 +456,7 @@ void DetermineDenVRatioDistribution(Options &opt,const Int_t nbodies, Particle *
     //adjust sdhigh to sdlow due to assymetry
     sdhigh=sdlow;
     //again, if number of particles is low (and so bin statisitics is poor) use initial estimate
-    if (nbodies<16*MINSUBSIZE||sublevel==-1) {
+    if (ntot<16*MINSUBSIZE||sublevel==-1) {
         if (opt.iverbose>=2) printf("Using meanr=%e sdlow=%e sdhigh=%e\n",meanr,sdlow,sdhigh);
         return;
     }
@@ -484,6 +484,112 @@ private(i,tid)
     delete tree;
 }
 
+/*!
+    Velocity density of the particles of a (sub)structure using only the particles of the structure (as with \ref HALOONLYDEN), reusing
+    the densities of particles stored in cache when all the neighbours used to calculate them belong to this structure, in which case the neighbours
+    within the structure are the same. The particles' indices in the full set are given by globalindex.
+    Densities are calculated with the same kernel as \ref GetVelocityDensityHaloOnlyDen so reused and recalculated densities are identical.
+    Densities and neighbours of recalculated particles are stored in cache for use when searching substructures of this structure.
+    Structures at the same level do not share particles so the cache can be updated for several structures at once, with marks of particles
+    read and written atomically as neighbours of one structure may be marked by another.
+*/
+void GetVelocityDensityReuse(Options &opt, const Int_t nbodies, Particle *Part, Int_t *globalindex, int sublevel, velden_sub_cache &cache)
+{
+    Int_t i, j, index, nreuse=0;
+    Int_t *nnids, *storeorgIndex;
+    Double_t *nnr2;
+    PriorityQueue **pqx, **pqv;
+    KDTree *tree;
+    vector<bool> ireuse(nbodies,false);
+    bool iflag;
+    long long nnkey;
+    int nthreads=1, tid;
+#ifndef USEMPI
+    int ThisTask=0, NProcs=1;
+#endif
+
+    //mark the particles of this structure
+    long long key=cache.StructureKey(sublevel, globalindex[0]);
+    for (i=0;i<nbodies;i++) {
+#ifdef USEOPENMP
+#pragma omp atomic write
+#endif
+        cache.mark[globalindex[i]]=key;
+    }
+    for (i=0;i<nbodies;i++) {
+        index=globalindex[i];
+        if (!cache.HasNeighbours(index)) continue;
+        int *nn=cache.Neighbours(index);
+        iflag=true;
+        for (int k=0;k<opt.Nsearch;k++) {
+#ifdef USEOPENMP
+#pragma omp atomic read
+#endif
+            nnkey=cache.mark[nn[k]];
+            if (nnkey!=key) {iflag=false;break;}
+        }
+        if (!iflag) continue;
+        ireuse[i]=true;
+        Part[i].SetDensity(cache.density[index]);
+        nreuse++;
+    }
+    if (opt.iverbose>1) cout<<ThisTask<<" reusing velocity density of "<<nreuse<<" of "<<nbodies<<" particles"<<endl;
+    if (nreuse==nbodies) return;
+
+#ifdef USEOPENMP
+#pragma omp parallel
+    {
+    if (omp_get_thread_num()==0) nthreads=omp_get_num_threads();
+    }
+#endif
+    //ids are set to the local index so that the order is restored when the tree is deleted
+    storeorgIndex=new Int_t[nbodies];
+    for (i=0;i<nbodies;i++) {storeorgIndex[i]=Part[i].GetID();Part[i].SetID(i);}
+    tree=new KDTree(Part,nbodies,opt.Bsize,tree->TPHYS,tree->KEPAN,1000,0,0,0);
+    nnids=new Int_t[nthreads*opt.Nsearch];
+    nnr2=new Double_t[nthreads*opt.Nsearch];
+    pqx=new PriorityQueue*[nthreads];
+    pqv=new PriorityQueue*[nthreads];
+    for (j=0;j<nthreads;j++) {
+        pqx[j]=new PriorityQueue(opt.Nsearch);
+        pqv[j]=new PriorityQueue(opt.Nvel);
+    }
+#ifdef USEOPENMP
+#pragma omp parallel default(shared) \
+private(i,index,tid)
+{
+#pragma omp for schedule(dynamic) nowait
+#endif
+    for (i=0;i<nbodies;i++) {
+        if (ireuse[Part[i].GetID()]) continue;
+#ifdef USEOPENMP
+        tid=omp_get_thread_num();
+#else
+        tid=0;
+#endif
+        //nnids then holds the physical neighbours used
+        Part[i].SetDensity(tree->CalcVelDensityParticle(i,opt.Nvel,opt.Nsearch,1,pqx[tid],pqv[tid],&nnids[tid*opt.Nsearch],&nnr2[tid*opt.Nsearch]));
+        index=globalindex[Part[i].GetID()];
+        cache.density[index]=Part[i].GetDensity();
+        int *nn=cache.Neighbours(index);
+        for (int k=0;k<opt.Nsearch;k++) nn[k]=globalindex[Part[nnids[tid*opt.Nsearch+k]].GetID()];
+    }
+#ifdef USEOPENMP
+}
+#endif
+    for (j=0;j<nthreads;j++) {
+        delete pqx[j];
+        delete pqv[j];
+    }
+    delete[] nnids;
+    delete[] nnr2;
+    delete[] pqx;
+    delete[] pqv;
+    delete tree;
+    for (i=0;i<nbodies;i++) Part[i].SetID(storeorgIndex[i]);
+    delete[] storeorgIndex;
+}
+
 ///Exact calculation of velocity density at a particle's position
 void GetVelocityDensityExact(Options &opt, const Int_t nbodies, Particle *Part, KDTree *tree)
 {
@@ -508,6 +614,21 @@ void GetVelocityDensityExact(Options &opt, const Int_t nbodies, Particle *Part,
     Int_t *nnids;
     Double_t *nnr2;
     PriorityQueue *pqx, *pqv;
+    //to find the neighbours of all particles in a leaf node together
+    vector<leaf_node_info> leafnodes;
+    leaf_nn_buffer leafbuf;
+    Int_t numleafnodes=0;
+    bool ibatched=opt.iLocalVelDenBatchedNN;
+    //to report the accuracy of single precision neighbour selection
+    bool isingle=opt.iLocalVelDenSinglePrecision;
+    Int_t nprecheck=0, nprefallback=0;
+    Double_t precsum=0, precmax=0;
+#ifdef STRUCDEN
+    bool iactiveonly=true;
+    if (opt.iBaryonSearch>=1 && opt.partsearchtype==PSTALL) ibatched=false;
+#else
+    bool iactiveonly=false;
+#endif
 
 #ifdef USEMPI
     Int_t nimport;
@@ -534,6 +655,71 @@ void GetVelocityDensityExact(Options &opt, const Int_t nbodies, Particle *Part,
     //In loop determine if particles NN search radius overlaps another mpi threads domain.
     //If not, then proceed as usually to determine velocity density.
     //If so, do not calculate local velocity density and set its velocity density to -1 as a flag
+    if (ibatched) {
+    //find neighbours of all the particles in a leaf node from a single set of candidates
+    GetLeafNodeRanges(tree, nbodies, leafnodes);
+    numleafnodes=leafnodes.size();
+#ifdef USEOPENMP
+#pragma omp parallel default(shared) \
+private(i,j,k,id,v2,nnids,nnr2,weight,pqv,leafbuf)
+{
+#endif
+    nnids=new Int_t[opt.Nsearch];
+    nnr2=new Double_t[opt.Nsearch];
+    weight=new Double_t[opt.Nvel];
+    pqv=new PriorityQueue(opt.Nvel);
+    leafbuf.isingle=isingle;
+#ifdef USEOPENMP
+#pragma omp for schedule(dynamic) \
+reduction(+:nprecheck,nprefallback,precsum) reduction(max:precmax)
+#endif
+    for (Int_t ileaf=0;ileaf<numleafnodes;ileaf++) {
+        Int_t ncand=GetLeafNNCandidates(tree, Part, leafnodes[ileaf].istart, leafnodes[ileaf].iend, opt.Nsearch, opt.p, iactiveonly, leafbuf, nnids, nnr2);
+        if (ncand==0) continue;
+        //if the leaf is extended there are many candidates and it is faster to search the tree for each particle
+        bool isearchtree=(ncand>NNLEAFBATCHMAXFAC*(Int_t)opt.Nsearch);
+        bool icheck=(isingle && !isearchtree && ileaf%NNSINGLECHECKSTRIDE==0), irecalc=false;
+        //if a checked particle differs too much from double precision, the leaf is recalculated in double precision
+        do {
+        if (irecalc) {leafbuf.isingle=false;icheck=false;nprefallback++;}
+        for (i=leafnodes[ileaf].istart;i<leafnodes[ileaf].iend;i++) {
+            if (iactiveonly && Part[i].GetType()<=0) continue;
+            if (isearchtree || FindNearestLeafCandidates(Part[i], opt.Nsearch, opt.p, leafbuf, nnids, nnr2)<opt.Nsearch)
+                tree->FindNearest(i,nnids,nnr2,opt.Nsearch);
+#ifdef USEMPI
+            if (opt.iLocalVelDenApproxCalcFlag==0) {
+            maxrdist[i]=sqrt(nnr2[opt.Nsearch-1]);
+#ifdef SWIFTINTERFACE
+            if (MPISearchForOverlapUsingMesh(libvelociraptorOpt,Part[i],maxrdist[i])!=0) {
+                Part[i].SetDensity(-1.0);
+                continue;
+            }
+#else
+            if (MPISearchForOverlap(Part[i],maxrdist[i])!=0) {
+                Part[i].SetDensity(-1.0);
+                continue;
+            }
+#endif
+            maxrdist[i]=0.0;
+            }
+#endif
+            Part[i].SetDensity(CalcVelDensityFromNN(tree, Part, i, nnids, opt.Nsearch, opt.Nvel, pqv, weight, false));
+            if (icheck && CheckVelDensityPrecision(opt, tree, Part, i, leafbuf, nnids, nnr2, pqv, weight, false, nprecheck, precsum, precmax)) irecalc=true;
+        }
+        } while (irecalc && leafbuf.isingle);
+        leafbuf.isingle=isingle;
+    }
+    delete[] nnids;
+    delete[] nnr2;
+    delete[] weight;
+    delete pqv;
+#ifdef USEOPENMP
+}
+#endif
+    vector<leaf_node_info>().swap(leafnodes);
+    if (isingle && nprecheck>0) cout<<ThisTask<<" Single precision neighbour search: compared velocity density of "<<nprecheck<<" particles to double precision, mean relative difference "<<precsum/(Double_t)nprecheck<<", maximum "<<precmax<<", recalculated "<<nprefallback<<" leaf nodes in double precision"<<endl;
+    }
+    else {
 #ifdef USEOPENMP
 #pragma omp parallel default(shared) \
 private(i,j,k,tid,id,v2,nnids,nnr2,weight,pqv)
@@ -597,6 +783,7 @@ private(i,j,k,tid,id,v2,nnids,nnr2,weight,pqv)
 #ifdef USEOPENMP
 }
 #endif
+    }
 
 #ifdef USEMPI
     if (NProcs >1 && opt.iLocalVelDenApproxCalcFlag==0) {
@@ -761,6 +948,19 @@ void GetVelocityDensityApproximative(Options &opt, const Int_t nbodies, Particle
     Double_t *nnr2, *nnr2neighbours;
     PriorityQueue *pqx, *pqv;
     Particle *Pval;
+    //to let particles select their own neighbours from candidates shared by the leaf node
+    leaf_nn_buffer leafbuf;
+    bool ileafcand=opt.iLocalVelDenLeafCandidates, iusecand, icheck, irecalc;
+    //to report the accuracy of single precision neighbour selection
+    bool isingle=opt.iLocalVelDenSinglePrecision;
+    Int_t nprecheck=0, nprefallback=0;
+    Double_t precsum=0, precmax=0;
+#ifdef STRUCDEN
+    bool iactiveonly=true;
+    if (opt.iBaryonSearch>=1 && opt.partsearchtype==PSTALL) ileafcand=false;
+#else
+    bool iactiveonly=false;
+#endif
 #ifndef USEOPENMP
     nthreads=1;
 #else
@@ -785,20 +985,9 @@ void GetVelocityDensityApproximative(Options &opt, const Int_t nbodies, Particle
     //and whether other mpi domains need to be searched.
 
     //first get all local leaf nodes;
-    Int_t numleafnodes = tree->GetNumLeafNodes();
-    Node *node;
-    vector<leaf_node_info> leafnodes(numleafnodes);
-    Int_t inode=0, ipart=0;
-    while (ipart<nbodies) {
-        node=tree->FindLeafNode(ipart);
-        leafnodes[inode].id = inode;
-        leafnodes[inode].istart = node->GetStart();
-        leafnodes[inode].iend = node->GetEnd();
-        leafnodes[inode].numtot = node->GetCount();
-        ipart+=leafnodes[inode].numtot;
-        inode++;
-    }
-    node=NULL;
+    vector<leaf_node_info> leafnodes;
+    GetLeafNodeRanges(tree, nbodies, leafnodes);
+    Int_t numleafnodes = leafnodes.size();
 
     //get memory useage
     GetMemUsage(opt, __func__+string("--line--")+to_string(__LINE__), (opt.iverbose>=1));
@@ -842,23 +1031,31 @@ void GetVelocityDensityApproximative(Options &opt, const Int_t nbodies, Particle
 
 #ifdef USEOPENMP
 #pragma omp parallel default(shared) \
-private(id,v2,nnids,nnr2,weight,pqv)
+private(id,v2,nnids,nnr2,weight,pqv,leafbuf,iusecand,icheck,irecalc)
 {
 #endif
     nnids=new Int_t[opt.Nsearch];
     nnr2=new Double_t[opt.Nsearch];
     weight=new Double_t[opt.Nvel];
     pqv=new PriorityQueue(opt.Nvel);
+    leafbuf.isingle=isingle;
 #ifdef USEOPENMP
 #pragma omp for schedule(dynamic) \
-reduction(+:nprocessed,ntot)
+reduction(+:nprocessed,ntot,nprecheck,nprefallback,precsum) reduction(max:precmax)
 #endif
     for (auto i=0;i<numleafnodes;i++) {
         ntot += leafnodes[i].num;
         //if there are no active particles in leaf node, do nothing
         if (leafnodes[i].num == 0) continue;
         //find the near neighbours for all particles in the leaf node
-
+        iusecand=false;
+        if (ileafcand) {
+            //gather candidates shared by the leaf, which also finds the neighbours of the centre of the leaf.
+            //If there are too many candidates, simply use the neighbours of the centre
+            iusecand=(GetLeafNNCandidates(tree, Part, leafnodes[i].istart, leafnodes[i].iend, opt.Nsearch, opt.p, iactiveonly, leafbuf, nnids, nnr2)
+                <=NNLEAFBATCHMAXFAC*(Int_t)opt.Nsearch);
+        }
+        else {
 #ifdef STRUCDEN
         //if not searching all particles in FOF then also doing baryon search then just find nearest neighbours
         if (!(opt.iBaryonSearch>=1 && opt.partsearchtype==PSTALL)) tree->FindNearestPos(leafnodes[i].cm,nnids,nnr2,opt.Nsearch);
@@ -867,9 +1064,12 @@ reduction(+:nprocessed,ntot)
 #else
         tree->FindNearestPos(leafnodes[i].cm,nnids,nnr2,opt.Nsearch);
 #endif
+        }
 #ifdef USEMPI
         if (opt.iLocalVelDenApproxCalcFlag==1) {
-        leafnodes[i].searchdist = sqrt(nnr2[opt.Nsearch-1]);
+        //if particles use their own neighbours, these lie within the candidate radius
+        if (iusecand) leafnodes[i].searchdist = leafbuf.radius;
+        else leafnodes[i].searchdist = sqrt(nnr2[opt.Nsearch-1]);
         //check if search region from Particle extends into other mpi domain, if so, skip particles
 #ifdef SWIFTINTERFACE
         if (MPISearchForOverlapUsingMesh(libvelociraptorOpt,leafnodes[i].cm,leafnodes[i].searchdist)!=0) continue;
@@ -880,27 +1080,22 @@ reduction(+:nprocessed,ntot)
 	}
 #endif
         nprocessed += leafnodes[i].num;
+        icheck=(iusecand && isingle && i%NNSINGLECHECKSTRIDE==0);
+        irecalc=false;
+        //if a checked particle differs too much from double precision, the leaf is recalculated in double precision
+        do {
+        if (irecalc) {leafbuf.isingle=false;icheck=false;nprefallback++;}
         for (auto j=leafnodes[i].istart;j<leafnodes[i].iend;j++)
         {
 #ifdef STRUCDEN
             if (Part[j].GetType()<=0) continue;
 #endif
-            for (auto k=0;k<opt.Nvel;k++) {
-                pqv->Push(-1, MAXVALUE);
-                weight[k]=1.0;
-            }
-            for (auto k=0;k<opt.Nsearch;k++) {
-                v2=0;
-                id=nnids[k];
-                if (id == j) continue;
-                for (auto n=0;n<3;n++) v2+=(Part[j].GetVelocity(n)-Part[id].GetVelocity(n))*(Part[j].GetVelocity(n)-Part[id].GetVelocity(n));
-                if (v2 < pqv->TopPriority()){
-                    pqv->Pop();
-                    pqv->Push(id, v2);
-                }
-            }
-            Part[j].SetDensity(tree->CalcSmoothLocalValue(opt.Nvel, pqv, weight));
+            if (iusecand) FindNearestLeafCandidates(Part[j], opt.Nsearch, opt.p, leafbuf, nnids, nnr2);
+            Part[j].SetDensity(CalcVelDensityFromNN(tree, Part, j, nnids, opt.Nsearch, opt.Nvel, pqv, weight, true));
+            if (icheck && CheckVelDensityPrecision(opt, tree, Part, j, leafbuf, nnids, nnr2, pqv, weight, true, nprecheck, precsum, precmax)) irecalc=true;
         }
+        } while (irecalc && leafbuf.isingle);
+        leafbuf.isingle=isingle;
     }
     delete[] nnids;
     delete[] nnr2;
@@ -909,6 +1104,7 @@ reduction(+:nprocessed,ntot)
 #ifdef USEOPENMP
 }
 #endif
+    if (isingle && nprecheck>0) cout<<ThisTask<<" Single precision neighbour search: compared velocity density of "<<nprecheck<<" particles to double precision, mean relative difference "<<precsum/(Double_t)nprecheck<<", maximum "<<precmax<<", recalculated "<<nprefallback<<" leaf nodes in double precision"<<endl;
 
 #ifdef USEMPI
     //if search is fully approximative, then since particles have been localized to mpi domains in FOF groups, don't search neighbour mpi domains
@@ -1072,3 +1268,188 @@ reduction(+:nprocessed)
     if (itreeflag) delete tree;
     if (period!=NULL) delete[] period;
 }
+
+/// \name Nearest neighbour searches of all particles in a leaf node
+//@{
+
+///get the particle index ranges of all leaf nodes of the tree
+void GetLeafNodeRanges(KDTree *tree, const Int_t nbodies, vector<leaf_node_info> &leafnodes)
+{
+    Int_t numleafnodes = tree->GetNumLeafNodes();
+    Node *node;
+    leafnodes.resize(numleafnodes);
+    Int_t inode=0, ipart=0;
+    while (ipart<nbodies) {
+        node=tree->FindLeafNode(ipart);
+        leafnodes[inode].id = inode;
+        leafnodes[inode].istart = node->GetStart();
+        leafnodes[inode].iend = node->GetEnd();
+        leafnodes[inode].numtot = node->GetCount();
+        leafnodes[inode].size = 0;
+        ipart+=leafnodes[inode].numtot;
+        inode++;
+    }
+}
+
+///periodically wrap a separation
+inline Double_t LeafNNWrap(Double_t dx, const Double_t period)
+{
+    if (period>0) {
+        if (dx>0.5*period) dx-=period;
+        else if (dx<-0.5*period) dx+=period;
+    }
+    return dx;
+}
+
+///add a value to a max-heap that only keeps the k smallest values
+inline void BoundedHeapPush(vector<pair<Double_t, Int_t> > &heap, const int k, const Double_t d2, const Int_t id)
+{
+    if ((int)heap.size()<k) {
+        heap.push_back(make_pair(d2,id));
+        push_heap(heap.begin(),heap.end());
+    }
+    else if (d2<heap.front().first) {
+        pop_heap(heap.begin(),heap.end());
+        heap.back()=make_pair(d2,id);
+        push_heap(heap.begin(),heap.end());
+    }
+}
+
+/*!
+    Gathers a set of candidate neighbours that contains the k nearest neighbours of every particle in the leaf node with tree indices istart to iend-1
+    (if iactiveonly only particles with type>0 are considered, as for \ref STRUCDEN).
+    If \f$ R_k \f$ is the distance from the centre of the leaf to its k-th nearest neighbour and \f$ d \f$ is the largest distance of a particle from the centre,
+    a ball of radius \f$ R_k+d \f$ about any particle of the leaf contains at least k particles, so all of its k nearest neighbours lie within \f$ R_k+2d \f$ of the centre.
+    The candidate positions relative to the centre are stored as structure of arrays for \ref FindNearestLeafCandidates.
+    nnids and nnr2 must be able to store k values and are used as temporary storage.
+    Returns the number of candidates (zero if there are no particles to consider).
+*/
+Int_t GetLeafNNCandidates(KDTree *tree, Particle *Part, const Int_t istart, const Int_t iend, const int k, const Double_t period,
+    const bool iactiveonly, leaf_nn_buffer &buf, Int_t *nnids, Double_t *nnr2)
+{
+    Int_t num=0, ncand;
+    Double_t dmax2=0, rk2=0, r2;
+    for (int l=0;l<3;l++) buf.cm[l]=0;
+    for (Int_t j=istart;j<iend;j++) {
+        if (iactiveonly && Part[j].GetType()<=0) continue;
+        num++;
+        for (int l=0;l<3;l++) buf.cm[l]+=Part[j].GetPosition(l);
+    }
+    buf.cand.clear();
+    if (num==0) return 0;
+    for (int l=0;l<3;l++) buf.cm[l]/=(Double_t)num;
+    for (Int_t j=istart;j<iend;j++) {
+        if (iactiveonly && Part[j].GetType()<=0) continue;
+        r2=0;
+        for (int l=0;l<3;l++) r2+=(Part[j].GetPosition(l)-buf.cm[l])*(Part[j].GetPosition(l)-buf.cm[l]);
+        if (r2>dmax2) dmax2=r2;
+    }
+    tree->FindNearestPos(buf.cm,nnids,nnr2,k);
+    for (int j=0;j<k;j++) if (nnr2[j]>rk2) rk2=nnr2[j];
+    buf.radius=sqrt(rk2)+2.0*sqrt(dmax2);
+    buf.cand=tree->SearchBallPosTagged(buf.cm,buf.radius*buf.radius);
+    ncand=buf.cand.size();
+    buf.x.resize(ncand);
+    buf.y.resize(ncand);
+    buf.z.resize(ncand);
+    buf.d2.resize(ncand);
+    for (Int_t j=0;j<ncand;j++) {
+        Particle *p=&Part[buf.cand[j]];
+        buf.x[j]=LeafNNWrap(p->X()-buf.cm[0],period);
+        buf.y[j]=LeafNNWrap(p->Y()-buf.cm[1],period);
+        buf.z[j]=LeafNNWrap(p->Z()-buf.cm[2],period);
+    }
+    //positions relative to the centre are small so little precision is lost when stored as floats
+    if (buf.isingle) {
+        buf.xf.assign(buf.x.begin(),buf.x.end());
+        buf.yf.assign(buf.y.begin(),buf.y.end());
+        buf.zf.assign(buf.z.begin(),buf.z.end());
+        buf.d2f.resize(ncand);
+    }
+    return ncand;
+}
+
+/*!
+    Finds the k nearest neighbours of particle p from the candidates gathered by \ref GetLeafNNCandidates, returning the tree indices and
+    squared distances in order of increasing distance. Distances to all candidates are calculated in a single loop over contiguous arrays, which
+    the compiler can vectorise, and the nearest are then kept in a bounded max-heap stored in buf so that no memory is allocated per particle.
+    As with a tree search, the particle itself is included if it is a candidate.
+    If buf.isingle, distances are calculated and compared in single precision, which doubles the number of candidates processed per vector instruction.
+    Returns the number of neighbours found, which is k unless there are fewer candidates.
+*/
+int FindNearestLeafCandidates(Particle &p, const int k, const Double_t period, leaf_nn_buffer &buf, Int_t *nnids, Double_t *nnr2)
+{
+    Int_t ncand=buf.cand.size();
+    Double_t x0=LeafNNWrap(p.X()-buf.cm[0],period);
+    Double_t y0=LeafNNWrap(p.Y()-buf.cm[1],period);
+    Double_t z0=LeafNNWrap(p.Z()-buf.cm[2],period);
+    buf.heap.clear();
+    if (buf.isingle) {
+        const float *x=buf.xf.data(), *y=buf.yf.data(), *z=buf.zf.data();
+        float *d2=buf.d2f.data();
+        float x0f=x0, y0f=y0, z0f=z0;
+        for (Int_t j=0;j<ncand;j++) d2[j]=(x[j]-x0f)*(x[j]-x0f)+(y[j]-y0f)*(y[j]-y0f)+(z[j]-z0f)*(z[j]-z0f);
+        for (Int_t j=0;j<ncand;j++) BoundedHeapPush(buf.heap, k, d2[j], buf.cand[j]);
+    }
+    else {
+        const Double_t *x=buf.x.data(), *y=buf.y.data(), *z=buf.z.data();
+        Double_t *d2=buf.d2.data();
+        for (Int_t j=0;j<ncand;j++) d2[j]=(x[j]-x0)*(x[j]-x0)+(y[j]-y0)*(y[j]-y0)+(z[j]-z0)*(z[j]-z0);
+        for (Int_t j=0;j<ncand;j++) BoundedHeapPush(buf.heap, k, d2[j], buf.cand[j]);
+    }
+    sort_heap(buf.heap.begin(),buf.heap.end());
+    int nfound=buf.heap.size();
+    for (int j=0;j<nfound;j++) {
+        nnids[j]=buf.heap[j].second;
+        nnr2[j]=buf.heap[j].first;
+    }
+    return nfound;
+}
+
+/*!
+    Calculates the velocity density of particle i from its nsearch physical neighbours (tree indices nnids) using the nvel nearest in velocity.
+    If iexcludeself, the particle itself is not used as a neighbour. The kernel weighted sum is calculated in double precision.
+*/
+Double_t CalcVelDensityFromNN(KDTree *tree, Particle *Part, const Int_t i, Int_t *nnids, const int nsearch, const int nvel,
+    PriorityQueue *pqv, Double_t *weight, const bool iexcludeself)
+{
+    Double_t v2;
+    Int_t id;
+    for (int k=0;k<nvel;k++) {
+        pqv->Push(-1, MAXVALUE);
+        weight[k]=1.0;
+    }
+    for (int k=0;k<nsearch;k++) {
+        id=nnids[k];
+        if (iexcludeself && id == i) continue;
+        v2=0;
+        for (int n=0;n<3;n++) v2+=(Part[i].GetVelocity(n)-Part[id].GetVelocity(n))*(Part[i].GetVelocity(n)-Part[id].GetVelocity(n));
+        if (v2 < pqv->TopPriority()){
+            pqv->Pop();
+            pqv->Push(id, v2);
+        }
+    }
+    return tree->CalcSmoothLocalValue(nvel, pqv, weight);
+}
+
+/*!
+    Recalculates the velocity density of particle i in double precision using the candidates of its leaf node and accumulates the
+    relative difference to the density stored (calculated with single precision neighbour selection).
+    Returns true if the difference exceeds \ref NNSINGLEMAXDIFF.
+*/
+bool CheckVelDensityPrecision(Options &opt, KDTree *tree, Particle *Part, const Int_t i, leaf_nn_buffer &buf, Int_t *nnids, Double_t *nnr2,
+    PriorityQueue *pqv, Double_t *weight, const bool iexcludeself, Int_t &ncheck, Double_t &sumdiff, Double_t &maxdiff)
+{
+    Double_t den, diff;
+    buf.isingle=false;
+    FindNearestLeafCandidates(Part[i], opt.Nsearch, opt.p, buf, nnids, nnr2);
+    buf.isingle=true;
+    den=CalcVelDensityFromNN(tree, Part, i, nnids, opt.Nsearch, opt.Nvel, pqv, weight, iexcludeself);
+    if (den<=0) return false;
+    diff=fabs(Part[i].GetDensity()-den)/den;
+    ncheck++;
+    sumdiff+=diff;
+    if (diff>maxdiff) maxdiff=diff;
+    return (diff>NNSINGLEMAXDIFF);
+}
+//@}
@@ -89,6 +89,8 @@ int main(int argc,char **argv)
 #endif
 
     InitMemUsageLog(opt);
+    //determine crossover between direct summation and tree potentials if requested
+    if (opt.uinfo.potppcalcnum<0) CalibratePotentialPPCrossover(opt);
 
     //variables
     //number of particles, (also number of baryons if use dm+baryon search)
@@ -117,7 +119,7 @@ int main(int argc,char **argv)
 
     Coordinate cm,cmvel;
     Double_t Mtot;
-    char fname1[1000],fname4[1000];
+    char fname1[1000];
 
 #ifdef USEMPI
     mpi_nlocal=new Int_t[NProcs];
@@ -254,18 +256,19 @@ int main(int argc,char **argv)
     cout<<"TIME::"<<ThisTask<<" took "<<time1<<" to load "<<nbodies<<endl;
 #endif
 
+    //reorder particles so that those close in space are close in memory, which helps all subsequent tree builds and searches
+    if (opt.iSortInputMorton) {
+        time1=MyGetTime();
+        SortParticlesByMortonKey(opt, nbodies, Part.data());
+        time1=MyGetTime()-time1;
+        cout<<"TIME::"<<ThisTask<<" took "<<time1<<" to sort "<<nbodies<<" particles by Morton key"<<endl;
+    }
+
     //write out the configuration used by velociraptor having read in the data (as input data can contain cosmological information)
     WriteVELOCIraptorConfig(opt);
     WriteSimulationInfo(opt);
     WriteUnitInfo(opt);
 
-    //set filenames if they have been passed
-#ifdef USEMPI
-    if (opt.smname!=NULL) sprintf(fname4,"%s.%d",opt.smname,ThisTask);
-#else
-    if (opt.smname!=NULL) sprintf(fname4,"%s",opt.smname);
-#endif
-
     //read local velocity data or calculate it
     //(and if STRUCDEN flag or HALOONLYDEN is set then only calculate the velocity density function for objects within a structure
     //as found by SearchFullSet)
@@ -273,8 +276,8 @@ int main(int argc,char **argv)
 #else
     if (opt.iSubSearch==1) {
         time1=MyGetTime();
-        if(FileExists(fname4)) ReadLocalVelocityDensity(opt, nbodies,Part);
-        else  {
+        //densities are only read if the file exists and was calculated with the same parameters, otherwise they are recalculated
+        if (opt.smname==NULL || ReadLocalVelocityDensity(opt, nbodies,Part)==false) {
             GetVelocityDensity(opt, nbodies, Part.data());
             WriteLocalVelocityDensity(opt, nbodies,Part);
         }
@@ -289,6 +292,8 @@ int main(int argc,char **argv)
     //From here can either search entire particle array for "Halos" or if a single halo is loaded, then can just search for substructure
     if (!opt.iSingleHalo) {
 #ifndef USEMPI
+        //if requested, find 3dfof groups for a range of linking lengths
+        if (opt.ellhalo3dsweepfacs.size()>0) SearchFOFLinkingLengthSweep(opt,nbodies,Part);
         time1=MyGetTime();
         pfof=SearchFullSet(opt,nbodies,Part,ngroup);
         nhalos=ngroup;
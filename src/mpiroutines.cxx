@@ -5009,9 +5009,7 @@ Int_t MPISearchBaryons(const Int_t nbaryons, Particle *&Pbaryons, Int_t *&pfofba
 {
     Double_t D2, dval, rval;
     Coordinate x1;
-    Particle p1;
     Int_t  i, j, k, pindex,nexport=0;
-    int tid;
     FOFcompfunc fofcmp=FOF6d;
     Int_t *nnID;
     Double_t *dist2;
@@ -5019,22 +5017,23 @@ Int_t MPISearchBaryons(const Int_t nbaryons, Particle *&Pbaryons, Int_t *&pfofba
     //now dark matter particles associated with a group existing on another mpi domain are local and can be searched.
     KDTree *mpitree=new KDTree(PartDataGet,NImport,nsearch/2,mpitree->TPHYS,mpitree->KEPAN,100,0,0,0,period);
     if (nsearch>NImport) nsearch=NImport;
+    //only baryons close to imported particles need to be searched
+    NeighbourCellMask dmmask;
+    dmmask.Initialize(NImport, PartDataGet, sqrt(param[6]), (period==NULL?0:period[0]));
 #ifdef USEOPENMP
 #pragma omp parallel default(shared) \
-private(i,j,k,tid,p1,pindex,x1,D2,dval,rval,nnID,dist2)
+private(i,j,k,pindex,x1,D2,dval,rval,nnID,dist2)
 {
+#endif
     nnID=new Int_t[nsearch];
     dist2=new Double_t[nsearch];
-#pragma omp for reduction(+:nexport)
+#ifdef USEOPENMP
+#pragma omp for reduction(+:nexport) schedule(dynamic,ompperiodnum/16+1)
 #endif
     for (i=0;i<nbaryons;i++)
     {
-#ifdef USEOPENMP
-        tid=omp_get_thread_num();
-#else
-        tid=0;
-#endif
-        p1=Pbaryons[i];
+        Particle &p1=Pbaryons[i];
+        if (dmmask.HasNeighbours(p1)) {
         x1=Coordinate(p1.GetPosition());
         rval=MAXVALUE;
         dval=localdist[i];
@@ -5056,6 +5055,7 @@ private(i,j,k,tid,p1,pindex,x1,D2,dval,rval,nnID,dist2)
             }
         }
         }
+        }
         nexport+=(mpi_foftask[i]!=ThisTask);
     }
     delete[] nnID;
@@ -5320,6 +5320,81 @@ void MPIBuildGridData(const Int_t ngrid, GridCell *grid, Coordinate *gvel, Matri
         }
     }
 }
+
+/*! Imports the grid cells of other mpi processes that lie within the region requested by this process, the box xreq (stored as lower
+    and upper bounds for each dimension) that contains the nearest cells of all local particles. Boxes are shared so that each process
+    only sends cells within the box of another. The returned arrays contain the local cells followed by the imported cells,
+    so memory scales with the local and neighbouring cells rather than the total number of cells.
+    \return number of cells in the returned arrays
+*/
+Int_t MPIBuildGridHalo(const Int_t ngrid, GridCell *grid, Coordinate *gvel, Matrix *gveldisp, Double_t xreq[6],
+    GridCell *&halogrid, Coordinate *&halogvel, Matrix *&halogveldisp)
+{
+    Int_t i, j, nimport=0, nhalo;
+    Int_t nsend_local[NProcs], noffset[NProcs];
+    Int_t sendTask,recvTask;
+    MPI_Status status;
+    vector<Double_t> allxreq(6*NProcs);
+    vector<vector<Int_t> > sendlist(NProcs);
+    vector<gridhalo_data> sendbuf, recvbuf;
+
+    MPI_Allgather(xreq, 6, MPI_Real_t, allxreq.data(), 6, MPI_Real_t, MPI_COMM_WORLD);
+    for (j=0;j<NProcs;j++) {
+        nsend_local[j]=0;
+        if (j==ThisTask) continue;
+        for (i=0;i<ngrid;i++) {
+            bool iin=true;
+            for (int k=0;k<3;k++) iin=iin && (grid[i].xm[k]>=allxreq[6*j+2*k] && grid[i].xm[k]<=allxreq[6*j+2*k+1]);
+            if (iin) sendlist[j].push_back(i);
+        }
+        nsend_local[j]=sendlist[j].size();
+    }
+    MPI_Allgather(nsend_local, NProcs, MPI_Int_t, mpi_nsend, NProcs, MPI_Int_t, MPI_COMM_WORLD);
+    for (j=0;j<NProcs;j++) {
+        noffset[j]=nimport;
+        if (j!=ThisTask) nimport+=mpi_nsend[ThisTask+j*NProcs];
+    }
+    recvbuf.resize(nimport);
+
+    for(j=0;j<NProcs;j++)
+    {
+        if (j!=ThisTask)
+        {
+            sendTask = ThisTask;
+            recvTask = j;
+            sendbuf.resize(nsend_local[recvTask]);
+            for (i=0;i<nsend_local[recvTask];i++) {
+                Int_t icell=sendlist[recvTask][i];
+                for (int k=0;k<3;k++) sendbuf[i].xm[k]=grid[icell].xm[k];
+                sendbuf[i].gvel=gvel[icell];
+                sendbuf[i].gveldisp=gveldisp[icell];
+            }
+            //blocking point-to-point send and receive.
+            MPI_Sendrecv(sendbuf.data(),
+                nsend_local[recvTask]* sizeof(struct gridhalo_data), MPI_BYTE,
+                recvTask, TAG_GRID_A,
+                &recvbuf[noffset[recvTask]],
+                mpi_nsend[ThisTask+recvTask * NProcs] * sizeof(struct gridhalo_data),
+                MPI_BYTE, recvTask, TAG_GRID_A, MPI_COMM_WORLD, &status);
+        }
+    }
+
+    nhalo=ngrid+nimport;
+    halogrid=new GridCell[nhalo];
+    halogvel=new Coordinate[nhalo];
+    halogveldisp=new Matrix[nhalo];
+    for (i=0;i<ngrid;i++) {
+        for (int k=0;k<3;k++) halogrid[i].xm[k]=grid[i].xm[k];
+        halogvel[i]=gvel[i];
+        halogveldisp[i]=gveldisp[i];
+    }
+    for (i=0;i<nimport;i++) {
+        for (int k=0;k<3;k++) halogrid[ngrid+i].xm[k]=recvbuf[i].xm[k];
+        halogvel[ngrid+i]=recvbuf[i].gvel;
+        halogveldisp[ngrid+i]=recvbuf[i].gveldisp;
+    }
+    return nhalo;
+}
 //@}
 
 /// \name config updates for MPI
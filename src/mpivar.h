@@ -219,6 +219,13 @@ extern struct nndata_in
 extern struct GridCell *mpi_grid;
 extern Coordinate *mpi_gvel;
 extern Matrix *mpi_gveldisp;
+///grid cell data exchanged with neighbouring mpi threads (see \ref MPIBuildGridHalo)
+struct gridhalo_data
+{
+    Double_t xm[3];
+    Coordinate gvel;
+    Matrix gveldisp;
+};
 //@}
 
 /*extern struct fofdata_out
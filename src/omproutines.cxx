@@ -283,61 +283,52 @@ void OpenMPLinkAcross(Options &opt,
     cout<<ThisTask<<" finished linking "<<MyGetTime()-time1<<endl;
 }
 
+/*!
+    Removes groups smaller than minsize and relabels the remaining groups in decreasing size.
+    Group sizes are counted with per-thread counts (see \ref BuildNumInGroup), the groups are ordered with a stable sort
+    (so groups of equal size keep their relative order) and the group ids are updated in parallel.
+*/
 Int_t OpenMPResortParticleandGroups(Int_t nbodies, vector<Particle> &Part, Int_t *&pfof, Int_t minsize)
 {
 #ifndef USEMPI
     int ThisTask=0,NProcs=1;
 #endif
-    Int_t ngroups = 0, newnumgroups = 0;;
-    vector<Int_t> numingroup, index;
-    unordered_map<Int_t, Int_t> pfofoldtonew;
-    PriorityQueue *pq;
+    Int_t ngroups = 0, newnumgroups = 0;
+    Int_t *numingroup;
+    vector<Int_t> index, pfofoldtonew;
 
     //init data
-    for (auto i=0;i<nbodies;i++) if (ngroups < pfof[i]) ngroups = pfof[i];
-    numingroup.resize(ngroups+1,0);
-    index.resize(ngroups+1);
-    for (auto i=0;i<=ngroups;i++) index[i] = i;
-    for (auto i=0;i<nbodies;i++) if (pfof[i]>0) numingroup[pfof[i]]++;
+    #pragma omp parallel for default(shared) reduction(max:ngroups) schedule(static)
+    for (Int_t i=0;i<nbodies;i++) if (ngroups < pfof[i]) ngroups = pfof[i];
+    numingroup = BuildNumInGroup(nbodies, ngroups, pfof);
     for (auto i=1;i<=ngroups;i++) {
         if (numingroup[i]<minsize) numingroup[i] = 0;
-        else newnumgroups++;
+        else index.push_back(i);
     }
+    newnumgroups = index.size();
     //if no groups are large enough, zero and return
     if (newnumgroups == 0) {
         #pragma omp parallel for default(shared)
         for (auto i=0;i<nbodies;i++) {
             pfof[i] = 0;
         }
-        ngroups = newnumgroups;
-        return ngroups;
+        delete[] numingroup;
+        return newnumgroups;
     }
 
     //otherwise, remap group ids so as to be in decreasing group size
-    //first set all pfof values for all groups below minsize to zero
-    for (auto i=0;i<nbodies;i++) {
-        if (pfof[i] == 0) continue;
-        if (numingroup[pfof[i]]<minsize) pfof[i] = 0;
-    }
-    pq = new PriorityQueue(newnumgroups);
-    for (auto i=1;i<=ngroups;i++) {
-        if (numingroup[i] == 0) continue;
-        pq->Push(index[i],numingroup[i]);
-    }
-    ngroups = newnumgroups;
-    newnumgroups = 0;
-    //generate map
-    for (auto i=0;i<ngroups;i++) {
-        pfofoldtonew[pq->TopQueue()] = ++newnumgroups;
-        pq->Pop();
-    }
-    delete pq;
+    stable_sort(index.begin(), index.end(), [numingroup](Int_t a, Int_t b){return numingroup[a]>numingroup[b];});
+    //generate map, with groups below minsize mapped to zero
+    pfofoldtonew.resize(ngroups+1,0);
+    for (auto i=0;i<newnumgroups;i++) pfofoldtonew[index[i]] = i+1;
+    delete[] numingroup;
     //set new group id values stored in pfof
-    for (auto i=0;i<nbodies;i++) {
+    #pragma omp parallel for default(shared) schedule(static)
+    for (Int_t i=0;i<nbodies;i++) {
         if (pfof[i] == 0) continue;
         pfof[i]=pfofoldtonew[pfof[i]];
     }
-    return ngroups;
+    return newnumgroups;
 }
 
 void OpenMPHeadNextUpdate(const Int_t nbodies, vector<Particle> &Part, const Int_t numgroups, Int_t *&pfof, Int_tree_t *&Head, Int_tree_t *&Next){
@@ -58,13 +58,15 @@ void AdjustStarQuantities(Options &opt, vector<Particle> &Part, const Int_t nbod
 void AdjustBHQuantities(Options &opt, vector<Particle> &Part, const Int_t nbodies);
 
 ///Read local velocity density
-void ReadLocalVelocityDensity(Options &opt, const Int_t nbodies, vector<Particle> &Part);
+bool ReadLocalVelocityDensity(Options &opt, const Int_t nbodies, vector<Particle> &Part);
+LocalDenRecord *MapLocalVelocityDensityFile(const char *fname, LocalDenHeader &header, void *&map, size_t &maplength);
 ///Writes local velocity density of each particle to a file
 void WriteLocalVelocityDensity(Options &opt, const Int_t nbodies, vector<Particle> &Part);
 
 
 ///Writes a tipsy formatted fof.grpfile
 void WriteFOF(Options &opt, const Int_t nbodies, Int_t *pfof);
+void WriteFOF(Options &opt, const Int_t nbodies, Int_t *pfof, const char *fname);
 ///Writes a pg list file (first in effective index order of input file(s), second is particle ids
 void WritePGList(Options &opt, const Int_t ngroups, const Int_t ng, Int_t *numingroup, Int_t **pglist, Int_t *ids);
 ///Write catalog information (number of groups, number in groups, number of particles in groups, particle pids)
@@ -153,6 +155,8 @@ void FillTreeGrid(Options &opt, const Int_t nbodies, const Int_t ngrid, KDTree *
 Coordinate *GetCellVel(Options &opt, const Int_t nbodies, Particle *Part, Int_t ngrid, GridCell *grid);
 ///Calculate velocity dispersion tensor of cell
 Matrix *GetCellVelDisp(Options &opt, const Int_t nbodies, Particle *Part, Int_t ngrid, GridCell *grid, Coordinate *gvel);
+///Invert velocity dispersion tensors of cells using Cholesky decomposition
+Int_t InvertCellVelDisp(const Int_t ngrid, Matrix *gveldisp, bool runomp);
 //@}
 
 /// \name Subroutines to calculate local velocity density
@@ -165,10 +169,25 @@ void GetVelocityDensity(Options &opt, const Int_t nbodies, Particle *Part, KDTre
 void GetVelocityDensityOld(Options &opt, const Int_t nbodies, Particle *Part, KDTree *tree);
 ///Velocity density where only particles in a halo (which is localised to an mpi domain) are within the tree
 void GetVelocityDensityHaloOnlyDen(Options &opt, const Int_t nbodies, Particle *Part, KDTree *tree);
+///Velocity density where only particles in a (sub)structure are used, reusing densities of particles whose neighbours are unchanged
+void GetVelocityDensityReuse(Options &opt, const Int_t nbodies, Particle *Part, Int_t *globalindex, int sublevel, velden_sub_cache &cache);
 ///exact velocity density, finds for each particle nearest physical neighbours and estimates velocity
 void GetVelocityDensityExact(Options &opt, const Int_t nbodies, Particle *Part, KDTree *tree);
 ///optimised search for cosmological simulations
 void GetVelocityDensityApproximative(Options &opt, const Int_t nbodies, Particle *Part, KDTree *tree);
+///get the particle index ranges of the leaf nodes of a tree
+void GetLeafNodeRanges(KDTree *tree, const Int_t nbodies, vector<leaf_node_info> &leafnodes);
+///gather candidate neighbours containing the nearest neighbours of all particles in a leaf node
+Int_t GetLeafNNCandidates(KDTree *tree, Particle *Part, const Int_t istart, const Int_t iend, const int k, const Double_t period,
+    const bool iactiveonly, leaf_nn_buffer &buf, Int_t *nnids, Double_t *nnr2);
+///find the nearest neighbours of a particle from the candidates of its leaf node
+int FindNearestLeafCandidates(Particle &p, const int k, const Double_t period, leaf_nn_buffer &buf, Int_t *nnids, Double_t *nnr2);
+///calculate the velocity density of a particle from its physical neighbours
+Double_t CalcVelDensityFromNN(KDTree *tree, Particle *Part, const Int_t i, Int_t *nnids, const int nsearch, const int nvel,
+    PriorityQueue *pqv, Double_t *weight, const bool iexcludeself);
+///compare the velocity density found with single precision neighbour selection to that found in double precision, returning whether it differs too much
+bool CheckVelDensityPrecision(Options &opt, KDTree *tree, Particle *Part, const Int_t i, leaf_nn_buffer &buf, Int_t *nnids, Double_t *nnr2,
+    PriorityQueue *pqv, Double_t *weight, const bool iexcludeself, Int_t &ncheck, Double_t &sumdiff, Double_t &maxdiff);
 //@}
 
 /// \name Suboutines that compare local velocity density to background
@@ -177,6 +196,14 @@ void GetVelocityDensityApproximative(Options &opt, const Int_t nbodies, Particle
 
 ///Calculate logarithmic contrast between local velocity density and background velocity density
 void GetDenVRatio(Options &opt, const Int_t nbodies, Particle *Part, Int_t ngrid, GridCell *grid, Coordinate *gvel, Matrix *gveldisp);
+#ifdef USEMPI
+///Determine the region containing the nearest grid cells of all local particles, used to import neighbouring cells of other mpi threads
+void GetDenVRatioGridRequest(const Int_t nbodies, Particle *Part, const Int_t nlocalgrid, vector<Int_t> &celloffset, vector<Int_t> &cellparts,
+    vector<Coordinate> &cellxm, Double_t xreq[6]);
+#endif
+///Bin the ratio distribution using per thread histograms that are merged (and combined across mpi processes if impi)
+void FillDenVRatioHistogram(const Int_t nbodies, Particle *Part, DenVRatioHistogram &hist, Double_t wmin, Double_t wmax,
+    Double_t cmin, Double_t cmax, Int_t &ncount, bool impi);
 ///Characterize the ratio distribution to estimate intrinsic scatter in this estimator
 void DetermineDenVRatioDistribution(Options &opt,const Int_t nbodies, Particle *Part, Double_t &meanr,Double_t &sdlow,Double_t &sdhigh, int subleve=0);
 ///Calculate normalized residual
@@ -206,9 +233,20 @@ Int_t *SearchFullSet(Options &opt, const Int_t nbodies, vector<Particle> &Part,
 Int_t *SearchSubset(Options &opt, const Int_t nbodies, const Int_t nsubset, Particle *Partsubset, Int_t &numgroups, Int_t sublevel=0, Int_t *pnumcores=NULL);
 ///Search for subsubstructures
 void SearchSubSub(Options &opt, const Int_t nsubset, vector<Particle> &Partsubset, Int_t *&pfof, Int_t &ngroup, Int_t &nhalos, PropData *pdata=NULL);
+///Search a (sub)structure for substructure, searching the substructures found as tasks if requested
+void SearchSubSubObject(Options &opt, const SubSearchContext *context, Options **threadopt, Particle *Partsubset, Int_t num, Int_t *pglist, int sublevel,
+    velden_sub_cache *veldencache, Double_t *parentell, SubSearchResult *res, bool itask, int minsizenext);
+///Pre-screen a substructure using the outlier values its particles had in its parent
+bool SubSearchPrescreen(Options &opt, Int_t num, Int_t *pglist, Double_t *parentell);
 ///Given a set of tagged core particles, assign surroundings
 void HaloCoreGrowth(Options &opt, const Int_t nsubset, Particle *&Partsubset, Int_t *&pfof, Int_t *&pfofbg, Int_t &numgroupsbg, Double_t param[], vector<Double_t> &dispfac,
     int numactiveloops, vector<int> &corelevel, int nthreads);
+///Assign untagged particles to the closest core using the phase-space centres and dispersions of the cores
+Int_t AssignParticlesToPhaseCores(Particle *Partsubset, Int_t *pfofbg, vector<Int_t> &activelist, Int_t numgroupsbg, int iloop,
+    vector<Double_t> &corecm, vector<Double_t> &coreinvdisp, vector<Double_t> &mcore, vector<Double_t> &dispfac, vector<int> &corelevel);
+///Assign untagged particles to the core of the closest of their nearest core particles
+void AssignParticlesToNearestCores(const Int_t nsubset, Particle *Partsubset, Int_t *pfof, Int_t *pfofbg,
+    Int_t nincore, Particle *Pcore, KDTree *tcore, int nsearch, Double_t param[], vector<Double_t> &mcore);
 ///merge substructures and cores if phase-space positions overlap
 void MergeSubstructuresCoresPhase(Options &opt, const Int_t nsubset, Particle *&Partsubset, Int_t *&pfof, Int_t &numsubs, Int_t &numcores);
 ///merge substructures if phase-space positions overlap
@@ -219,10 +257,22 @@ void RemoveSpuriousDynamicalSubstructures(Options &opt, const Int_t nsubset, Int
 int CheckSignificance(Options &opt, const Int_t nsubset, Particle *Partsubset, Int_t &numgroups, Int_t *numingroups, Int_t *pfof, Int_t **pglist);
 ///Search for Baryonic structures associated with dark matter structures in phase-space
 Int_t* SearchBaryons(Options &opt, Int_t &nbaryons, Particle *&Pbaryons, const Int_t ndark, vector<Particle> &Partsubset, Int_t *&pfofdark, Int_t &ngroupdark, Int_t &nhalos, int ihaloflag=0, int iinclusive=0, PropData *phalos=NULL);
+///Get the levels of the structure hierarchy
+vector<StrucLevelData*> GetHierarchyLevels();
+///Flatten the structure hierarchy into parent index arrays
+void BuildStrucHierarchy(Int_t ngroups, StrucHierarchy &h);
 ///Get the hierarchy of structures found
 Int_t GetHierarchy(Options &opt, Int_t ngroups, Int_t *nsub, Int_t *parentgid, Int_t *uparentgid, Int_t *stype);
 ///Copy hierarchy to PropData structure
 void CopyHierarchy(Options &opt, PropData *pdata,Int_t ngroups, Int_t *nsub, Int_t *parentgid, Int_t *uparentgid, Int_t *stype);
+///Store physical neighbours of particles in 3DFOF groups found using the 3DFOF tree
+void FOF3DCacheNeighbours(Options &opt, const Int_t nbodies, vector<Particle> &Part, Int_t *pfof, KDTree *tree, Double_t rdist2,
+    vector<Int_t> &nnoffset, vector<Int_t> &nnlist);
+///6DFOF search of a group using stored 3DFOF neighbours
+Int_t *FOF6DCachedNeighbours(const Int_t n, Particle *Part, Int_t *ids, const Int_t noffset, Int_t *sortindex,
+    vector<Int_t> &nnoffset, vector<Int_t> &nnlist, Double_t ellx2, Double_t ellv2, Int_t minsize, Int_t &numgroups);
+///3DFOF search for several linking lengths using a single tree and neighbour search, writing group arrays for each
+void SearchFOFLinkingLengthSweep(Options &opt, const Int_t nbodies, vector<Particle> &Part);
 ///Adjust particles in structures for period such that all substructure searches no longer have to run periodic searches
 void AdjustStructureForPeriod(Options &opt, const Int_t nbodies, vector<Particle> &Part, Int_t numgroups, Int_t *pfof);
 ///Adjust halo (object) positions back to inside the periodic volume.
@@ -273,7 +323,7 @@ void GetNodeList(Node *np, Int_t &ncell, Node **nodelist, const Int_t bsize);
 inline void MarkCell(Node *np, Int_t *marktreecell, Int_t *markleafcell, Int_t &ntreecell, Int_t &nleafcell, const Int_t bsize, Double_t *cR2max, Coordinate *cm, Double_t *cmtot, Coordinate xpos, Double_t eps2);
 
 ///Interface for unbinding proceedure
-int CheckUnboundGroups(Options opt, const Int_t nbodies, Particle *Part, Int_t &ngroup, Int_t *&pfof, Int_t *numingroup=NULL, Int_t **pglist=NULL,int ireorder=1, Int_t *groupflag=NULL);
+int CheckUnboundGroups(Options &opt, const Int_t nbodies, Particle *Part, Int_t &ngroup, Int_t *&pfof, Int_t *numingroup=NULL, Int_t **pglist=NULL,int ireorder=1, Int_t *groupflag=NULL);
 ///check if group self-bound
 int Unbind(Options &opt, Particle **gPartList, Int_t &numgroups, Int_t *numingroup, Int_t *pfof, Int_t **pglist, int ireorder=1);
 int Unbind(Options &opt, Particle *Part, Int_t &numgroups, Int_t *&numingroup, Int_t *&noffset, Int_t *&pfof);
@@ -281,6 +331,16 @@ int Unbind(Options &opt, Particle *Part, Int_t &numgroups, Int_t *&numingroup, I
 void Potential(Options &opt, Int_t nbodies, Particle *Part, Double_t *potV);
 void Potential(Options &opt, Int_t nbodies, Particle *Part);
 void PotentialPP(Options &opt, Int_t nbodies, Particle *Part);
+///Set the crossover between direct summation and tree potential calculations from timings
+void CalibratePotentialPPCrossover(Options &opt);
+///Calculate potential with a dual tree walk using quadrupole moments (fast multipole method)
+void PotentialFMM(Options &opt, Int_t nbodies, Particle *Part);
+void FMMBuildTree(Options &opt, KDTree *tree, Int_t nbodies, Particle *Part, FMMTree &fmm, bool runomp);
+void FMMMoments(FMMTree &fmm, bool runomp);
+void FMMInteract(FMMTree &fmm, Int_t a, Int_t b, Double_t theta2, Double_t eps2, Double_t *psi);
+void FMMPotential(Options &opt, FMMTree &fmm, vector<Double_t> &psi, bool runomp);
+void FMMBuildGroupTree(Options &opt, Int_t nbodies, Particle *Part, FMMTree &fmm, vector<Int_t> &treeslot);
+void FMMRemoveParticles(FMMTree &fmm, Int_t nremove, Int_t *treeids);
 //@}
 
 /// \name Routines to determine bulk quantities of halo and adjust halo
@@ -349,6 +409,8 @@ void CalcVelSigmaTensor(const Int_t n, Particle *p, Double_t &a, Double_t &b, Do
 void CalcPhaseSigmaTensor(const Int_t n, Particle *p, GMatrix &eigenvalues, GMatrix& eigenvec, GMatrix &I, int itype=-1);
 ///Calculate phase-space dispersion tensor
 void CalcPhaseSigmaTensor(const Int_t n, Particle *p, GMatrix &I, int itype=-1);
+///Calculate phase-space centre of mass and dispersion tensor about it
+void CalcPhaseCMSigmaTensor(const Int_t n, Particle *p, GMatrix &cm, GMatrix &I, int itype=-1);
 ///Calculate the reduced weighted inertia tensor used to determine the spatial morphology
 void CalcMTensor(Matrix& M, const Double_t q, const Double_t s, const Int_t n, Particle *p, int itype);
 ///Same as \ref CalcMTensor but include mass
@@ -357,6 +419,10 @@ void CalcMTensorWithMass(Matrix& M, const Double_t q, const Double_t s, const In
 void RotParticles(const Int_t n, Particle *p, Matrix &R);
 ///get phase-space center-of-mass
 GMatrix CalcPhaseCM(const Int_t n, Particle *p, int itype=-1);
+///get phase-space center-of-mass and second moments in a single pass
+PhaseMoments CalcPhaseMoments(const Int_t n, Particle *p, int itype=-1, bool itensor=false);
+///get phase-space center-of-mass and second moments of all groups in a single pass
+void CalcGroupPhaseMoments(const Int_t nsubset, Particle *Partsubset, Int_t *pfof, const Int_t ngroups, vector<PhaseMoments> &moments, bool itensor=false);
 
 ///get concentration routines associted with finding concentrations via root finding
 void CalcConcentration(PropData &p);
@@ -738,6 +804,9 @@ Int_t MPIBaryonExchange(const Int_t nbaryons, Particle *&Pbaryons, Int_t *&pfofb
 
 ///Effectively is an allgather for the grid data so that particles can find nearest cells and use appropriate nearest neighbouring cells for calculating estimated background velocity density function
 void MPIBuildGridData(const Int_t ngrid, GridCell *grid, Coordinate *gvel, Matrix *gveldisp);
+///Imports only the grid cells of other mpi threads that lie within the region containing the nearest cells of local particles
+Int_t MPIBuildGridHalo(const Int_t ngrid, GridCell *grid, Coordinate *gvel, Matrix *gveldisp, Double_t xreq[6],
+    GridCell *&halogrid, Coordinate *&halogvel, Matrix *&halogveldisp);
 ///Determine number of particles that need to be exported to another mpi thread from local mpi thread based on array of distances for each particle for NN search
 void MPIGetNNExportNum(const Int_t nbodies, Particle *Part, Double_t *rdist);
 #ifdef SWIFTINTERFACE
@@ -800,6 +869,8 @@ Int_t **BuildPGList(const Int_t nbodies, const Int_t numgroups, Int_t *numingrou
 Particle **BuildPartList(const Int_t numgroups, Int_t *numingroup, Int_t **pglist, Particle* Part, bool ikeepextrainfo = false);
 ///build a particle list subset using array of indices
 Particle *BuildPart(Int_t numingroup, Int_t *pglist, Particle* Part, bool ikeepextrainfo = false);
+///fill a particle list subset with only the quantities used by the substructure search
+void FillPartLean(Int_t numingroup, Int_t *pglist, Particle *Part, Particle *gPart);
 ///build the Head array which points to the head of the group a particle belongs to
 Int_tree_t *BuildHeadArray(const Int_t nbodies, const Int_t numgroups, Int_t *numingroup, Int_t **pglist);
 ///build the Next array which points to the next particle in the group
@@ -826,6 +897,8 @@ void ReorderGroupIDsAndArraybyValue(const Int_t numgroups, const Int_t newnumgro
 void ReorderGroupIDsAndArraybyValue(const Int_t numgroups, const Int_t newnumgroups, Int_t *numingroup, Int_t *pfof, Int_t **pglist, Double_t *value, Double_t *gdata);
 ///reorder groups and the associated property data by value
 void ReorderGroupIDsAndHaloDatabyValue(const Int_t numgroups, const Int_t newnumgroups, Int_t *numingroup, Int_t *pfof, Int_t **pglist, Int_t *value, PropData *pdata);
+///sort particles by their Morton key so that particles close in space are close in memory. Resets particle ids to index order
+void SortParticlesByMortonKey(Options &opt, const Int_t nbodies, Particle *Part);
 //@}
 
 
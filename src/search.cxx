@@ -45,6 +45,9 @@ Int_t* SearchFullSet(Options &opt, const Int_t nbodies, vector<Particle> &Part,
     KDTree **tree3dfofomp = NULL;
     Int_t *p3dfofomp = NULL;
     int iorder = 1;
+    //to store the neighbours found with the 3dfof tree if these are used in the 6dfof search
+    bool icachedfof6d = false;
+    vector<Int_t> nncacheoffset, nncachelist, sortindex;
 #ifndef USEMPI
     int ThisTask=0,NProcs=1;
     Int_t Nlocal=nbodies;
@@ -235,6 +238,14 @@ Int_t* SearchFullSet(Options &opt, const Int_t nbodies, vector<Particle> &Part,
 
 #ifndef USEMPI
     totalgroups=numgroups;
+    //if 6dfof search uses the physical neighbours found with the 3dfof tree, store them before the tree is freed
+    if (opt.iFOF6DCachedNeighbours && opt.fofbgtype<=FOF6D && numgroups>0 && tree!=NULL) {
+        time3=MyGetTime();
+        FOF3DCacheNeighbours(opt, nbodies, Part, pfof, tree,
+            param[1]*opt.ellhalo6dxfac*opt.ellhalo6dxfac, nncacheoffset, nncachelist);
+        icachedfof6d = true;
+        if (opt.iverbose) cout<<ThisTask<<": stored "<<nncachelist.size()<<" 3dfof neighbours for 6dfof search in "<<MyGetTime()-time3<<endl;
+    }
     //if this flag is set, calculate localfield value here for particles possibly resident in a field structure
 #ifdef STRUCDEN
     if (numgroups>0 && (opt.iSubSearch==1&&opt.foftype!=FOF6DCORE)) {
@@ -491,6 +502,11 @@ Int_t* SearchFullSet(Options &opt, const Int_t nbodies, vector<Particle> &Part,
         //store index order
         ids=new Int_t[Nlocal];
         for (i=0;i<Nlocal;i++) ids[i]=Part[i].GetID();
+        //and if using cached neighbours, store where each particle now resides
+        if (icachedfof6d) {
+            sortindex.resize(Nlocal);
+            for (i=0;i<Nlocal;i++) sortindex[ids[i]]=i;
+        }
     }
     else {
         storetype = NULL;
@@ -624,6 +640,12 @@ private(i,tid,xscaling,vscaling)
 #endif
             //if adaptive 6dfof, set params
             if (opt.fofbgtype==FOF6DADAPTIVE) paramomp[2+tid*20]=paramomp[7+tid*20]=vscale2array[i];
+            //if neighbours stored from 3dfof search, just link these pairs in phase-space
+            if (icachedfof6d) {
+                pfofomp[i]=FOF6DCachedNeighbours(numingroup[i], &(Part.data()[noffset[i]]), &ids[noffset[i]], noffset[i],
+                    sortindex.data(), nncacheoffset, nncachelist, paramomp[1+tid*20], paramomp[2+tid*20], minsize, ngomp[i]);
+                continue;
+            }
             //scale particle positions
             xscaling=1.0/sqrt(paramomp[1+tid*20]);
             vscaling=1.0/sqrt(paramomp[2+tid*20]);
@@ -643,6 +665,11 @@ private(i,tid,xscaling,vscaling)
 #endif
     }
     if(opt.fofbgtype==FOF6DADAPTIVE || opt.iKeepFOF) delete[] vscale2array;
+    if (icachedfof6d) {
+        vector<Int_t>().swap(nncacheoffset);
+        vector<Int_t>().swap(nncachelist);
+        vector<Int_t>().swap(sortindex);
+    }
     //now get new num groups
     ng = 0; for (i=1;i<=iend;i++) ng += ngomp[i];
 
@@ -869,16 +896,8 @@ private(i,tid,xscaling,vscaling)
             delete[] value6d3d;
 
             //initialize next level which stores halos
-            psldata->nextlevel = new StrucLevelData();
-            psldata->nextlevel->Phead = new Particle*[ng+1];
-            psldata->nextlevel->gidhead = new Int_t*[ng+1];
-            psldata->nextlevel->Pparenthead = new Particle*[ng+1];
-            psldata->nextlevel->gidparenthead = new Int_t*[ng+1];
-            psldata->nextlevel->giduberparenthead = new Int_t*[ng+1];
-            psldata->nextlevel->stypeinlevel = new Int_t[ng+1];
+            psldata->nextlevel = new StrucLevelData(ng);
             psldata->nextlevel->stype = HALOSTYPE;
-            psldata->nextlevel->nsinlevel = ng;
-            psldata->nextlevel->nextlevel = NULL;
 
             for (i = 0; i <= ng; i++)
             {
@@ -966,6 +985,254 @@ private(i,j,diff,gid)
 #endif
 }
 
+/*!
+    Store the physical neighbours of particles in 3DFOF groups using the tree built for the 3DFOF search.
+    Only neighbours within rdist2 and belonging to the same group are kept. Lists are stored in compressed form such that
+    the neighbours of the particle with index (id) i are nnlist[nnoffset[i]] to nnlist[nnoffset[i+1]-1], where neighbours are also stored by index.
+    These pairs are used by \ref FOF6DCachedNeighbours so that the 6DFOF search need not build and search a tree for every 3DFOF group.
+    Since the neighbours of a particle are not known before searching, each thread stores its lists locally and these
+    are copied to the final array once the offsets are known. Both loops use the same static schedule so each thread processes the same particles.
+*/
+void FOF3DCacheNeighbours(Options &opt, const Int_t nbodies, vector<Particle> &Part, Int_t *pfof, KDTree *tree, Double_t rdist2,
+    vector<Int_t> &nnoffset, vector<Int_t> &nnlist)
+{
+    Int_t i;
+    int nthreads=1,tid=0;
+    vector<Int_t> nncount(nbodies,0);
+    vector<Int_t> tagged;
+#ifdef USEOPENMP
+#pragma omp parallel
+    {
+    if (omp_get_thread_num()==0) nthreads=omp_get_num_threads();
+    }
+#endif
+    vector<vector<Int_t> > threadlist(nthreads);
+    nnoffset.resize(nbodies+1);
+#ifdef USEOPENMP
+#pragma omp parallel default(shared) \
+private(i,tid,tagged)
+{
+    tid=omp_get_thread_num();
+#pragma omp for schedule(static)
+#endif
+    for (i=0;i<nbodies;i++) {
+        Int_t index=Part[i].GetID(), gid=pfof[index];
+        if (gid==0) continue;
+        tagged=tree->SearchBallPosTagged(i,rdist2);
+        for (auto &j:tagged) {
+            if (j==i) continue;
+            if (pfof[Part[j].GetID()]!=gid) continue;
+            threadlist[tid].push_back(Part[j].GetID());
+            nncount[index]++;
+        }
+    }
+#ifdef USEOPENMP
+#pragma omp single
+{
+#endif
+    nnoffset[0]=0;
+    for (Int_t j=0;j<nbodies;j++) nnoffset[j+1]=nnoffset[j]+nncount[j];
+    nnlist.resize(nnoffset[nbodies]);
+#ifdef USEOPENMP
+}
+#endif
+    Int_t ilocal=0;
+#ifdef USEOPENMP
+#pragma omp for schedule(static)
+#endif
+    for (i=0;i<nbodies;i++) {
+        Int_t index=Part[i].GetID();
+        if (pfof[index]==0) continue;
+        for (Int_t j=0;j<nncount[index];j++) nnlist[nnoffset[index]+j]=threadlist[tid][ilocal++];
+    }
+    vector<Int_t>().swap(threadlist[tid]);
+#ifdef USEOPENMP
+}
+#endif
+    GetMemUsage(opt, __func__+string("--line--")+to_string(__LINE__), (opt.iverbose>=1));
+}
+
+/*!
+    6DFOF search of particles Part[0] to Part[n-1], which have been sorted so that they start at position noffset of the full particle array,
+    using the neighbour lists produced by \ref FOF3DCacheNeighbours. ids stores the original index of these particles and sortindex maps
+    the original index to the sorted position. Pairs are linked if \f$ \Delta x^2/\ell_x^2+\Delta v^2/\ell_v^2\leq1 \f$, the same criterion
+    used when running FOF on a tree of scaled phase-space coordinates.
+    Returns group ids ordered by size with groups smaller than minsize set to zero. As with a tree search, the particle ids are set to their local index.
+*/
+Int_t *FOF6DCachedNeighbours(const Int_t n, Particle *Part, Int_t *ids, const Int_t noffset, Int_t *sortindex,
+    vector<Int_t> &nnoffset, vector<Int_t> &nnlist, Double_t ellx2, Double_t ellv2, Int_t minsize, Int_t &numgroups)
+{
+    Int_t *pfof=new Int_t[n];
+    vector<Int_t> head(n), len(n,0), gidval(n,0), roots;
+    Double_t ellxinv2=1.0/ellx2, ellvinv2=1.0/ellv2, dx2, dv2;
+    //find head of group, compressing the path as one goes
+    auto findhead = [&head](Int_t j) {
+        while (head[j]!=j) {head[j]=head[head[j]];j=head[j];}
+        return j;
+    };
+    for (Int_t j=0;j<n;j++) head[j]=j;
+    for (Int_t j=0;j<n;j++) {
+        Int_t index=ids[j];
+        for (Int_t k=nnoffset[index];k<nnoffset[index+1];k++) {
+            Int_t jj=sortindex[nnlist[k]]-noffset;
+            //pairs are symmetric so only check once
+            if (jj<=j || jj>=n) continue;
+            dx2=dv2=0;
+            for (int l=0;l<3;l++) {
+                dx2+=(Part[j].GetPosition(l)-Part[jj].GetPosition(l))*(Part[j].GetPosition(l)-Part[jj].GetPosition(l));
+                dv2+=(Part[j].GetVelocity(l)-Part[jj].GetVelocity(l))*(Part[j].GetVelocity(l)-Part[jj].GetVelocity(l));
+            }
+            if (dx2*ellxinv2+dv2*ellvinv2>1.0) continue;
+            Int_t h1=findhead(j), h2=findhead(jj);
+            if (h1==h2) continue;
+            if (h1<h2) head[h2]=h1;
+            else head[h1]=h2;
+        }
+    }
+    for (Int_t j=0;j<n;j++) {head[j]=findhead(j);len[head[j]]++;}
+    for (Int_t j=0;j<n;j++) if (head[j]==j && len[j]>=minsize) roots.push_back(j);
+    //order groups by size
+    stable_sort(roots.begin(), roots.end(), [&len](Int_t a, Int_t b){return len[a]>len[b];});
+    numgroups=roots.size();
+    for (Int_t j=0;j<numgroups;j++) gidval[roots[j]]=j+1;
+    for (Int_t j=0;j<n;j++) {
+        pfof[j]=gidval[head[j]];
+        Part[j].SetID(j);
+    }
+    return pfof;
+}
+
+/*!
+    3DFOF search for each of the linking lengths given by \ref Options.ellhalo3dsweepfacs times the halo linking length.
+    Rather than building a tree and running FOF for every linking length, the search is run once at the largest linking length and
+    the pairs of particles within this distance in the same group are stored with \ref FOF3DCacheNeighbours.
+    FOF groups at a linking length b are the connected components of the pairs separated by at most b, so sorting the pairs by separation
+    and linking them in order (ie: building the minimum spanning forest, Kruskal) gives the groups at every linking length in a single pass,
+    with the groups being stored once all pairs with separations up to the next linking length have been linked.
+    Groups are ordered by size, those smaller than \ref Options.HaloMinSize are discarded and each group array is written with \ref WriteFOF
+    in input order to <outname>.fof.llfac<factor>.grp. As in \ref SearchFullSet, if baryons are searched for separately only dark matter particles are linked.
+    The particle order is left unchanged.
+*/
+void SearchFOFLinkingLengthSweep(Options &opt, const Int_t nbodies, vector<Particle> &Part)
+{
+    Int_t i, numgroups;
+    Int_t *pfof;
+    Double_t *period=NULL;
+    Double_t time1, time2, ell2, ellmax2, dx, d2;
+    KDTree *tree=NULL;
+    vector<Double_t> facs(opt.ellhalo3dsweepfacs);
+    vector<Int_t> nnoffset, nnlist, treeindex(nbodies), npairs(nbodies+1,0), head(nbodies), len(nbodies), gidval(nbodies), roots;
+    vector<pair<Double_t, pair<Int_t,Int_t> > > pairs;
+    char fname[1000];
+    //as with FOF3dDM, only link dark matter particles if baryons are associated with groups afterwards
+    bool idmonly=(opt.partsearchtype==PSTALL && opt.iBaryonSearch>1);
+    vector<bool> islinked;
+
+    if (facs.size()==0) return;
+    time1=MyGetTime();
+    sort(facs.begin(),facs.end());
+    ell2=(opt.ellxscale*opt.ellxscale)*(opt.ellphys*opt.ellphys)*(opt.ellhalophysfac*opt.ellhalophysfac);
+    ellmax2=ell2*facs.back()*facs.back();
+    cout<<"Running 3DFOF for "<<facs.size()<<" linking lengths up to "<<sqrt(ellmax2)<<" Lunits"<<endl;
+    if (opt.p>0) {
+        period=new Double_t[3];
+        for (int j=0;j<3;j++) period[j]=opt.p;
+    }
+
+    //search at the largest linking length and store all linked pairs
+    time2=MyGetTime();
+    tree=new KDTree(Part.data(),nbodies,opt.Bsize,tree->TPHYS,tree->KEPAN,1000,0,0,0,period);
+    pfof=tree->FOF(sqrt(ellmax2),numgroups,opt.HaloMinSize,1);
+    if (numgroups>0) FOF3DCacheNeighbours(opt, nbodies, Part, pfof, tree, ellmax2, nnoffset, nnlist);
+    else nnoffset.assign(nbodies+1,0);
+    delete[] pfof;
+    if (opt.iverbose) cout<<"Found "<<numgroups<<" groups and stored "<<nnlist.size()<<" neighbours in "<<MyGetTime()-time2<<endl;
+
+    //store pairs once, along with their separation, and sort by separation
+    time2=MyGetTime();
+    for (i=0;i<nbodies;i++) treeindex[Part[i].GetID()]=i;
+    islinked.assign(nbodies,true);
+    if (idmonly) for (i=0;i<nbodies;i++) islinked[Part[i].GetID()]=(Part[i].GetType()==DARKTYPE);
+#ifdef USEOPENMP
+#pragma omp parallel for \
+default(shared) private(i) schedule(static) if (nbodies > ompsortsize)
+#endif
+    for (i=0;i<nbodies;i++) {
+        if (!islinked[i]) continue;
+        for (Int_t k=nnoffset[i];k<nnoffset[i+1];k++) if (nnlist[k]>i && islinked[nnlist[k]]) npairs[i+1]++;
+    }
+    for (i=0;i<nbodies;i++) npairs[i+1]+=npairs[i];
+    pairs.resize(npairs[nbodies]);
+#ifdef USEOPENMP
+#pragma omp parallel for \
+default(shared) private(i,dx,d2) schedule(static) if (nbodies > ompsortsize)
+#endif
+    for (i=0;i<nbodies;i++) {
+        if (npairs[i+1]==npairs[i]) continue;
+        Int_t ipair=npairs[i];
+        Particle *p1=&Part[treeindex[i]];
+        for (Int_t k=nnoffset[i];k<nnoffset[i+1];k++) {
+            Int_t j=nnlist[k];
+            if (j<=i || !islinked[j]) continue;
+            Particle *p2=&Part[treeindex[j]];
+            d2=0;
+            for (int l=0;l<3;l++) {
+                dx=p1->GetPosition(l)-p2->GetPosition(l);
+                if (opt.p>0) {
+                    if (dx>0.5*opt.p) dx-=opt.p;
+                    else if (dx<-0.5*opt.p) dx+=opt.p;
+                }
+                d2+=dx*dx;
+            }
+            pairs[ipair++]=make_pair(d2,make_pair(i,j));
+        }
+    }
+    vector<Int_t>().swap(nnoffset);
+    vector<Int_t>().swap(nnlist);
+    vector<Int_t>().swap(npairs);
+    vector<Int_t>().swap(treeindex);
+    vector<bool>().swap(islinked);
+    sort(pairs.begin(),pairs.end());
+    if (opt.iverbose) cout<<"Sorted "<<pairs.size()<<" pairs in "<<MyGetTime()-time2<<endl;
+
+    //find head of group, compressing the path as one goes
+    auto findhead = [&head](Int_t j) {
+        while (head[j]!=j) {head[j]=head[head[j]];j=head[j];}
+        return j;
+    };
+    for (i=0;i<nbodies;i++) head[i]=i;
+    pfof=new Int_t[nbodies];
+    size_t ipair=0;
+    for (auto &fac:facs) {
+        Double_t maxd2=ell2*fac*fac;
+        //link pairs in order of separation, only pairs that join two groups being part of the spanning forest
+        for (;ipair<pairs.size() && pairs[ipair].first<=maxd2;ipair++) {
+            Int_t h1=findhead(pairs[ipair].second.first), h2=findhead(pairs[ipair].second.second);
+            if (h1==h2) continue;
+            if (h1<h2) head[h2]=h1;
+            else head[h1]=h2;
+        }
+        for (i=0;i<nbodies;i++) len[i]=gidval[i]=0;
+        for (i=0;i<nbodies;i++) {head[i]=findhead(i);len[head[i]]++;}
+        roots.clear();
+        for (i=0;i<nbodies;i++) if (head[i]==i && len[i]>=opt.HaloMinSize) roots.push_back(i);
+        //order groups by size
+        stable_sort(roots.begin(), roots.end(), [&len](Int_t a, Int_t b){return len[a]>len[b];});
+        numgroups=roots.size();
+        for (i=0;i<numgroups;i++) gidval[roots[i]]=i+1;
+        for (i=0;i<nbodies;i++) pfof[i]=gidval[head[i]];
+        cout<<"Linking length factor "<<fac<<" ("<<sqrt(maxd2)<<" Lunits) : found "<<numgroups<<" groups"<<endl;
+        sprintf(fname,"%s.fof.llfac%g.grp",opt.outname,fac);
+        WriteFOF(opt,nbodies,pfof,fname);
+    }
+    delete[] pfof;
+
+    //free memory
+    delete tree;
+    if (period!=NULL) delete[] period;
+    cout<<"TIME:: took "<<MyGetTime()-time1<<" to run linking length sweep"<<endl;
+}
+
 //@}
 
 ///\name Search using outliers from background velocity distribution.
@@ -1890,22 +2157,18 @@ void HaloCoreGrowth(Options &opt, const Int_t nsubset, Particle *&Partsubset, In
     int numactiveloops, vector<int> &corelevel,
     int nthreads){
     //for simplicity make a new particle array storing core particles
-    Int_t nincore=0,nbucket=opt.Bsize,pid, pidcore;
-    Particle *Pcore,*Pval;
+    Int_t nincore=0,nbucket=opt.Bsize,pid;
+    Particle *Pcore;
     KDTree *tcore;
-    Coordinate x1;
-    Double_t D2, dval, mval, weight;
+    Double_t D2;
     vector<Double_t> mcore(numgroupsbg+1, 0.0);
     vector<Int_t> ncore(numgroupsbg+1, 0);
     vector<Int_t> newcore(numgroupsbg+1, 0);
     Int_t newnumgroupsbg=0;
     int nsearch=opt.Nvel;
     int mincoresize;
-    int tid,i;
-    Int_t **nnID;
-    Double_t **dist2;
+    int i;
     PriorityQueue *pq;
-    Int_t nactivepart=nsubset;
     vector<Int_t> noffset(numgroupsbg+1,0);
 
     //determine the weights for the cores dispersions factors
@@ -1927,7 +2190,6 @@ void HaloCoreGrowth(Options &opt, const Int_t nsubset, Particle *&Partsubset, In
         //about their centres and use this to determine distances
         if (opt.iPhaseCoreGrowth) {
             if (opt.iverbose>=2) cout<<"Searching untagged particles to assign to cores using full phase-space metrics"<<endl;
-            vector<GMatrix> dist(nthreads,GMatrix(6,1));
             vector<GMatrix> cmphase(numgroupsbg+1,GMatrix(6,1));
             vector<GMatrix> invdisp(numgroupsbg+1,GMatrix(6,6));
             GMatrix coredist(6,1);
@@ -1946,11 +2208,7 @@ void HaloCoreGrowth(Options &opt, const Int_t nsubset, Particle *&Partsubset, In
             for (i=2;i<=numgroupsbg;i++) noffset[i]=noffset[i-1]+ncore[i-1];
             //now get centre of masses and dispersions
             for (i=1;i<=numgroupsbg;i++) {
-                cmphase[i]=CalcPhaseCM(ncore[i], &Pcore[noffset[i]]);
-                for (int j=0;j<ncore[i];j++) {
-                    for (int k=0;k<6;k++) Pcore[noffset[i]+j].SetPhase(k,Pcore[noffset[i]+j].GetPhase(k)-cmphase[i](k,0));
-                }
-                CalcPhaseSigmaTensor(ncore[i], &Pcore[noffset[i]], invdisp[i]);
+                CalcPhaseCMSigmaTensor(ncore[i], &Pcore[noffset[i]], cmphase[i], invdisp[i]);
                 ///\todo must be issue with either phase-space tensor or number of particles assigned as
                 ///it is possible to get haloes of size 0
                 invdisp[i]=invdisp[i].Inverse();
@@ -1978,78 +2236,22 @@ void HaloCoreGrowth(Options &opt, const Int_t nsubset, Particle *&Partsubset, In
             //otherwise recalculating dispersions at every level
             else if (opt.iPhaseCoreGrowth>=2) for (i=1;i<=numgroupsbg;i++) dispfac[i]=1.0;
 
-            for (Int_t iloop=numactiveloops;iloop>=0;iloop--) {
-#ifdef USEOPENMP
-            //if particle number large enough to warrant parallel search
-            if (nactivepart>ompperiodnum) {
-            int nreduce=0;
-#pragma omp parallel default(shared) \
-private(i,tid,Pval,D2,dval,mval,pid,weight)
-{
-#pragma omp for reduction(+:nreduce)
-            for (i=0;i<nsubset;i++)
-            {
-                tid=omp_get_thread_num();
-                Pval=&Partsubset[i];
-                if (Pval->GetType()<iloop) continue;
-                pid=Pval->GetID();
-                if (pfofbg[pid]==0 && pfof[pid]==0) {
-                    mval=mcore[1];
-                    for (int k=0;k<6;k++) dist[tid](k,0)=Pval->GetPhase(k)-cmphase[1](k,0);
-                    dval=(dist[tid].Transpose()*invdisp[1]*dist[tid])(0,0);
-                    pfofbg[pid]=1;
-                    for (int j=2;j<=numgroupsbg;j++) {
-                        if (mcore[j]>0 && corelevel[j]>=iloop){
-                            weight = 1.0/sqrt(mcore[j]/mval);
-                            for (int k=0;k<6;k++) dist[tid](k,0)=Pval->GetPhase(k)-cmphase[j](k,0);
-                            D2=(dist[tid].Transpose()*invdisp[j]*dist[tid])(0,0) * weight;
-                            if (dval*dispfac[pfofbg[pid]]>D2*dispfac[j]) {
-                                dval=D2;
-                                mval=mcore[j];
-                                pfofbg[pid]=j;
-                            }
-                        }
-                    }
-                    //if particle assigned to a core remove from search
-                    Pval->SetType(-1);
-                    nreduce++;
-                }
+            //particles that can still be assigned to a core
+            vector<Int_t> activelist;
+            for (i=0;i<nsubset;i++) {
+                pid=Partsubset[i].GetID();
+                if (pfofbg[pid]==0 && pfof[pid]==0) activelist.push_back(i);
             }
-}
-            nactivepart-=nreduce;
-            }
-            else {
-#endif
-            for (i=0;i<nsubset;i++)
-            {
-                tid=0;
-                Pval=&Partsubset[i];
-                if (Pval->GetType()<iloop) continue;
-                pid=Pval->GetID();
-                if (pfofbg[pid]==0 && pfof[pid]==0) {
-                    mval=mcore[1];
-                    for (int k=0;k<6;k++) dist[tid](k,0)=Pval->GetPhase(k)-cmphase[1](k,0);
-                    dval=(dist[tid].Transpose()*invdisp[1]*dist[tid])(0,0);
-                    pfofbg[pid]=1;
-                    for (int j=2;j<=numgroupsbg;j++) {
-                        if (mcore[j]>0 && corelevel[j]>=iloop){
-                            weight = 1.0/sqrt(mcore[j]/mval);
-                            for (int k=0;k<6;k++) dist[tid](k,0)=Pval->GetPhase(k)-cmphase[j](k,0);
-                            D2=(dist[tid].Transpose()*invdisp[j]*dist[tid])(0,0) * weight;
-                            if (dval*dispfac[pfofbg[pid]]>D2*dispfac[j]) {
-                                dval=D2;
-                                mval=mcore[j];
-                                pfofbg[pid]=j;
-                            }
-                        }
-                    }
-                    Pval->SetType(-1);
-                    nactivepart--;
+            vector<Double_t> corecm(6*(numgroupsbg+1)), coreinvdisp(36*(numgroupsbg+1));
+            for (Int_t iloop=numactiveloops;iloop>=0;iloop--) {
+            //store centres and inverse dispersions in flat arrays for the assignment kernel
+            for (i=1;i<=numgroupsbg;i++) {
+                for (int k=0;k<6;k++) {
+                    corecm[6*i+k]=cmphase[i](k,0);
+                    for (int l=0;l<6;l++) coreinvdisp[36*i+6*k+l]=invdisp[i](k,l);
                 }
             }
-#ifdef USEOPENMP
-            }
-#endif
+            AssignParticlesToPhaseCores(Partsubset, pfofbg, activelist, numgroupsbg, iloop, corecm, coreinvdisp, mcore, dispfac, corelevel);
             //otherwise, recalculate dispersions
             if (opt.iPhaseCoreGrowth>=2) {
                 nincore=0;
@@ -2070,11 +2272,7 @@ private(i,tid,Pval,D2,dval,mval,pid,weight)
                 for (i=2;i<=numgroupsbg;i++) noffset[i]=noffset[i-1]+ncore[i-1];
                 //now get centre of masses and dispersions
                 for (i=1;i<=numgroupsbg;i++) if (corelevel[i]>=iloop) {
-                    cmphase[i]=CalcPhaseCM(ncore[i], &Pcore[noffset[i]]);
-                    for (int j=0;j<ncore[i];j++) {
-                        for (int k=0;k<6;k++) Pcore[noffset[i]+j].SetPhase(k,Pcore[noffset[i]+j].GetPhase(k)-cmphase[i](k,0));
-                    }
-                    CalcPhaseSigmaTensor(ncore[i], &Pcore[noffset[i]], invdisp[i]);
+                    CalcPhaseCMSigmaTensor(ncore[i], &Pcore[noffset[i]], cmphase[i], invdisp[i]);
                     invdisp[i]=invdisp[i].Inverse();
                 }
                 delete[] Pcore;
@@ -2095,93 +2293,10 @@ private(i,tid,Pval,D2,dval,mval,pid,weight)
                 nincore++;
             }
             tcore=new KDTree(Pcore,nincore,opt.Bsize,tcore->TPHYS);
-            nnID=new Int_t*[nthreads];
-            dist2=new Double_t*[nthreads];
-            for (i=0;i<nthreads;i++) {
-                nnID[i]=new Int_t[nsearch];
-                dist2[i]=new Double_t[nsearch];
-            }
-            for (i=1;i<=numgroupsbg;i++) ncore[i]=0;
-#ifdef USEOPENMP
-            //if particle number large enough to warrant parallel search
-            if (nsubset>ompperiodnum) {
-#pragma omp parallel default(shared) \
-private(i,tid,Pval,x1,D2,dval,mval,pid,pidcore)
-{
-#pragma omp for
-            //for each particle in the subset if not assigned to any group (core or substructure) then assign particle
-            //this is done using either a simple distance/sigmax+velocity distance/sigmav calculation to the nearest core particles
-            //or if a more complex routine is required then ...
-            for (i=0;i<nsubset;i++)
-            {
-                tid=omp_get_thread_num();
-                Pval=&Partsubset[i];
-                pid=Pval->GetID();
-                if (pfofbg[pid]==0 && pfof[pid]==0) {
-                    x1=Coordinate(Pval->GetPosition());
-                    tcore->FindNearestPos(x1, nnID[tid], dist2[tid],nsearch);
-                    dval=0;
-                    pidcore=nnID[tid][0];
-                    //calculat distance from current particle to core particle
-                    for (int k=0;k<3;k++) {
-                        dval+=(Pval->GetPosition(k)-Pcore[pidcore].GetPosition(k))*(Pval->GetPosition(k)-Pcore[pidcore].GetPosition(k))/param[6]+(Pval->GetVelocity(k)-Pcore[pidcore].GetVelocity(k))*(Pval->GetVelocity(k)-Pcore[pidcore].GetVelocity(k))/param[7];
-                    }
-                    //get the core particle mass ratio
-                    mval=mcore[Pcore[pidcore].GetType()];
-                    pfofbg[pid]=Pcore[pidcore].GetType();
-                    //now initialized to first core particle, examine the rest to see if one is closer
-                    for (int j=1;j<nsearch;j++) {
-                        D2=0;
-                        pidcore=nnID[tid][j];
-                        for (int k=0;k<3;k++) {
-                            D2+=(Pval->GetPosition(k)-Pcore[pidcore].GetPosition(k))*(Pval->GetPosition(k)-Pcore[pidcore].GetPosition(k))/param[6]+(Pval->GetVelocity(k)-Pcore[pidcore].GetVelocity(k))*(Pval->GetVelocity(k)-Pcore[pidcore].GetVelocity(k))/param[7];
-                        }
-                        //if distance * mass weight is smaller than current distance, reassign particle
-                        if (dval>D2*mval/mcore[Pcore[pidcore].GetType()]) {dval=D2;mval=mcore[Pcore[pidcore].GetType()];pfofbg[pid]=Pcore[pidcore].GetType();}
-                    }
-                }
-            }
-}
-            }
-            else {
-#endif
-            for (i=0;i<nsubset;i++)
-            {
-                tid=0;
-                Pval=&Partsubset[i];
-                pid=Pval->GetID();
-                if (pfofbg[pid]==0 && pfof[pid]==0) {
-                    x1=Coordinate(Pval->GetPosition());
-                    tcore->FindNearestPos(x1, nnID[tid], dist2[tid],nsearch);
-                    dval=0;
-                    pidcore=nnID[tid][0];
-                    for (int k=0;k<3;k++) {
-                        dval+=(Pval->GetPosition(k)-Pcore[pidcore].GetPosition(k))*(Pval->GetPosition(k)-Pcore[pidcore].GetPosition(k))/param[6]+(Pval->GetVelocity(k)-Pcore[pidcore].GetVelocity(k))*(Pval->GetVelocity(k)-Pcore[pidcore].GetVelocity(k))/param[7];
-                    }
-                    mval=mcore[Pcore[pidcore].GetType()];
-                    pfofbg[pid]=Pcore[pidcore].GetType();
-                    for (int j=1;j<nsearch;j++) {
-                        D2=0;
-                        pidcore=nnID[tid][j];
-                        for (int k=0;k<3;k++) {
-                            D2+=(Pval->GetPosition(k)-Pcore[pidcore].GetPosition(k))*(Pval->GetPosition(k)-Pcore[pidcore].GetPosition(k))/param[6]+(Pval->GetVelocity(k)-Pcore[pidcore].GetVelocity(k))*(Pval->GetVelocity(k)-Pcore[pidcore].GetVelocity(k))/param[7];
-                        }
-                        if (dval>D2*mval/mcore[Pcore[pidcore].GetType()]) {dval=D2;mval=mcore[Pcore[pidcore].GetType()];pfofbg[pid]=Pcore[pidcore].GetType();}
-                    }
-                }
-            }
-#ifdef USEOPENMP
-            }
-#endif
+            AssignParticlesToNearestCores(nsubset, Partsubset, pfof, pfofbg, nincore, Pcore, tcore, nsearch, param, mcore);
             //clean up memory
             delete tcore;
             delete[] Pcore;
-            for (i=0;i<nthreads;i++) {
-                delete[] nnID[i];
-                delete[] dist2[i];
-            }
-            delete[] nnID;
-            delete[] dist2;
         }
         //now that particles assigned to cores, remove if core too small
         if (opt.partsearchtype!=PSTSTAR&&opt.foftype!=FOF6DCORE) mincoresize=max((Int_t)(nsubset*opt.halocorenfac),(Int_t)opt.MinSize);//max((Int_t)(nsubset*MAXCELLFRACTION/2.0),(Int_t)opt.MinSize);
@@ -2220,6 +2335,120 @@ private(i,tid,Pval,x1,D2,dval,mval,pid,pidcore)
 }
 
 
+///squared phase-space distance dx^T M dx given the 6x6 matrix M stored row by row
+inline Double_t PhaseDistance2(const Double_t *dx, const Double_t *m)
+{
+    Double_t d2=0;
+    for (int k=0;k<6;k++) {
+        Double_t mdx=0;
+        for (int l=0;l<6;l++) mdx+=m[6*k+l]*dx[l];
+        d2+=dx[k]*mdx;
+    }
+    return d2;
+}
+
+/*!
+    Assigns the untagged particles listed in activelist whose type is at least iloop to the core with the smallest mass weighted phase-space
+    distance, where distances use the core centres and inverse dispersion tensors stored in the flat arrays corecm (6 values per core) and
+    coreinvdisp (36 values per core). Assigned particles are removed from activelist and the number assigned is returned.
+*/
+Int_t AssignParticlesToPhaseCores(Particle *Partsubset, Int_t *pfofbg, vector<Int_t> &activelist, Int_t numgroupsbg, int iloop,
+    vector<Double_t> &corecm, vector<Double_t> &coreinvdisp, vector<Double_t> &mcore, vector<Double_t> &dispfac, vector<int> &corelevel)
+{
+    Int_t nactive=activelist.size(), nassigned=0, nleft=0;
+    vector<int> activecores;
+    for (int j=2;j<=numgroupsbg;j++) if (mcore[j]>0 && corelevel[j]>=iloop) activecores.push_back(j);
+#ifdef USEOPENMP
+#pragma omp parallel default(shared) if (nactive>ompperiodnum)
+{
+#pragma omp for reduction(+:nassigned)
+#endif
+    for (Int_t n=0;n<nactive;n++) {
+        Particle *Pval=&Partsubset[activelist[n]];
+        if (Pval->GetType()<iloop) continue;
+        Double_t phase[6], dx[6], dval, mval, D2, weight;
+        int icore=1;
+        for (int k=0;k<6;k++) phase[k]=Pval->GetPhase(k);
+        for (int k=0;k<6;k++) dx[k]=phase[k]-corecm[6+k];
+        dval=PhaseDistance2(dx,&coreinvdisp[36]);
+        mval=mcore[1];
+        for (auto j:activecores) {
+            weight=1.0/sqrt(mcore[j]/mval);
+            for (int k=0;k<6;k++) dx[k]=phase[k]-corecm[6*j+k];
+            D2=PhaseDistance2(dx,&coreinvdisp[36*j])*weight;
+            if (dval*dispfac[icore]>D2*dispfac[j]) {
+                dval=D2;
+                mval=mcore[j];
+                icore=j;
+            }
+        }
+        pfofbg[Pval->GetID()]=icore;
+        //if particle assigned to a core remove from search
+        Pval->SetType(-1);
+        nassigned++;
+    }
+#ifdef USEOPENMP
+}
+#endif
+    for (Int_t n=0;n<nactive;n++) if (pfofbg[Partsubset[activelist[n]].GetID()]==0) activelist[nleft++]=activelist[n];
+    activelist.resize(nleft);
+    return nassigned;
+}
+
+/*!
+    Assigns each untagged particle to the core of the core particle with the smallest mass weighted phase-space distance
+    amongst its nsearch nearest core particles (in position). The phase-space coordinates and cores of the core particles are copied to
+    contiguous arrays once the core tree has been built so that the distances to all the neighbours of a particle are calculated in a single loop.
+*/
+void AssignParticlesToNearestCores(const Int_t nsubset, Particle *Partsubset, Int_t *pfof, Int_t *pfofbg,
+    Int_t nincore, Particle *Pcore, KDTree *tcore, int nsearch, Double_t param[], vector<Double_t> &mcore)
+{
+    vector<Double_t> corephase(6*nincore);
+    vector<Int_t> coretype(nincore);
+    Double_t iscale[6];
+    for (int k=0;k<3;k++) {iscale[k]=1.0/param[6];iscale[k+3]=1.0/param[7];}
+    for (Int_t j=0;j<nincore;j++) {
+        for (int k=0;k<6;k++) corephase[6*j+k]=Pcore[j].GetPhase(k);
+        coretype[j]=Pcore[j].GetType();
+    }
+#ifdef USEOPENMP
+#pragma omp parallel default(shared) if (nsubset>ompperiodnum)
+{
+#endif
+    vector<Int_t> nnID(nsearch);
+    vector<Double_t> dist2(nsearch), D2(nsearch);
+#ifdef USEOPENMP
+#pragma omp for schedule(dynamic,ompperiodnum/16+1)
+#endif
+    for (Int_t i=0;i<nsubset;i++)
+    {
+        Particle *Pval=&Partsubset[i];
+        Int_t pid=Pval->GetID(), icore;
+        Double_t phase[6], dval, mval;
+        if (pfofbg[pid]!=0 || pfof[pid]!=0) continue;
+        for (int k=0;k<6;k++) phase[k]=Pval->GetPhase(k);
+        tcore->FindNearestPos(Coordinate(phase), nnID.data(), dist2.data(), nsearch);
+        //calculate distances to all neighbouring core particles
+        for (int j=0;j<nsearch;j++) {
+            const Double_t *pc=&corephase[6*nnID[j]];
+            D2[j]=0;
+            for (int k=0;k<6;k++) D2[j]+=(phase[k]-pc[k])*(phase[k]-pc[k])*iscale[k];
+        }
+        //initialise to the first core particle and examine the rest to see if one is closer once weighted by the core mass ratio
+        icore=coretype[nnID[0]];
+        dval=D2[0];
+        mval=mcore[icore];
+        for (int j=1;j<nsearch;j++) {
+            Int_t jcore=coretype[nnID[j]];
+            if (dval>D2[j]*mval/mcore[jcore]) {dval=D2[j];mval=mcore[jcore];icore=jcore;}
+        }
+        pfofbg[pid]=icore;
+    }
+#ifdef USEOPENMP
+}
+#endif
+}
+
 //Merge any groups that overlap in phase-space
 void MergeSubstructuresCoresPhase(Options &opt, const Int_t nsubset, Particle *&Partsubset, Int_t *&pfof, Int_t &numsubs, Int_t &numcores)
 {
@@ -2229,6 +2458,7 @@ void MergeSubstructuresCoresPhase(Options &opt, const Int_t nsubset, Particle *&
     Coordinate pos;
     vector<Int_t> numingroup, noffset, taggedsubs;
     vector<Particle> subs, cores;
+    vector<PhaseMoments> moments;
     KDTree *tree;
     //vector<GMatrix> phasetensorsubs(numsubs,GMatrix(6,6)), phasetensorcores(numcores,GMatrix(6,6));
     vector<Double_t> sigXsubs(numsubs), sigVsubs(numsubs), sigXcores(numcores), sigVcores(numcores);
@@ -2242,75 +2472,39 @@ void MergeSubstructuresCoresPhase(Options &opt, const Int_t nsubset, Particle *&
     numingroup.resize(numsubs+numcores+1);
     noffset.resize(numsubs+numcores+1);
     indexing.resize(nsubset);
-    for (auto &x:sigXsubs) x=0;
-    for (auto &x:sigVsubs) x=0;
-    for (auto &x:sigXcores) x=0;
-    for (auto &x:sigVcores) x=0;
-    //get center of mass in phase-space
     for (auto i=0;i<nsubset;i++) {
         pfofval = pfof[Partsubset[i].GetID()];
         indexing[i].fofval = pfofval;
         indexing[i].index = i;
         numingroup[pfofval]++;
-        //if ignoring background halo when determing whether to merge substructures,
-        if (pfofval==0 && opt.icoresubmergewithbg) continue;
-        if (pfofval<=numsubs) {
-            pfofval-=1;
-            //store total mass in potential (to ensure compatability with NOMASS option)
-            subs[pfofval].SetPotential(subs[pfofval].GetPotential()+Partsubset[i].GetMass());
-            for (auto k=0;k<6;k++) subs[pfofval].SetPhase(k,subs[pfofval].GetPhase(k)+Partsubset[i].GetPhase(k)*Partsubset[i].GetMass());
-        }
-        else {
-            pfofval-=numsubs+1;
-            cores[pfofval].SetPotential(cores[pfofval].GetPotential()+Partsubset[i].GetMass());
-            for (auto k=0;k<6;k++) cores[pfofval].SetPhase(k,cores[pfofval].GetPhase(k)+Partsubset[i].GetPhase(k)*Partsubset[i].GetMass());
-        }
     }
     noffset[0]=0; for (auto i=1;i<=numsubs+numcores;i++) noffset[i]=numingroup[i-1]+noffset[i-1];
+    //get center of mass in phase-space and dispersions in a single pass
+    CalcGroupPhaseMoments(nsubset, Partsubset, pfof, numsubs+numcores, moments);
     pfofval=1;
-    for (auto &x:subs) {
-        x.SetPID(pfofval);
-        x.SetID(pfofval);
+    for (auto i=0;i<numsubs;i++) {
+        subs[i].SetPID(pfofval);
+        subs[i].SetID(pfofval);
+        //store total mass in potential (to ensure compatability with NOMASS option)
+        subs[i].SetPotential(moments[pfofval].mass);
+        for (auto k=0;k<6;k++) subs[i].SetPhase(k,moments[pfofval].mean[k]);
+        sigXsubs[i]=moments[pfofval].SigmaX2();
+        sigVsubs[i]=moments[pfofval].SigmaV2();
         pfofval++;
-        for (auto k=0;k<6;k++) x.SetPhase(k,x.GetPhase(k)/x.GetPotential());
     }
-    for (auto &x:cores) {
-        x.SetPID(pfofval);
-        x.SetID(pfofval);
+    for (auto i=0;i<numcores;i++) {
+        cores[i].SetPID(pfofval);
+        cores[i].SetID(pfofval);
+        cores[i].SetPotential(moments[pfofval].mass);
+        for (auto k=0;k<6;k++) cores[i].SetPhase(k,moments[pfofval].mean[k]);
+        sigXcores[i]=moments[pfofval].SigmaX2();
+        sigVcores[i]=moments[pfofval].SigmaV2();
         pfofval++;
-        for (auto k=0;k<6;k++) x.SetPhase(k,x.GetPhase(k)/x.GetPotential());
     }
     //sort indices by fof value
     sort(indexing.begin(), indexing.end(), [](indexfof &a, indexfof &b){
     return a.fofval < b.fofval;
     });
-    //get the dispersions
-    for (auto i=0;i<nsubset;i++) {
-        pfofval = pfof[Partsubset[i].GetID()];
-        if (pfofval==0) continue;
-        if (pfofval<=numsubs) {
-            pfofval-=1;
-            disp=0; for (auto k=0;k<3;k++) disp+=pow(Partsubset[i].GetPosition(k)-subs[pfofval].GetPosition(k),2.0);
-            sigXsubs[pfofval]+=disp*Partsubset[i].GetMass();
-            disp=0; for (auto k=0;k<3;k++) disp+=pow(Partsubset[i].GetVelocity(k)-subs[pfofval].GetVelocity(k),2.0);
-            sigVsubs[pfofval]+=disp*Partsubset[i].GetMass();
-        }
-        else {
-            pfofval-=numsubs+1;
-            disp=0; for (auto k=0;k<3;k++) disp+=pow(Partsubset[i].GetPosition(k)-cores[pfofval].GetPosition(k),2.0);
-            sigXcores[pfofval]+=disp*Partsubset[i].GetMass();
-            disp=0; for (auto k=0;k<3;k++) disp+=pow(Partsubset[i].GetVelocity(k)-cores[pfofval].GetVelocity(k),2.0);
-            sigVcores[pfofval]+=disp*Partsubset[i].GetMass();
-        }
-    }
-    for (auto i=0;i<numsubs;i++) {
-        sigXsubs[i]*=1.0/subs[i].GetPotential();
-        sigVsubs[i]*=1.0/subs[i].GetPotential();
-    }
-    for (auto i=0;i<numcores;i++) {
-        sigXcores[i]*=1.0/cores[i].GetPotential();
-        sigVcores[i]*=1.0/cores[i].GetPotential();
-    }
     //now built tree on substructures
     tree = new KDTree(subs.data(),numsubs,1,tree->TPHYS,tree->KEPAN,100,0,0,0);
     //tree = new KDTree(subs.data(),numlargesubs,1,tree->TPHYS,tree->KEPAN,100,0,0,0);
@@ -2401,6 +2595,7 @@ void MergeSubstructuresPhase(Options &opt, const Int_t nsubset, Particle *&Parts
     };
     vector<Particle> subs;
     vector<mergeinfo> minfo;
+    vector<PhaseMoments> moments;
     KDTree *tree;
     //vector<GMatrix> phasetensorsubs(numgroups+1,GMatrix(6,6));
     vector<Double_t> sigXsubs(numgroups+1), sigVsubs(numgroups+1);
@@ -2424,18 +2619,15 @@ void MergeSubstructuresPhase(Options &opt, const Int_t nsubset, Particle *&Parts
     for (auto &x:sigVsubs) x=0;
     for (auto &x:numingroup) x=0;
 
-    //get center of mass in phase-space
     for (auto i=0;i<nsubset;i++) {
         pfofval = pfof[Partsubset[i].GetID()];
         indexing[i].fofval = pfofval;
         indexing[i].index = i;
         numingroup[pfofval]++;
-        //if (opt.icoresubmergewithbg == 0 && pfofval==0) continue;
-        //store total mass in potential (to ensure compatability with NOMASS option)
-        subs[pfofval].SetPotential(subs[pfofval].GetPotential()+Partsubset[i].GetMass());
-        for (auto k=0;k<6;k++) subs[pfofval].SetPhase(k,subs[pfofval].GetPhase(k)+Partsubset[i].GetPhase(k)*Partsubset[i].GetMass());
     }
     noffset[0]=0; for (auto i=1;i<=numgroups;i++) noffset[i]=numingroup[i-1]+noffset[i-1];
+    //get center of mass in phase-space and dispersions in a single pass
+    CalcGroupPhaseMoments(nsubset, Partsubset, pfof, numgroups, moments);
 
     //set sub properties.
     for (auto i=0;i<subs.size();i++)
@@ -2448,7 +2640,9 @@ void MergeSubstructuresPhase(Options &opt, const Int_t nsubset, Particle *&Parts
         minfo[i].pfofval = i;
         minfo[i].type = subs[i].GetType();
         minfo[i].numingroup = numingroup[i];
-        for (auto k=0;k<6;k++) subs[i].SetPhase(k,subs[i].GetPhase(k)/subs[i].GetPotential());
+        //store total mass in potential (to ensure compatability with NOMASS option)
+        subs[i].SetPotential(moments[i].mass);
+        for (auto k=0;k<6;k++) subs[i].SetPhase(k,moments[i].mean[k]);
     }
 
     //sort indices by original fof value
@@ -2456,22 +2650,12 @@ void MergeSubstructuresPhase(Options &opt, const Int_t nsubset, Particle *&Parts
     return a.fofval < b.fofval;
     });
 
-    //get the dispersions
-    for (auto i=0;i<nsubset;i++) {
-        pfofval = pfof[Partsubset[i].GetID()];
-        //if ignoring background host when checking whether to merge, then leave it as zero dispersion
-        if (pfofval == 0 && opt.icoresubmergewithbg == 0) continue;
-        disp=0; for (auto k=0;k<3;k++) disp+=pow(Partsubset[i].GetPosition(k)-subs[pfofval].GetPosition(k),2.0);
-        sigXsubs[pfofval]+=disp*Partsubset[i].GetMass();
-        disp=0; for (auto k=0;k<3;k++) disp+=pow(Partsubset[i].GetVelocity(k)-subs[pfofval].GetVelocity(k),2.0);
-        sigVsubs[pfofval]+=disp*Partsubset[i].GetMass();
-    }
-
+    //get the dispersions. If ignoring background host when checking whether to merge, then leave it as zero dispersion
     if (opt.icoresubmergewithbg == 0) index1 = 1;
     else index1 = 0;
     for (auto i=index1;i<subs.size();i++) {
-        sigXsubs[i]*=1.0/subs[i].GetPotential();
-        sigVsubs[i]*=1.0/subs[i].GetPotential();
+        sigXsubs[i]=moments[i].SigmaX2();
+        sigVsubs[i]=moments[i].SigmaV2();
     }
 
     //now built tree on substructures
@@ -2657,7 +2841,9 @@ num_threads(nthreads) if (num > ompperiodnum)
 }
 
 ///Pre-calcualtions for searching for substructure
-inline void PreCalcSearchSubSet(Options &opt, Int_t subnumingroup,  Particle *&subPart, Int_t sublevel)
+///If veldencache is passed, velocity densities are reused where possible (see \ref GetVelocityDensityReuse) with globalindex the indices of the particles in the full set
+inline void PreCalcSearchSubSet(Options &opt, Int_t subnumingroup,  Particle *&subPart, Int_t sublevel,
+    Int_t *globalindex=NULL, velden_sub_cache *veldencache=NULL)
 {
     #ifndef USEMPI
     int ThisTask = 0;
@@ -2692,7 +2878,8 @@ inline void PreCalcSearchSubSet(Options &opt, Int_t subnumingroup,  Particle *&s
         opt.HaloSigmaV=pow(sigma2x*sigma2y*sigma2z,1.0/3.0);
         if (opt.HaloSigmaV>opt.HaloVelDispScale) opt.HaloVelDispScale=opt.HaloSigmaV;
 #ifdef HALOONLYDEN
-        GetVelocityDensity(opt,subnumingroup,subPart);
+        if (veldencache!=NULL) GetVelocityDensityReuse(opt,subnumingroup,subPart,globalindex,sublevel,*veldencache);
+        else GetVelocityDensity(opt,subnumingroup,subPart);
 #endif
         GetDenVRatio(opt,subnumingroup, subPart, ngrid, grid, gvel, gveldisp);
         GetOutliersValues(opt,subnumingroup, subPart, sublevel);
@@ -2707,12 +2894,13 @@ inline void PreCalcSearchSubSet(Options &opt, Int_t subnumingroup,  Particle *&s
     }
 }
 
-inline void CleanAndUpdateGroupsFromSubSearch(Options &opt,
+///Builds the particle lists of the substructures found in a (sub)structure, unbinding them if required. The lists are converted to indices of
+///the global subset using subpglist.
+inline void CleanGroupsFromSubSearch(Options &opt,
     Int_t &subnumingroup, Particle *subPart, Int_t *&subpfof,
     Int_t &subngroup, Int_t *&subsubnumingroup,
     Int_t **&subsubpglist, Int_t &numcores,
-    Int_t *&subpglist,
-    Int_t *&pfof, Int_t &ngroup, Int_t &ngroupidoffset)
+    Int_t *&subpglist)
 {
     bool iunbindflag;
     Int_t ng=subngroup;
@@ -2737,6 +2925,8 @@ inline void CleanAndUpdateGroupsFromSubSearch(Options &opt,
             for (auto j=1;j<=ng;j++) delete[] subsubpglist[j];
             delete[] subsubnumingroup;
             delete[] subsubpglist;
+            subsubnumingroup=NULL;
+            subsubpglist=NULL;
             if (subngroup>0) {
                 subsubnumingroup = BuildNumInGroup(subnumingroup, subngroup, subpfof);
                 subsubpglist = BuildPGList(subnumingroup, subngroup, subsubnumingroup, subpfof);
@@ -2750,11 +2940,6 @@ inline void CleanAndUpdateGroupsFromSubSearch(Options &opt,
         }
     }
 
-    for (auto j=0;j<subnumingroup;j++)
-    {
-        if (subpfof[j]>0) pfof[subpglist[j]]=ngroup+ngroupidoffset+subpfof[j];
-    }
-    //ngroupidoffset+=subngroup;
     //now alter subsubpglist so that index pointed is global subset index as global subset is used to get the particles to be searched for subsubstructure
     for (auto j=1;j<=subngroup;j++)
     {
@@ -2765,6 +2950,132 @@ inline void CleanAndUpdateGroupsFromSubSearch(Options &opt,
     }
 }
 
+///Returns whether a (sub)structure, whose outliers have been calculated by \ref PreCalcSearchSubSet, has enough outliers for \ref SearchSubset
+///to find a substructure. Only particles with outlier values above the threshold can be linked by \ref FOFStreamwithprob, so fewer of these than
+///the minimum size means no group can be found. Searches which also look for cores or do not link outliers are always carried out.
+inline bool SubSearchHasOutliers(Options &opt, Int_t num, Particle *subPart, int sublevel)
+{
+    int maxhalocoresublevel=opt.maxnlevelcoresearch;
+    if (opt.partsearchtype==PSTSTAR) maxhalocoresublevel=100;
+    if (opt.foftype!=FOFSTPROB || opt.iSingleHalo) return true;
+    if (opt.iHaloCoreSearch>0 && sublevel<=maxhalocoresublevel) return true;
+    if (num<MINSUBSIZE) return false;
+    Double_t ellvallim=opt.ellthreshold;
+    int minsize=opt.MinSize;
+    if (opt.iiterflag) {
+        ellvallim*=opt.ellfac;
+        minsize*=opt.nminfac;
+    }
+    Int_t noutliers=0;
+    for (Int_t j=0;j<num;j++) if (subPart[j].GetPotential()>=ellvallim) noutliers++;
+    return (noutliers>=minsize);
+}
+
+///Pre-screen of a (sub)structure based on the outlier values its particles had when its parent was searched, parentell, indexed by global subset index.
+///Substructures show up as particles whose values are well above those of the rest of the object, so if fewer than \ref Options.MinSize particles
+///exceed the median value by \ref Options.ellthreshold the object is not searched. Returns true if the object should be searched.
+bool SubSearchPrescreen(Options &opt, Int_t num, Int_t *pglist, Double_t *parentell)
+{
+    vector<Double_t> ell(num);
+    for (Int_t j=0;j<num;j++) {
+        ell[j]=parentell[pglist[j]];
+        //outliers not calculated for some particles so cannot screen
+        if (ell[j]==MAXVALUE) return true;
+    }
+    nth_element(ell.begin(),ell.begin()+num/2,ell.end());
+    Double_t ellvallim=ell[num/2]+opt.ellthreshold;
+    Int_t noutliers=0;
+    for (Int_t j=0;j<num;j++) if (ell[j]>=ellvallim) noutliers++;
+    return (noutliers>=opt.MinSize);
+}
+
+/*!
+    Searches a (sub)structure, whose particles are given by the indices pglist of the global subset, for substructure and unbinds the substructures found.
+    The results are stored in res. If itask is set (when running with OpenMP inside a parallel region), the substructures found that are large
+    enough to be searched at the next level (at least minsizenext particles) are themselves searched as tasks, so that deep hierarchies
+    in one object proceed while other objects are still being searched. These tasks use the options of the thread running them, threadopt,
+    after restoring the fields changed by a search from context.
+    Objects that cannot contain substructure are not searched (see \ref SubSearchHasOutliers) and, if parentell is passed, neither are
+    objects that fail \ref SubSearchPrescreen. The outlier values of the particles are then stored in parentell for the pre-screen of the
+    substructures found. The reason an object is skipped is stored in res.
+*/
+void SearchSubSubObject(Options &opt, const SubSearchContext *context, Options **threadopt, Particle *Partsubset, Int_t num, Int_t *pglist, int sublevel,
+    velden_sub_cache *veldencache, Double_t *parentell, SubSearchResult *res, bool itask, int minsizenext)
+{
+    Particle *subPart;
+    Int_t *subpfof;
+    bool ilean=opt.iSubSearchLeanCopy;
+    if (parentell!=NULL && sublevel>1 && !SubSearchPrescreen(opt, num, pglist, parentell)) {
+        res->iskipped=SUBSEARCHPRESCREEN;
+        if (veldencache!=NULL) for (Int_t j=0;j<num;j++) veldencache->ClearNeighbours(pglist[j]);
+        return;
+    }
+#ifdef SWIFTINTERFACE
+    //potential is taken from the gravity potential which is not copied
+    if (!opt.uinfo.icalculatepotential) ilean=false;
+#endif
+    subPart=new Particle[num];
+    if (ilean) FillPartLean(num, pglist, Partsubset, subPart);
+    else for (Int_t j=0;j<num;j++) {
+        subPart[j]=Partsubset[pglist[j]];
+#ifdef GASON
+        if (subPart[j].HasHydroProperties()) subPart[j].SetHydroProperties();
+#endif
+#ifdef STARON
+        if (subPart[j].HasStarProperties()) subPart[j].SetStarProperties();
+#endif
+#ifdef BHON
+        if (subPart[j].HasBHProperties()) subPart[j].SetBHProperties();
+#endif
+#ifdef EXTRADMON
+        if (subPart[j].HasExtraDMProperties()) subPart[j].SetExtraDMProperties();
+#endif
+    }
+    //move to cm if desired
+    if (opt.icmrefadjust) {
+        //this routine is in substructureproperties.cxx. Has internal parallelisation
+        GMatrix cmphase = CalcPhaseCM(num, subPart);
+        //this routine is within this file, also has internal parallelisation
+        AdjustSubPartToPhaseCM(num, subPart, cmphase);
+    }
+    PreCalcSearchSubSet(opt, num, subPart, sublevel, pglist, veldencache);
+    if (parentell!=NULL) {
+        if (num>=MINSUBSIZE&&opt.foftype!=FOF6DCORE) for (Int_t j=0;j<num;j++) parentell[pglist[j]]=subPart[j].GetPotential();
+        else for (Int_t j=0;j<num;j++) parentell[pglist[j]]=MAXVALUE;
+    }
+    if (!SubSearchHasOutliers(opt, num, subPart, sublevel)) {
+        res->iskipped=SUBSEARCHNOOUTLIERS;
+        if (veldencache!=NULL) for (Int_t j=0;j<num;j++) veldencache->ClearNeighbours(pglist[j]);
+        delete[] subPart;
+        return;
+    }
+    subpfof = SearchSubset(opt, num, num, subPart, res->ngroup, sublevel, &res->numcores);
+    //neighbours of particles not in substructures are no longer needed
+    if (veldencache!=NULL) for (Int_t j=0;j<num;j++) if (subpfof[j]==0) veldencache->ClearNeighbours(pglist[j]);
+    CleanGroupsFromSubSearch(opt, num, subPart, subpfof, res->ngroup, res->numingroup, res->pglist, res->numcores, pglist);
+    delete[] subpfof;
+    delete[] subPart;
+
+#ifdef USEOPENMP
+    if (itask && res->ngroup>0) {
+        int minsizenextnext=min(minsizenext*2,MINSUBSIZE);
+        res->children.assign(res->ngroup+1,NULL);
+        for (Int_t j=1;j<=res->ngroup;j++) {
+            if (res->numingroup[j]<minsizenext) continue;
+            SubSearchResult *child=new SubSearchResult;
+            res->children[j]=child;
+            #pragma omp task firstprivate(j,child,context,threadopt,Partsubset,res,sublevel,veldencache,parentell,minsizenextnext)
+            {
+                Options &optchild=*threadopt[omp_get_thread_num()];
+                context->Restore(optchild);
+                SearchSubSubObject(optchild, context, threadopt, Partsubset, res->numingroup[j], res->pglist[j], sublevel+1,
+                    veldencache, parentell, child, true, minsizenextnext);
+            }
+        }
+    }
+#endif
+}
+
 void UpdateGroupIDsFromSubstructure(Int_t activenumgroups, Int_t oldnumgroups,
     Int_t *&pfof, Int_t *&subngroup, Int_t *&subnumingroup, Int_t **&subpglist,
     Int_t ns, Int_t &ngroupidoffset, vector<Int_t> &ngroupidoffset_old, vector<Int_t> &ngroupidoffset_new)
@@ -2808,22 +3119,32 @@ void UpdateGroupIDsFromSubstructure(Int_t activenumgroups, Int_t oldnumgroups,
     the loop so that the available pool of threads over which to run in parallel for the callled subroutines is adaptive. (Or it might be
     simply more useful to not have the functions called within this loop parallelised. This loop invokes a few routines that have OpenMP
     parallelisation: InitializeTreeGrid, GetCellVel, GetCellVelDisp, CalcVelSigmaTensor, etc.
+
+    Objects smaller than \ref ompsplitsubsearchnum are searched as OpenMP tasks (see \ref SearchSubSubObject), each of which spawns tasks
+    to search the substructures it finds. Their results are kept until the level is reached, where only the group ids are updated.
+    Larger objects are still searched one at a time using the internal parallelisation of the called routines.
 */
 void SearchSubSub(Options &opt, const Int_t nsubset, vector<Particle> &Partsubset, Int_t *&pfof, Int_t &ngroup, Int_t &nhalos, PropData *pdata)
 {
     //now build a sublist of groups to search for substructure
     Int_t nsubsearch, oldnsubsearch,sublevel,maxsublevel,ngroupidoffset,ngroupidoffsetold,ngrid;
-    bool iflag,iunbindflag;
-    Particle *subPart;
+    bool iflag;
     Int_t firstgroup,firstgroupoffset;
     Int_t ng,*numingroup,**pglist;
-    Int_t *subpfof,*subngroup;
+    Int_t *subngroup;
     Int_t *subnumingroup,**subpglist;
     Int_t **subsubnumingroup, ***subsubpglist;
-    Int_t *numcores,*coreflag;
+    Int_t *numcores;
     Int_t *subpfofold;
     vector<Int_t> ngroupidoffset_old, ngroupidoffset_new;
     vector<Int_t> ompactivesubgroups;
+    //results of searching objects at the current and next level
+    vector<SubSearchResult*> subresults, nextsubresults;
+    //to reuse velocity densities of particles in substructures of substructures
+    velden_sub_cache *veldencache=NULL;
+    //outlier values of particles in the objects searched, used to pre-screen their substructures
+    vector<Double_t> parentell;
+    Int_t nskipped[3];
     //variables to keep track of structure level, pfof values (ie group ids) and their parent structure
     //use to point to current level
     StrucLevelData *pcsld;
@@ -2882,6 +3203,15 @@ void SearchSubSub(Options &opt, const Int_t nsubset, vector<Particle> &Partsubse
     for (Int_t i=1;i<=ngroup;i++) delete[] pglist[i];
     delete[] pglist;
     delete[] numingroup;
+    //neighbours are stored as int indices into the subset
+    if (opt.iSubVelDenReuse && nsubset<INT_MAX) {
+        veldencache=new velden_sub_cache;
+        veldencache->Initialize(nsubset,opt.Nsearch);
+        if (opt.iverbose) cout<<ThisTask<<" storing neighbours to reuse velocity densities requires "<<veldencache->MemUsage()/1024./1024./1024.<<" GB"<<endl;
+        GetMemUsage(opt, __func__+string("--line--")+to_string(__LINE__), (opt.iverbose>=1));
+    }
+    if (opt.iSubSearchPrescreen) parentell.assign(nsubset,MAXVALUE);
+    subresults.assign(nsubsearch+1,NULL);
     //now start searching while there are still sublevels to be searched
     while (iflag) {
         if (opt.iverbose) cout<<ThisTask<<" There are "<<nsubsearch<<" substructures large enough to search for other substructures at sub level "<<sublevel<<endl;
@@ -2906,6 +3236,8 @@ void SearchSubSub(Options &opt, const Int_t nsubset, vector<Particle> &Partsubse
         GetMemUsage(opt, __func__+string("--line--")+to_string(__LINE__)+string("--subelvel--")+to_string(sublevel), (opt.iverbose>=1));
 
         for (Int_t i=1;i<=oldnsubsearch;i++) {
+            //objects may have already been searched as a task when their parent was searched
+            if (subresults[i]!=NULL) continue;
             // try running loop over largest objects in serial with parallel inside calls
             // so skip of group is small enough and running with openmp
 #ifdef USEOPENMP
@@ -2914,90 +3246,62 @@ void SearchSubSub(Options &opt, const Int_t nsubset, vector<Particle> &Partsubse
                 continue;
             }
 #endif
-            subpfofold[i]=pfof[subpglist[i][0]];
-            subPart=new Particle[subnumingroup[i]];
-            for (Int_t j=0;j<subnumingroup[i];j++) {
-                subPart[j]=Partsubset[subpglist[i][j]];
-#ifdef GASON
-                if (subPart[j].HasHydroProperties()) subPart[j].SetHydroProperties();
-#endif
-#ifdef STARON
-                if (subPart[j].HasStarProperties()) subPart[j].SetStarProperties();
-#endif
-#ifdef BHON
-                if (subPart[j].HasBHProperties()) subPart[j].SetBHProperties();
-#endif
-#ifdef EXTRADMON
-                if (subPart[j].HasExtraDMProperties()) subPart[j].SetExtraDMProperties();
-#endif
-            }
-            //move to cm if desired
-            if (opt.icmrefadjust) {
-                //this routine is in substructureproperties.cxx. Has internal parallelisation
-                GMatrix cmphase = CalcPhaseCM(subnumingroup[i], subPart);
-                //this routine is within this file, also has internal parallelisation
-                AdjustSubPartToPhaseCM(subnumingroup[i], subPart, cmphase);
-            }
-            PreCalcSearchSubSet(opt, subnumingroup[i], subPart, sublevel);
-            subpfof = SearchSubset(opt, subnumingroup[i], subnumingroup[i], subPart,
-                subngroup[i], sublevel, &numcores[i]);
-            CleanAndUpdateGroupsFromSubSearch(opt, subnumingroup[i], subPart, subpfof,
-                    subngroup[i], subsubnumingroup[i], subsubpglist[i], numcores[i],
-                    subpglist[i], pfof, ngroup, ngroupidoffset_old[i]);
-            delete[] subpfof;
-            delete[] subPart;
-            ns+=subngroup[i];
+            subresults[i]=new SubSearchResult;
+            SearchSubSubObject(opt, NULL, NULL, Partsubset.data(), subnumingroup[i], subpglist[i], sublevel, veldencache,
+                (opt.iSubSearchPrescreen?parentell.data():NULL), subresults[i], false, 0);
         }
 
-
 #ifdef USEOPENMP
+        //search the small objects as tasks. Each task also searches the substructures it finds as tasks, so that threads are not left idle
+        //waiting for all objects at this level to be searched before the objects at the next level are.
         if (ompactivesubgroups.size()>0) {
-            Int_t oldns = ns;
-            ns = 0;
-            Options opt2;
-            #pragma omp parallel for \
-            default(shared) private(subPart, subpfof, opt2) schedule(dynamic) \
-            reduction(+:ns)
+            int minsizenext=min(minsizeforsubsearch*2,MINSUBSIZE);
+            for (auto iomp=0;iomp<ompactivesubgroups.size();iomp++) subresults[ompactivesubgroups[iomp]]=new SubSearchResult;
+            //each thread copies the options once and tasks only reset the fields a search changes
+            SubSearchContext context;
+            context.Save(opt);
+            vector<Options*> threadopt(omp_get_max_threads(),NULL);
+            #pragma omp parallel default(shared)
+            {
+            threadopt[omp_get_thread_num()]=new Options(opt);
+            #pragma omp single
+            {
             for (auto iomp=0;iomp<ompactivesubgroups.size();iomp++) {
                 Int_t i=ompactivesubgroups[iomp];
-                opt2 = opt;
-                subpfofold[i] = pfof[subpglist[i][0]];
-                subPart = new Particle[subnumingroup[i]];
-                for (Int_t j=0;j<subnumingroup[i];j++) {
-                    subPart[j] = Partsubset[subpglist[i][j]];
-#ifdef GASON
-                    if (subPart[j].HasHydroProperties()) subPart[j].SetHydroProperties();
-#endif
-#ifdef STARON
-                    if (subPart[j].HasStarProperties()) subPart[j].SetStarProperties();
-#endif
-#ifdef BHON
-                    if (subPart[j].HasBHProperties()) subPart[j].SetBHProperties();
-#endif
-#ifdef EXTRADMON
-                    if (subPart[j].HasExtraDMProperties()) subPart[j].SetExtraDMProperties();
-#endif
-                }
-
-                if (opt.icmrefadjust) {
-                    //this routine is in substructureproperties.cxx. Has internal parallelisation
-                    GMatrix cmphase = CalcPhaseCM(subnumingroup[i], subPart);
-                    //this routine is within this file, also has internal parallelisation
-                    AdjustSubPartToPhaseCM(subnumingroup[i], subPart, cmphase);
+                #pragma omp task firstprivate(i)
+                {
+                    Options &opt2=*threadopt[omp_get_thread_num()];
+                    context.Restore(opt2);
+                    SearchSubSubObject(opt2, &context, threadopt.data(), Partsubset.data(), subnumingroup[i], subpglist[i], sublevel, veldencache,
+                        (opt.iSubSearchPrescreen?parentell.data():NULL), subresults[i], true, minsizenext);
                 }
-                PreCalcSearchSubSet(opt2, subnumingroup[i], subPart, sublevel);
-                subpfof = SearchSubset(opt2, subnumingroup[i], subnumingroup[i], subPart,
-                    subngroup[i], sublevel, &numcores[i]);
-                CleanAndUpdateGroupsFromSubSearch(opt2, subnumingroup[i], subPart, subpfof,
-                        subngroup[i], subsubnumingroup[i], subsubpglist[i], numcores[i],
-                        subpglist[i], pfof, ngroup, ngroupidoffset_old[i]);
-                delete[] subpfof;
-                delete[] subPart;
-                ns += subngroup[i];
             }
-            ns += oldns;
+            }
+            delete threadopt[omp_get_thread_num()];
+            }
         }
 #endif
+        //update the group ids of the substructures found
+        nskipped[SUBSEARCHNOOUTLIERS]=nskipped[SUBSEARCHPRESCREEN]=0;
+        for (Int_t i=1;i<=oldnsubsearch;i++) {
+            subpfofold[i]=pfof[subpglist[i][0]];
+            if (subresults[i]->iskipped) {
+                nskipped[subresults[i]->iskipped]++;
+                if (opt.iverbose>=2) cout<<ThisTask<<" Skipped searching "<<subpfofold[i]<<" with "<<subnumingroup[i]<<" particles at sub level "<<sublevel
+                    <<(subresults[i]->iskipped==SUBSEARCHPRESCREEN?" as it failed the pre-screen":" as it has too few outliers")<<endl;
+            }
+            subngroup[i]=subresults[i]->ngroup;
+            numcores[i]=subresults[i]->numcores;
+            subsubnumingroup[i]=subresults[i]->numingroup;
+            subsubpglist[i]=subresults[i]->pglist;
+            for (Int_t j=1;j<=subngroup[i];j++)
+                for (Int_t k=0;k<subsubnumingroup[i][j];k++)
+                    pfof[subsubpglist[i][j][k]]=ngroup+ngroupidoffset_old[i]+j;
+            ns+=subngroup[i];
+        }
+        if (opt.iverbose && nskipped[SUBSEARCHNOOUTLIERS]+nskipped[SUBSEARCHPRESCREEN]>0) cout<<ThisTask<<" Skipped searching "
+            <<nskipped[SUBSEARCHNOOUTLIERS]<<" substructures with too few outliers and "<<nskipped[SUBSEARCHPRESCREEN]
+            <<" that failed the pre-screen at sub level "<<sublevel<<endl;
         UpdateGroupIDsFromSubstructure(oldnsubsearch, ngroup,
             pfof, subngroup, subnumingroup, subpglist,
             ns, ngroupidoffset, ngroupidoffset_old, ngroupidoffset_new);
@@ -3005,16 +3309,8 @@ void SearchSubSub(Options &opt, const Int_t nsubset, vector<Particle> &Partsubse
         //if objects have been found adjust the StrucLevelData
         //this stores the address of the parent particle and pfof along with child substructure particle and pfof
         if (ns>0) {
-            pcsld->nextlevel=new StrucLevelData();
-            //pcsld->nextlevel->Initialize(ns);
-            pcsld->nextlevel->Phead=new Particle*[ns+1];
-            pcsld->nextlevel->gidhead=new Int_t*[ns+1];
-            pcsld->nextlevel->Pparenthead=new Particle*[ns+1];
-            pcsld->nextlevel->gidparenthead=new Int_t*[ns+1];
-            pcsld->nextlevel->giduberparenthead=new Int_t*[ns+1];
-            pcsld->nextlevel->stypeinlevel=new Int_t[ns+1];
+            pcsld->nextlevel=new StrucLevelData(ns);
             pcsld->nextlevel->stype=HALOSTYPE+SUBSTYPE*sublevel;
-            pcsld->nextlevel->nsinlevel=ns;
             Int_t nscount=1;
             for (Int_t i=1;i<=oldnsubsearch;i++) {
                 Int_t ii=0,iindex;
@@ -3108,6 +3404,7 @@ void SearchSubSub(Options &opt, const Int_t nsubset, vector<Particle> &Partsubse
         if (nsubsearch>0) {
             subnumingroup=new Int_t[nsubsearch+1];
             subpglist=new Int_t*[nsubsearch+1];
+            nextsubresults.assign(nsubsearch+1,NULL);
             nsubsearch=1;
             for (Int_t i=1;i<=oldnsubsearch;i++) {
                 for (Int_t j=1;j<=subngroup[i];j++)
@@ -3115,12 +3412,17 @@ void SearchSubSub(Options &opt, const Int_t nsubset, vector<Particle> &Partsubse
                         subnumingroup[nsubsearch]=subsubnumingroup[i][j];
                         subpglist[nsubsearch]=new Int_t[subnumingroup[nsubsearch]];
                         for (Int_t k=0;k<subnumingroup[nsubsearch];k++) subpglist[nsubsearch][k]=subsubpglist[i][j][k];
+                        //keep results of objects already searched as tasks
+                        if (subresults[i]->children.size()>0) nextsubresults[nsubsearch]=subresults[i]->children[j];
                         nsubsearch++;
                     }
             }
             nsubsearch--;
         }
         else iflag=false;
+        for (Int_t i=1;i<=oldnsubsearch;i++) delete subresults[i];
+        subresults.swap(nextsubresults);
+        nextsubresults.clear();
         //free memory
         for (Int_t i=1;i<=oldnsubsearch;i++) {
             if (subngroup[i]>0) {
@@ -3137,6 +3439,7 @@ void SearchSubSub(Options &opt, const Int_t nsubset, vector<Particle> &Partsubse
         if (opt.iverbose) cout<<ThisTask<<"Finished storing next level of substructures to be searched for subsubstructure"<<endl;
     }
 
+    if (veldencache!=NULL) delete veldencache;
     ngroup+=ngroupidoffset;
     cout<<ThisTask<<"Done searching substructure to "<<sublevel-1<<" sublevels "<<endl;
     }
@@ -3275,18 +3578,21 @@ int CheckSignificance(Options &opt, const Int_t nsubset, Particle *Partsubset, I
     if (opt.iverbose) {
         cout<<"Checking that groups have a significance level of "<<opt.siglevel<<" and contain more than "<<opt.MinSize<<" members"<<endl;
     }
-    for (i=0;i<=numgroups;i++) {aveell[i]=0.;maxell[i]=-MAXVALUE;minell[i]=MAXVALUE;//numingroup[i]=0;
-    }
-    for (i=0;i<nsubset;i++)
-    {
-        Int_t gid=pfof[Partsubset[i].GetID()];
-        Double_t ellvalue=Partsubset[i].GetPotential();
-        aveell[gid]+=ellvalue;
-        if(maxell[gid]<ellvalue)maxell[gid]=ellvalue;
-        if(minell[gid]>ellvalue)minell[gid]=ellvalue;
-    }
+    //get the mean, minimum and maximum outlier statistic of each group in a single pass over its members
+#ifdef USEOPENMP
+#pragma omp parallel for default(shared) private(i) schedule(dynamic) reduction(max:iflag) if (nsubset>ompunbindnum)
+#endif
     for (i=1;i<=numgroups;i++) {
-        aveell[i]/=(Double_t)numingroup[i];
+        Double_t sum=0., ellmax=-MAXVALUE, ellmin=MAXVALUE;
+        for (Int_t j=0;j<numingroup[i];j++) {
+            Double_t ellvalue=Partsubset[pglist[i][j]].GetPotential();
+            sum+=ellvalue;
+            ellmax=max(ellmax,ellvalue);
+            ellmin=min(ellmin,ellvalue);
+        }
+        aveell[i]=sum/(Double_t)numingroup[i];
+        maxell[i]=ellmax;
+        minell[i]=ellmin;
         betaave[i]=(aveell[i]/ellaveexp-1.0)*sqrt((Double_t)numingroup[i]);
         //flag indicating that group ids need to be adjusted
         if(betaave[i]<opt.siglevel) iflag=1;
@@ -3302,23 +3608,21 @@ private(i)
 #endif
         for (i=1;i<=numgroups;i++) {
             if(betaave[i]<opt.siglevel) {
-                do {
-                    if ((numingroup[i])<opt.MinSize) {
-                        for (Int_t j=0;j<numingroup[i];j++) pfof[Partsubset[pglist[i][j]].GetID()]=0;
-                        numingroup[i]=-1;
-                        break;
-                    }
-                    Int_t iminell;
-                    Double_t vminell=minell[i];
-                    aveell[i]=(aveell[i]*(Double_t)numingroup[i]-minell[i])/(Double_t)(numingroup[i]-1.0);
-                    minell[i]=maxell[i];
-                    for (Int_t j=0;j<numingroup[i];j++)
-                        if(Partsubset[pglist[i][j]].GetPotential()>vminell&&Partsubset[pglist[i][j]].GetPotential()<minell[i])minell[i]=Partsubset[pglist[i][j]].GetPotential();
-                        else if (Partsubset[pglist[i][j]].GetPotential()==vminell) iminell=j;
-                    pfof[Partsubset[pglist[i][iminell]].GetID()]=0;
-                    if (iminell!=numingroup[i]-1)pglist[i][iminell]=pglist[i][--numingroup[i]];
-                    betaave[i]=(aveell[i]/ellaveexp-1.0)*sqrt((Double_t)numingroup[i]);
-                } while(betaave[i]<opt.siglevel);
+                //remove the members with the lowest outlier statistic until the group is significant, sorting the members once
+                //so that each removal does not require a pass over the group
+                Int_t nremove=0, nmembers=numingroup[i];
+                sort(pglist[i], pglist[i]+nmembers, [&Partsubset](const Int_t &a, const Int_t &b){
+                    return Partsubset[a].GetPotential()<Partsubset[b].GetPotential();});
+                Double_t sum=aveell[i]*(Double_t)nmembers;
+                while (betaave[i]<opt.siglevel && nmembers-nremove>=opt.MinSize) {
+                    sum-=Partsubset[pglist[i][nremove]].GetPotential();
+                    pfof[Partsubset[pglist[i][nremove]].GetID()]=0;
+                    nremove++;
+                    aveell[i]=sum/(Double_t)(nmembers-nremove);
+                    betaave[i]=(aveell[i]/ellaveexp-1.0)*sqrt((Double_t)(nmembers-nremove));
+                }
+                numingroup[i]=nmembers-nremove;
+                for (Int_t j=0;j<numingroup[i];j++) pglist[i][j]=pglist[i][j+nremove];
             }
             if ((numingroup[i])<opt.MinSize) {
                 for (Int_t j=0;j<numingroup[i];j++) pfof[Partsubset[pglist[i][j]].GetID()]=0;
@@ -3361,20 +3665,19 @@ private(i)
 Int_t* SearchBaryons(Options &opt, Int_t &nbaryons, Particle *&Pbaryons, const Int_t ndark, vector<Particle> &Part, Int_t *&pfofdark, Int_t &ngroupdark, Int_t &nhalos, int ihaloflag, int iinclusive, PropData *pdata)
 {
     KDTree *tree;
-    Double_t *period;
+    Double_t *period=NULL;
     Int_t *pfofbaryons, *pfofall, *pfofold;
     Int_t i,pindex,npartingroups,ng,nghalos,nhalosold=nhalos, baryonfofold;
     Int_t *ids, *storeval,*storeval2;
     Double_t D2,dval,rval;
     Coordinate x1;
-    Particle p1;
     int icheck;
     FOFcompfunc fofcmp;
     Double_t param[20];
     int nsearch=opt.Nvel;
     Int_t *nnID=NULL,*numingroup;
     Double_t *dist2=NULL, *localdist;
-    int nthreads=1,maxnthreads,tid;
+    int nthreads=1,maxnthreads;
     int minsize;
     Int_t nparts=ndark+nbaryons;
     Int_t nhierarchy=1,gidval;
@@ -3537,31 +3840,39 @@ Int_t* SearchBaryons(Options &opt, Int_t &nbaryons, Particle *&Pbaryons, const I
     }
     //build tree of baryon particles (in groups if a full particle search was done, otherwise npartingroups=nbaryons
     tree=new KDTree(Part.data(),npartingroups,nsearch/2,tree->TPHYS,tree->KEPAN,100,0,0,0,period);
-    //allocate memory for search
+    //baryons with no dm particle in groups within the linking length cannot be associated so mark the cells occupied by these dm particles and
+    //only search baryons near them. The baryons to be searched are ordered by cell so that consecutive searches traverse the same parts of the tree
+    NeighbourCellMask dmmask;
+    dmmask.Initialize(npartingroups, Part.data(), sqrt(param[6]), opt.p);
+    vector<Int_t> searchlist;
+    vector<long long> searchkey(nbaryons);
+    searchlist.reserve(nbaryons);
+    for (i=0;i<nbaryons;i++) {
+        //if all particles have been searched for field objects then ignore baryons not associated with a group
+        if (opt.partsearchtype==PSTALL && pfofbaryons[i]==0) continue;
+        if (!dmmask.HasNeighbours(Pbaryons[i])) continue;
+        searchlist.push_back(i);
+        searchkey[i]=dmmask.GetKey(Pbaryons[i]);
+    }
+    sort(searchlist.begin(), searchlist.end(), [&searchkey](const Int_t &a, const Int_t &b){return searchkey[a]<searchkey[b];});
+    vector<long long>().swap(searchkey);
+    Int_t nsearchlist=searchlist.size();
     //find the closest dm particle that belongs to the largest dm group and associate the baryon with that group (including phase-space window)
-    if (opt.iverbose) cout<<"Searching ..."<<endl;
+    if (opt.iverbose) cout<<"Searching "<<nsearchlist<<" of "<<nbaryons<<" baryons near dm particles in groups ..."<<endl;
 #ifdef USEOPENMP
 #pragma omp parallel default(shared) \
-private(i,tid,p1,pindex,x1,D2,dval,rval,icheck,nnID,dist2,baryonfofold)
+private(i,pindex,x1,D2,dval,rval,icheck,nnID,dist2,baryonfofold)
 {
+#endif
     nnID=new Int_t[nsearch];
     dist2=new Double_t[nsearch];
-#pragma omp for
-#else
-    nnID=new Int_t[nsearch];
-    dist2=new Double_t[nsearch];
-#endif
-    for (i=0;i<nbaryons;i++)
-    {
 #ifdef USEOPENMP
-        tid=omp_get_thread_num();
-#else
-        tid=0;
+#pragma omp for schedule(dynamic,ompperiodnum/16+1)
 #endif
-
-        //if all particles have been searched for field objects then ignore baryons not associated with a group
-        if (opt.partsearchtype==PSTALL && pfofbaryons[i]==0) continue;
-        p1=Pbaryons[i];
+    for (Int_t n=0;n<nsearchlist;n++)
+    {
+        i=searchlist[n];
+        Particle &p1=Pbaryons[i];
         x1=Coordinate(p1.GetPosition());
         rval=dval=MAXVALUE;
         baryonfofold=pfofbaryons[i];
@@ -3933,43 +4244,63 @@ private(i,tid,p1,pindex,x1,D2,dval,rval,icheck,nnID,dist2,baryonfofold)
 
 /// \name Routines used to determine substructure hierarchy
 //@{
-Int_t GetHierarchy(Options &opt,Int_t ngroups, Int_t *nsub, Int_t *parentgid, Int_t *uparentgid, Int_t* stype)
+///Get the levels of the structure hierarchy, starting with field structures
+vector<StrucLevelData*> GetHierarchyLevels()
 {
-    if (opt.iverbose) cout<<"Getting Hierarchy "<<ngroups<<endl;
-    Int_t ng=0,nhierarchy=1,noffset=0;
-    StrucLevelData *ppsldata,**papsldata;
-    ppsldata=psldata;
-    while (ppsldata->nextlevel!=NULL){nhierarchy++;ppsldata=ppsldata->nextlevel;}
-    for (Int_t i=1;i<=ngroups;i++) nsub[i]=0;
-    for (Int_t i=1;i<=ngroups;i++) parentgid[i]=GROUPNOPARENT;
-    for (Int_t i=1;i<=ngroups;i++) uparentgid[i]=GROUPNOPARENT;
-    ppsldata=psldata;
-    papsldata=new StrucLevelData*[nhierarchy];
-    nhierarchy=0;
-    while (ppsldata!=NULL) {papsldata[nhierarchy++]=ppsldata;ppsldata=ppsldata->nextlevel;}
-    for (int i=nhierarchy-1;i>=1;i--){
-        //store number of substructures
-        for (int j=1;j<=papsldata[i]->nsinlevel;j++) {
-	           if (papsldata[i]->gidparenthead[j]!=NULL&&papsldata[i]->gidparenthead[j]!=papsldata[i]->gidhead[j]) nsub[*(papsldata[i]->gidparenthead[j])]++;
-        }
-        //then add these to parent substructure
-        for (int j=1;j<=papsldata[i]->nsinlevel;j++) {
-    	    if (papsldata[i]->gidparenthead[j]!=NULL&&papsldata[i]->gidparenthead[j]!=papsldata[i]->gidhead[j]){
-                nsub[*(papsldata[i]->gidparenthead[j])]+=nsub[*(papsldata[i]->gidhead[j])];
-                parentgid[*(papsldata[i]->gidhead[j])]=*(papsldata[i]->gidparenthead[j]);
-            }
-            if (papsldata[i]->giduberparenthead[j]!=NULL &&papsldata[i]->gidparenthead[j]!=papsldata[i]->gidhead[j]) uparentgid[*(papsldata[i]->gidhead[j])]=*(papsldata[i]->giduberparenthead[j]);
-            stype[*(papsldata[i]->gidhead[j])]=(papsldata[i]->stypeinlevel[j]);
+    vector<StrucLevelData*> levels;
+    for (StrucLevelData *ppsldata=psldata;ppsldata!=NULL;ppsldata=ppsldata->nextlevel) levels.push_back(ppsldata);
+    return levels;
+}
+
+/*!
+    Flattens the structure hierarchy into h, resolving the group ids currently pointed to by the levels. Parents are only set for
+    structures below the field level whose parent differs from themselves. The number of (sub)substructures is accumulated
+    from the deepest level upwards.
+*/
+void BuildStrucHierarchy(Int_t ngroups, StrucHierarchy &h)
+{
+    vector<StrucLevelData*> levels=GetHierarchyLevels();
+    Int_t gid;
+    h.ngroups=ngroups;
+    h.nlevels=levels.size();
+    h.parent.assign(ngroups+1,GROUPNOPARENT);
+    h.uparent.assign(ngroups+1,GROUPNOPARENT);
+    h.stype.assign(ngroups+1,0);
+    h.nsub.assign(ngroups+1,0);
+    h.level.assign(ngroups+1,-1);
+    //groups ordered by level
+    vector<Int_t> order;
+    order.reserve(ngroups);
+    for (int i=0;i<h.nlevels;i++) {
+        StrucLevelData *sld=levels[i];
+        for (Int_t j=1;j<=sld->nsinlevel;j++) {
+            if (sld->gidhead[j]==NULL) continue;
+            gid=*(sld->gidhead[j]);
+            h.stype[gid]=sld->stypeinlevel[j];
+            h.level[gid]=i;
+            order.push_back(gid);
+            if (i==0 || sld->gidparenthead[j]==sld->gidhead[j]) continue;
+            if (sld->gidparenthead[j]!=NULL) h.parent[gid]=*(sld->gidparenthead[j]);
+            if (sld->giduberparenthead[j]!=NULL) h.uparent[gid]=*(sld->giduberparenthead[j]);
         }
     }
-    //store field structures (top treel level) types
-    for (int j=1;j<=papsldata[0]->nsinlevel;j++) {
-        stype[*(papsldata[0]->gidhead[j])]=(papsldata[0]->stypeinlevel[j]);
+    //number of substructures, deepest structures first
+    for (auto it=order.rbegin();it!=order.rend();it++) if (h.parent[*it]!=GROUPNOPARENT) h.nsub[h.parent[*it]]+=1+h.nsub[*it];
+}
+
+Int_t GetHierarchy(Options &opt,Int_t ngroups, Int_t *nsub, Int_t *parentgid, Int_t *uparentgid, Int_t* stype)
+{
+    if (opt.iverbose) cout<<"Getting Hierarchy "<<ngroups<<endl;
+    StrucHierarchy h;
+    BuildStrucHierarchy(ngroups, h);
+    for (Int_t i=1;i<=ngroups;i++) {
+        nsub[i]=h.nsub[i];
+        parentgid[i]=h.parent[i];
+        uparentgid[i]=h.uparent[i];
+        if (h.level[i]>=0) stype[i]=h.stype[i];
     }
-    for (int i=0;i<nhierarchy;i++)papsldata[i]=NULL;
-    delete[] papsldata;
     if(opt.iverbose) cout<<"Done"<<endl;
-    return nhierarchy;
+    return h.nlevels;
 }
 
 void CopyHierarchy(Options &opt,PropData *pdata, Int_t ngroups, Int_t *nsub, Int_t *parentgid, Int_t *uparentgid, Int_t* stype)
@@ -3640,94 +3640,21 @@ void CalcPhaseSigmaTensor(const Int_t n, Particle *p, GMatrix &eigenvalues, GMat
 }
 
 void CalcPhaseSigmaTensor(const Int_t n, Particle *p, GMatrix &I, int itype) {
-    Double_t det,weight;
-    Double_t Ixx,Iyy,Izz,Ixy,Ixz,Iyz;
-    Double_t Ivxvx,Ivyvy,Ivzvz,Ivxvy,Ivxvz,Ivyvz;
-    Double_t Ixvx,Iyvx,Izvx,Ixvy,Iyvy,Izvy,Ixvz,Iyvz,Izvz;
+    PhaseMoments moments=CalcPhaseMoments(n, p, itype, true);
     I=GMatrix(6,6);
-    Int_t i;
-    Ixx=Iyy=Izz=Ixy=Ixz=Iyz=0.;
-    Ivxvx=Ivyvy=Ivzvz=Ivxvy=Ivxvz=Ivyvz=0.;
-    Ixvx=Iyvx=Izvx=Ixvy=Iyvy=Izvy=Ixvz=Iyvz=Izvz=0;
-    Double_t mtot=0;
-#ifdef USEOPENMP
-    if (n>=ompunbindnum) {
-#pragma omp parallel default(shared) \
-private(i,weight)
-{
-#pragma omp for schedule(dynamic) reduction(+:Ixx,Iyy,Izz,Ixy,Ixz,Iyz,Ivxvx,Ivyvy,Ivzvz,Ivxvy,Ivxvz,Ivyvz,Ixvx,Iyvx,Izvx,Ixvy,Iyvy,Izvy,Ixvz,Iyvz,Izvz,mtot)
-    for (i = 0; i < n; i++)
-    {
-        if (itype==-1) weight=p[i].GetMass();
-        else if (p[i].GetType()==itype) weight=p[i].GetMass();
-        else weight=0.;
-        Ixx+=(p[i].X()*p[i].X())*weight;
-        Iyy+=(p[i].Y()*p[i].Y())*weight;
-        Izz+=(p[i].Z()*p[i].Z())*weight;
-        Ixy+=(p[i].X()*p[i].Y())*weight;
-        Ixz+=(p[i].X()*p[i].Z())*weight;
-        Iyz+=(p[i].Y()*p[i].Z())*weight;
-        Ivxvx+=(p[i].Vx()*p[i].Vx())*weight;
-        Ivyvy+=(p[i].Vy()*p[i].Vy())*weight;
-        Ivzvz+=(p[i].Vz()*p[i].Vz())*weight;
-        Ivxvy+=(p[i].Vx()*p[i].Vy())*weight;
-        Ivxvz+=(p[i].Vx()*p[i].Vz())*weight;
-        Ivyvz+=(p[i].Vy()*p[i].Vz())*weight;
-
-        Ixvx+=(p[i].X()*p[i].Vx())*weight;
-        Iyvx+=(p[i].Y()*p[i].Vx())*weight;
-        Izvx+=(p[i].Z()*p[i].Vx())*weight;
-        Ixvy+=(p[i].X()*p[i].Vy())*weight;
-        Iyvy+=(p[i].Y()*p[i].Vy())*weight;
-        Izvy+=(p[i].Z()*p[i].Vy())*weight;
-        Ixvz+=(p[i].X()*p[i].Vz())*weight;
-        Iyvz+=(p[i].Y()*p[i].Vz())*weight;
-        Izvz+=(p[i].Z()*p[i].Vz())*weight;
-
-        mtot+=weight;
-    }
+    //tensor is about the origin so add the contribution of the centre
+    for (int j=0;j<6;j++) for (int k=0;k<6;k++) I(j,k)=moments.cov[j][k]/moments.mass+moments.mean[j]*moments.mean[k];
 }
-    I(0,0)=Ixx;I(1,1)=Iyy;I(2,2)=Izz;
-    I(0,1)=I(1,0)=Ixy;
-    I(0,2)=I(2,0)=Ixz;
-    I(1,2)=I(2,1)=Iyz;
-
-    I(3,3)=Ivxvx;I(4,4)=Ivyvy;I(5,5)=Ivzvz;
-    I(3,4)=I(4,3)=Ivxvy;
-    I(3,5)=I(5,3)=Ivxvz;
-    I(4,5)=I(5,4)=Ivyvz;
 
-    I(0,3)=I(3,0)=Ixvx;
-    I(1,3)=I(3,1)=Iyvx;
-    I(2,3)=I(3,2)=Izvx;
-    I(0,4)=I(4,0)=Ixvy;
-    I(1,4)=I(4,1)=Iyvy;
-    I(2,4)=I(4,2)=Izvy;
-    I(0,5)=I(5,0)=Ixvz;
-    I(1,5)=I(5,1)=Iyvz;
-    I(2,5)=I(5,2)=Izvz;
-
-    }
-    else {
-#endif
-    for (i = 0; i < n; i++)
-    {
-        if (itype==-1) weight=p[i].GetMass();
-        else if (p[i].GetType()==itype) weight=p[i].GetMass();
-        else weight=0.;
-        for (int j = 0; j < 6; j++)
-        {
-            for (int k = 0; k < 6; k++)
-            {
-                I(j, k) += (p[i].GetPhase(j) *p[i].GetPhase(k))*weight;
-            }
-        }
-        mtot+=weight;
-    }
-#ifdef USEOPENMP
+///calculate the phase-space centre of mass and the dispersion tensor about it in a single pass
+void CalcPhaseCMSigmaTensor(const Int_t n, Particle *p, GMatrix &cm, GMatrix &I, int itype) {
+    PhaseMoments moments=CalcPhaseMoments(n, p, itype, true);
+    cm=GMatrix(6,1);
+    I=GMatrix(6,6);
+    for (int j=0;j<6;j++) {
+        cm(j,0)=moments.mean[j];
+        for (int k=0;k<6;k++) I(j,k)=moments.cov[j][k]/moments.mass;
     }
-#endif
-    I=I*(1.0/mtot);
 }
 
 ///calculate the weighted reduced inertia tensor assuming particles are the same mass
@@ -3883,57 +3810,75 @@ private(i,j,temp)
 #endif
 }
 
-///calculate the phase-space dispersion tensor
-GMatrix CalcPhaseCM(const Int_t n, Particle *p, int itype)
+/*!
+    Accumulates the mass weighted phase-space centre and second moments about the centre of particles (of type itype if not -1)
+    in a single parallel pass. Only the diagonal of the second moments is accumulated unless itensor is set.
+*/
+PhaseMoments CalcPhaseMoments(const Int_t n, Particle *p, int itype, bool itensor)
 {
-    Double_t det,weight;
-    Double_t cmx,cmy,cmz,cmvx,cmvy,cmvz;
-    GMatrix cm(6,1);
-    Int_t i;
-    cmx=cmy=cmz=cmvx=cmvy=cmvz=0;
-    Double_t mtot=0;
+    PhaseMoments moments;
 #ifdef USEOPENMP
-    if (n>=ompunbindnum) {
-#pragma omp parallel default(shared) \
-private(i,weight)
+#pragma omp parallel default(shared) if (n>=ompunbindnum)
 {
-#pragma omp for schedule(dynamic) reduction(+:cmx,cmy,cmz,cmvx,cmvy,cmvz,mtot)
-    for (i = 0; i < n; i++)
+#endif
+    PhaseMoments threadmoments;
+    Double_t x[6], weight;
+#ifdef USEOPENMP
+#pragma omp for schedule(static) nowait
+#endif
+    for (Int_t i = 0; i < n; i++)
     {
         if (itype==-1) weight=p[i].GetMass();
         else if (p[i].GetType()==itype) weight=p[i].GetMass();
         else weight=0.;
-        cmx+=p[i].X()*weight;
-        cmy+=p[i].Y()*weight;
-        cmz+=p[i].Z()*weight;
-        cmvx+=p[i].Vx()*weight;
-        cmvy+=p[i].Vy()*weight;
-        cmvz+=p[i].Vz()*weight;
-
-        mtot+=weight;
+        for (int j=0;j<6;j++) x[j]=p[i].GetPhase(j);
+        threadmoments.Add(x, weight, itensor);
     }
+#ifdef USEOPENMP
+#pragma omp critical
+#endif
+    moments.Merge(threadmoments);
+#ifdef USEOPENMP
 }
-    cm(0,0)=cmx;
-    cm(1,0)=cmy;
-    cm(2,0)=cmz;
-    cm(3,0)=cmvx;
-    cm(4,0)=cmvy;
-    cm(5,0)=cmvz;
-    }
-    else {
 #endif
-    for (i = 0; i < n; i++)
-    {
-        if (itype==-1) weight=p[i].GetMass();
-        else if (p[i].GetType()==itype) weight=p[i].GetMass();
-        else weight=0.;
-        for (int j = 0; j < 6; j++) cm(j, 0) += p[i].GetPhase(j)*weight;
-        mtot+=weight;
-    }
+    return moments;
+}
+
+/*!
+    Accumulates the phase-space moments of all groups in a single parallel pass over the particles, where the group of particle i is
+    pfof[Partsubset[i].GetID()]. moments is resized to ngroups+1 with group 0 containing the particles not in a group.
+*/
+void CalcGroupPhaseMoments(const Int_t nsubset, Particle *Partsubset, Int_t *pfof, const Int_t ngroups, vector<PhaseMoments> &moments, bool itensor)
+{
+    moments.assign(ngroups+1,PhaseMoments());
+#ifdef USEOPENMP
+#pragma omp parallel default(shared) if (nsubset>=ompunbindnum)
+{
+#endif
+    vector<PhaseMoments> threadmoments(ngroups+1);
+    Double_t x[6];
 #ifdef USEOPENMP
+#pragma omp for schedule(static) nowait
+#endif
+    for (Int_t i=0;i<nsubset;i++) {
+        for (int j=0;j<6;j++) x[j]=Partsubset[i].GetPhase(j);
+        threadmoments[pfof[Partsubset[i].GetID()]].Add(x, Partsubset[i].GetMass(), itensor);
     }
+#ifdef USEOPENMP
+#pragma omp critical
+#endif
+    for (Int_t i=0;i<=ngroups;i++) moments[i].Merge(threadmoments[i]);
+#ifdef USEOPENMP
+}
 #endif
-    cm=cm*(1.0/mtot);
+}
+
+///calculate the phase-space centre of mass
+GMatrix CalcPhaseCM(const Int_t n, Particle *p, int itype)
+{
+    PhaseMoments moments=CalcPhaseMoments(n, p, itype, false);
+    GMatrix cm(6,1);
+    for (int j=0;j<6;j++) cm(j,0)=moments.mean[j];
     return cm;
 }
 
@@ -4200,6 +4145,8 @@ void GetBindingEnergy(Options &opt, const Int_t nbodies, Particle *Part, Int_t n
     Int_t *storepid;
 
     double time2 = MyGetTime();
+    //groups below this size are calculated in parallel with each using a single thread
+    Int_t nompcalc=max((Int_t)POTOMPCALCNUM,opt.uinfo.potppcalcnum+1);
 
     if (opt.uinfo.icalculatepotential) {
     //small groups with PP calculations of potential.
@@ -4209,8 +4156,8 @@ private(i,j,k,storepid)
 {
     #pragma omp for schedule(dynamic) nowait
 #endif
-    for (i=1;i<=ngroup;i++) if (numingroup[i]<POTOMPCALCNUM) {
-        if (numingroup[i]<=POTPPCALCNUM) PotentialPP(opt,numingroup[i],&Part[noffset[i]]);
+    for (i=1;i<=ngroup;i++) if (numingroup[i]<nompcalc) {
+        if (numingroup[i]<=opt.uinfo.potppcalcnum) PotentialPP(opt,numingroup[i],&Part[noffset[i]]);
         else {
             storepid=new Int_t[numingroup[i]];
             for (j=0;j<numingroup[i];j++) {
@@ -4230,7 +4177,7 @@ private(i,j,k,storepid)
 }
 #endif
         //loop for large groups with tree calculation
-        for (i=1;i<=ngroup;i++) if (numingroup[i]>=POTOMPCALCNUM) {
+        for (i=1;i<=ngroup;i++) if (numingroup[i]>=nompcalc) {
             storepid=new Int_t[numingroup[i]];
             for (j=0;j<numingroup[i];j++) {
                 storepid[j]=Part[noffset[i]+j].GetPID();
@@ -4707,22 +4654,10 @@ void CalculateHaloProperties(Options &opt, const Int_t nbodies, Particle *Part,
 ///Get total number of (sub)substructures in a (sub)structure
 Int_t *GetSubstrutcureNum(Int_t ngroups)
 {
-    Int_t nhierarchy=1;
-    StrucLevelData *ppsldata,**papsldata;
+    StrucHierarchy h;
+    BuildStrucHierarchy(ngroups, h);
     Int_t *nsub=new Int_t[ngroups+1];
-    ppsldata=psldata;
-    while (ppsldata->nextlevel!=NULL){nhierarchy++;ppsldata=ppsldata->nextlevel;}
-    for (Int_t i=1;i<=ngroups;i++) nsub[i]=0;
-    ppsldata=psldata;
-    papsldata=new StrucLevelData*[nhierarchy];
-    nhierarchy=0;
-    while (ppsldata!=NULL) {papsldata[nhierarchy++]=ppsldata;ppsldata=ppsldata->nextlevel;}
-    for (int i=nhierarchy-1;i>=1;i--){
-        //store number of substructures in level below
-        for (int j=0;j<papsldata[i]->nsinlevel;j++) nsub[*(papsldata[i]->gidparenthead[j])]++;
-        //then add all lower level substructures
-        for (int j=0;j<papsldata[i]->nsinlevel;j++) nsub[*(papsldata[i]->gidparenthead[j])]+=nsub[*(papsldata[i]->gidhead[j])];
-    }
+    for (Int_t i=1;i<=ngroups;i++) nsub[i]=h.nsub[i];
     return nsub;
 }
 
@@ -4730,22 +4665,10 @@ Int_t *GetSubstrutcureNum(Int_t ngroups)
 ///Here group ids are MPI local, that is they have not been offset to the global group id value
 Int_t *GetParentID(Int_t ngroups)
 {
-    //initialize number of levels
-    Int_t nhierarchy=1;
-    //store start point of hierarchy pointer
-    StrucLevelData *ppsldata,**papsldata;
+    StrucHierarchy h;
+    BuildStrucHierarchy(ngroups, h);
     Int_t *parentgid=new Int_t[ngroups+1];
-    ppsldata=psldata;
-    while (ppsldata->nextlevel!=NULL){nhierarchy++;ppsldata=ppsldata->nextlevel;}
-    for (Int_t i=1;i<=ngroups;i++) parentgid[i]=0;
-    ppsldata=psldata;
-    papsldata=new StrucLevelData*[nhierarchy];
-    nhierarchy=0;
-    while (ppsldata!=NULL) {papsldata[nhierarchy++]=ppsldata;ppsldata=ppsldata->nextlevel;}
-    for (int i=nhierarchy-1;i>=1;i--){
-        //store number of substructures in level below
-        for (int j=0;j<papsldata[i]->nsinlevel;j++) parentgid[*(papsldata[i]->gidhead[j])]=*(papsldata[i]->gidparenthead[j]);
-    }
+    for (Int_t i=1;i<=ngroups;i++) parentgid[i]=(h.parent[i]==GROUPNOPARENT)?0:h.parent[i];
     return parentgid;
 }
 //@}
@@ -163,6 +163,7 @@ int InitVelociraptor(char* configname, unitinfo u, siminfo s, const int numthrea
     ///check configuration
     iconfigflag = ConfigCheckSwift(libvelociraptorOpt, s);
     if (iconfigflag != 1) return iconfigflag;
+    if (libvelociraptorOpt.uinfo.potppcalcnum<0) CalibratePotentialPPCrossover(libvelociraptorOpt);
 
     if (ThisTask == 0) cout<<"Setting cosmology, units, sim stuff "<<endl;
     ///set units, here idea is to convert internal units so that have kpc, km/s, solar mass
@@ -239,6 +240,7 @@ int InitVelociraptorExtra(const int iextra, char* configname, unitinfo u, siminf
     ///check configuration
     iconfigflag = ConfigCheckSwift(libvelociraptorOptextra[iextra], s);
     if (iconfigflag != 1) return iconfigflag;
+    if (libvelociraptorOptextra[iextra].uinfo.potppcalcnum<0) CalibratePotentialPPCrossover(libvelociraptorOptextra[iextra]);
 
     if (ThisTask == 0) cout<<"Setting cosmology, units, sim stuff "<<endl;
     ///set units, here idea is to convert internal units so that have kpc, km/s, solar mass
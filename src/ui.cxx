@@ -125,7 +125,7 @@ void usage(void)
 
     \arg <b> \e Output </b> Output base name. Overrides the name passed with the command line argument <b> \e -o </b>. Only implemented for completeness. \ref Options.outname \n
     \arg <b> \e Write_group_array_file </b> When producing output also produce a file which lists for every particle the group they belong to. Can be used with \b tipsy format or to tag every particle. \ref Options.iwritefof
-    \arg <b> \e Output_den </b> A filename for storing the intermediate step of calculating local densities. This is particularly useful if the code is not compiled with \b STRUCDEN & \b HALOONLYDEN (see \ref STF-makeflags). \ref Options.smname \n
+    \arg <b> \e Output_den </b> A filename for storing the intermediate step of calculating local densities. This is particularly useful if the code is not compiled with \b STRUCDEN & \b HALOONLYDEN (see \ref STF-makeflags). The file stores densities by particle id along with the parameters used to calculate them, so it is only reused if these match and can be read with a different number of mpi processes. \ref Options.smname \n
 
     \section searchconfig Parameters related to search type.
     See \ref io.cxx (and related ios like \ref gadgetio.cxx), \ref search.cxx, \ref fofalgo.h for extra details
@@ -147,6 +147,10 @@ void usage(void)
 
     \arg <b> \e Nsearch_velocity </b> number of velocity neighbours used to calculate velocity density, adjust \ref Options.Nvel (suggested value is 32) \n
     \arg <b> \e Nsearch_physical </b> number of physical neighbours searched for Nv to calculate velocity density  \ref Options.Nsearch (suggested value is 256) \n
+    \arg <b> \e Local_velocity_density_batched_search </b> 0/1 flag to find the nearest physical neighbours of all particles in a tree leaf node with a single tree search when calculating the exact local velocity density (\ref Options.iLocalVelDenApproxCalcFlag=0). Neighbours are identical to those of a search per particle. \ref Options.iLocalVelDenBatchedNN \n
+    \arg <b> \e Local_velocity_density_leaf_candidates </b> 0/1 flag used with the approximative local velocity density. Rather than all particles in a tree leaf node using the physical neighbours of the centre of the leaf, the leaf gathers a shared set of candidates containing the neighbours of all its particles and each particle selects its own nearest physical neighbours from this set without searching the tree. \ref Options.iLocalVelDenLeafCandidates \n
+    \arg <b> \e Local_velocity_density_single_precision </b> 0/1 flag to calculate distances and select physical neighbours in single precision when neighbours are found using candidates shared by a leaf node (see \e Local_velocity_density_batched_search and \e Local_velocity_density_leaf_candidates). The velocity density itself is accumulated in double precision. A sample of particles is also processed in double precision and the differences are reported, with the leaf node of a sampled particle recalculated in double precision if the difference exceeds \ref NNSINGLEMAXDIFF. Densities of other particles can therefore differ slightly from those found in double precision. \ref Options.iLocalVelDenSinglePrecision \n
+    \arg <b> \e Local_velocity_density_substructure_reuse </b> 0/1 flag only used if compiled with \b HALOONLYDEN, where the local velocity density is calculated using only the particles of the (sub)structure being searched. Stores the physical neighbours of particles so that when searching a substructure for substructure, particles whose neighbours all belong to the substructure reuse their density. Requires memory for \ref Options.Nsearch indices per particle being searched. \ref Options.iSubVelDenReuse \n
     \arg <b> \e Cell_fraction </b> fraction of a halo contained in a subvolume used to characterize the background  \ref Options.Ncellfac \n
     \arg <b> \e Grid_type </b> integer describing type of grid used to decompose volume for substructure search  \ref Options.gridtype (see \ref GRIDTYPES) \n
         - \b 1 \e standard physical shannon entropy, balanced KD tree volume decomposition into cells
@@ -158,6 +162,11 @@ void usage(void)
 
     \subsection fofsubconfig Configuration for substructure search
     \arg <b> \e Search_for_substructure </b> By default field objects are searched for internal substructures but can disable this by setting this to 0 \n
+    \arg <b> \e Substructure_search_lean_particle_copy </b> 0/1 flag. The particles of each object searched for substructure are copied. If set, only the quantities used by the search
+    (mass, phase-space coordinates, ids, type, densities, potential and, for gas, internal energy) are copied, not the hydro, star, black hole and extra dark matter properties,
+    reducing the time and transient memory of the copies in runs with baryons. \ref Options.iSubSearchLeanCopy \n
+    \arg <b> \e Substructure_search_prescreen </b> 0/1 flag. If set, a substructure is only searched for further substructure if at least \ref Options.MinSize of its particles
+    had outlier values, when its parent was searched, exceeding the median of the substructure by \ref Options.ellthreshold. Substructures that cannot host substructure are skipped and reported. \ref Options.iSubSearchPrescreen \n
     \arg <b> \e Keep_FOF </b> if field 6DFOF search is done, allows to keep structures found in 3DFOF (can be interpreted as the inter halo stellar mass when only stellar search is used).\n
     \arg <b> \e FoF_search_type </b> There are several substructure FOF criteria implemented (see \ref FOFTYPES for more types and \ref fofalgo.h for implementation) \n
         - \b 1 \e standard phase-space based, well tested VELOCIraptor criterion.
@@ -187,6 +196,8 @@ void usage(void)
     \arg <b> \e Halo_velocity_linking_length_factor </b> allows one to use different velocity linking lengths between field objects and substructures when using 6D FOF searches.  (Since in such cases the general idea is to use the local velocity dispersion to define a scale, \f$ \geq5 \f$ times this value seems to correctly scale searches) \ref Options.ellhalovelfac \n
     \arg <b> \e Halo_6D_linking_length_factor </b> allows one to use different linking lengths between 3DFOF and 6DFOF field search. Typically values are \f$ \sim 1 \f$ \n
     \arg <b> \e Halo_6D_vel_linking_length_factor </b> scaling applied to dispersions used in 6DFOF field search. Typical values are \f$ \geq 1.25 \f$ \n
+    \arg <b> \e Halo_6D_use_cached_3D_neighbours </b> 0/1 flag to store the physical neighbours of particles in 3DFOF groups found with the 3DFOF tree and link these in phase-space instead of building a tree per 3DFOF group. Only used if \ref Options.ellhalo6dxfac \f$ \leq1 \f$ and not running with MPI. Requires extra memory to store neighbour lists. \ref Options.iFOF6DCachedNeighbours \n
+    \arg <b> \e Halo_3D_linking_length_sweep_factors </b> comma separated list of factors (with trailing comma) of the halo 3D linking length. For each factor a 3DFOF group array is written to <em>outname</em>.fof.llfac<em>factor</em>.grp. All linking lengths are processed with a single tree and neighbour search. Not available with MPI. \ref Options.ellhalo3dsweepfacs \n
 
     \arg <b> \e Halo_core_search </b> 0/1/2 flag allows one to explicitly search for large 6D FOF cores that are indicative of a recent major merger. Since substructure is defined on the scale of the maximum cell size and major mergers typically result two or more phase-space dense regions that are \e larger than the cell size used in reasonable substructure searches, one can identify them using this search. The overall goal is to treat these objects differently than a substructure. However, if 2 is set, then smaller core is treated as substruture and all particles within the FOF envelop are assigned to the cores based on their phase-space distance to core particles \ref Options.iHaloCoreSearch \n
     \arg <b> \e Use_adaptive_core_search </b> 0/1 flag allows one to run complex adaptive phase-space search for large 6D FOF cores and then use these linking lengths to separate mergers. 0 is simple high density dispersively cold cores with v scale adaptive, 1 is adaptive with simple dispersions in both x and v.
@@ -221,7 +232,16 @@ void usage(void)
     \arg <b> \e Frac_pot_ref </b> Set the fraction of particles used to calculate the velocity of the minimum of the potential (0.1). \ref Options.uinfo & \ref UnbindInfo.fracpotref \n
     \arg <b> \e Unbinding_type </b> Set the unbinding criteria, either just remove particles deemeed "unbound", that is those with \f$ \alpha T+W>0\f$, choosing \ref UPART. Or with \ref USYSANDPART
     removes "unbound" particles till system also has a true bound fraction > \ref UnbindInfo.minEfrac.
-    \arg <b> \e Softening_length </b> Set the (simple plummer) gravitational softening length. \ref UnbindInfo.eps
+    \arg <b> \e Softening_length </b> Set the (simple plummer) gravitational softening length. \ref UnbindInfo.eps \n
+    \arg <b> \e Tree_potential_opening_angle </b> Opening angle used by the tree potential calculations, controlling their accuracy (0.5). Must be < 1 for the fast multipole method. \ref UnbindInfo.TreeThetaOpen \n
+    \arg <b> \e Tree_potential_type </b> Set the tree potential calculation used for large groups, either a Barnes-Hut monopole tree walk per particle \ref POTTREEMONOPOLE (0)
+    or a dual tree walk with quadrupole moments (fast multipole method) \ref POTTREEFMM (1) that scales as \f$ O(N) \f$. \ref UnbindInfo.treepotentialtype \n
+    \arg <b> \e Tree_potential_fmm_min_size </b> Minimum number of particles in a group for the fast multipole method to be used when selected (100000). \ref UnbindInfo.fmmminsize \n
+    \arg <b> \e Potential_PP_max_size </b> Maximum number of particles in a group for its potential to be calculated by direct summation rather than with a tree (150).
+    If <0, the crossover is determined at start up by timing both. \ref UnbindInfo.potppcalcnum \n
+    \arg <b> \e Unbinding_incremental_potential </b> 0/1 flag. If set, large groups keep a tree while being unbound, with unbound particles removed from the tree
+    by updating the moments of the cells containing them and potentials refreshed by a walk of this tree rather than building a new one.
+    The tree is built the first time potentials are refreshed. Not compatible with \e Keep_background_potential. \ref UnbindInfo.iincrementalpotential
 
     \section cosmoconfig Units & Cosmology
     \subsection unitconfig Units
@@ -265,6 +285,7 @@ void usage(void)
     \section ioconfigs I/O options
     \arg <b> \e Cosmological_input </b> 1/0 indicating that input simulation is cosmological or not. With cosmological input, a variety of length/velocity scales are set to determine such things as the virial overdensity, linking length. \ref Options.icosmologicalin \n
     \arg <b> \e Input_chunk_size </b> Amount of information to read from input file in one go (100000). \ref Options.inputbufsize \n
+    \arg <b> \e Input_sort_by_Morton_key </b> 0/1 flag indicating whether particles are sorted by their Morton key once read (and distributed) so that particles close in space are close in memory, speeding up tree builds and searches. Not compatible with \e Write_group_array_file or \e Halo_3D_linking_length_sweep_factors as the input order is lost. \ref Options.iSortInputMorton \n
     \arg <b> \e Write_group_array_file </b> 0/1 flag indicating whether write a single large tipsy style group assignment file is written. \ref Options.iwritefof \n
     \arg <b> \e Separate_output_files </b> 1/0 flag indicating whether separate files are written for field and subhalo groups. \ref Options.iseparatefiles \n
     \arg <b> \e Binary_output </b> 3/2/1/0 flag indicating whether output is hdf, binary or ascii. \ref Options.ibinaryout, \ref OUTADIOS, \ref OUTHDF, \ref OUTBINARY, \ref OUTASCII \n
@@ -290,6 +311,8 @@ void usage(void)
     of data. \ref Options.mpipartfac \n
     \arg <b> \e MPI_particle_total_buf_size </b> Total memory size in bytes used to store particles in temporary buffer such that
     particles are sent to non-reading mpi processes in one communication round in chunks of size buffer_size/NProcs/sizeof(Particle). \ref Options.mpiparticlebufsize \n
+    \arg <b> \e MPI_grid_halo_exchange </b> When searching a single halo, each mpi process only imports the background grid cells of other processes that can be
+    among the nearest cells of its particles rather than gathering the full grid (1/0). \ref Options.impigridhaloexchange \n
 
     */
 
@@ -683,6 +706,10 @@ void GetParamFile(Options &opt)
                         opt.fofbgtype = atoi(vbuff);
                     else if (strcmp(tbuff, "Search_for_substructure")==0)
                         opt.iSubSearch = atoi(vbuff);
+                    else if (strcmp(tbuff, "Substructure_search_lean_particle_copy")==0)
+                        opt.iSubSearchLeanCopy = atoi(vbuff);
+                    else if (strcmp(tbuff, "Substructure_search_prescreen")==0)
+                        opt.iSubSearchPrescreen = atoi(vbuff);
                     else if (strcmp(tbuff, "Keep_FOF")==0)
                         opt.iKeepFOF = atoi(vbuff);
                     else if (strcmp(tbuff, "Iterative_searchflag")==0)
@@ -701,6 +728,14 @@ void GetParamFile(Options &opt)
                     //bg and fof parameters
                     else if (strcmp(tbuff, "Local_velocity_density_approximate_calculation")==0)
                         opt.iLocalVelDenApproxCalcFlag = atoi(vbuff);
+                    else if (strcmp(tbuff, "Local_velocity_density_batched_search")==0)
+                        opt.iLocalVelDenBatchedNN = atoi(vbuff);
+                    else if (strcmp(tbuff, "Local_velocity_density_leaf_candidates")==0)
+                        opt.iLocalVelDenLeafCandidates = atoi(vbuff);
+                    else if (strcmp(tbuff, "Local_velocity_density_single_precision")==0)
+                        opt.iLocalVelDenSinglePrecision = atoi(vbuff);
+                    else if (strcmp(tbuff, "Local_velocity_density_substructure_reuse")==0)
+                        opt.iSubVelDenReuse = atoi(vbuff);
                     else if (strcmp(tbuff, "Cell_fraction")==0)
                         opt.Ncellfac = atof(vbuff);
                     else if (strcmp(tbuff, "Grid_type")==0)
@@ -738,6 +773,17 @@ void GetParamFile(Options &opt)
                         opt.ellhalo6dxfac = atof(vbuff);
                     else if (strcmp(tbuff, "Halo_6D_vel_linking_length_factor")==0)
                         opt.ellhalo6dvfac = atof(vbuff);
+                    else if (strcmp(tbuff, "Halo_6D_use_cached_3D_neighbours")==0)
+                        opt.iFOF6DCachedNeighbours = atoi(vbuff);
+                    else if (strcmp(tbuff, "Halo_3D_linking_length_sweep_factors")==0) {
+                        pos=0;
+                        dataline=string(vbuff);
+                        while ((pos = dataline.find(delimiter)) != string::npos) {
+                            token = dataline.substr(0, pos);
+                            opt.ellhalo3dsweepfacs.push_back(stof(token));
+                            dataline.erase(0, pos + delimiter.length());
+                        }
+                    }
                     //specific search for 6d fof core searches
                     else if (strcmp(tbuff, "Halo_core_ellx_fac")==0)
                         opt.halocorexfac = atof(vbuff);
@@ -878,6 +924,16 @@ void GetParamFile(Options &opt)
                         opt.uinfo.maxallowedunboundfrac = atof(vbuff);
                     else if (strcmp(tbuff, "Softening_length")==0)
                         opt.uinfo.eps = atof(vbuff);
+                    else if (strcmp(tbuff, "Tree_potential_opening_angle")==0)
+                        opt.uinfo.TreeThetaOpen = atof(vbuff);
+                    else if (strcmp(tbuff, "Tree_potential_type")==0)
+                        opt.uinfo.treepotentialtype = atoi(vbuff);
+                    else if (strcmp(tbuff, "Tree_potential_fmm_min_size")==0)
+                        opt.uinfo.fmmminsize = atol(vbuff);
+                    else if (strcmp(tbuff, "Potential_PP_max_size")==0)
+                        opt.uinfo.potppcalcnum = atol(vbuff);
+                    else if (strcmp(tbuff, "Unbinding_incremental_potential")==0)
+                        opt.uinfo.iincrementalpotential = atoi(vbuff);
 
                     //property related
                     else if (strcmp(tbuff, "Reference_frame_for_properties")==0)
@@ -975,6 +1031,8 @@ void GetParamFile(Options &opt)
                     //input read related
                     else if (strcmp(tbuff, "Input_chunk_size")==0)
                         opt.inputbufsize = atol(vbuff);
+                    else if (strcmp(tbuff, "Input_sort_by_Morton_key")==0)
+                        opt.iSortInputMorton = atoi(vbuff);
                     else if (strcmp(tbuff, "MPI_particle_total_buf_size")==0)
                         opt.mpiparticletotbufsize = atol(vbuff);
                     //mpi memory related
@@ -982,6 +1040,8 @@ void GetParamFile(Options &opt)
                         opt.mpipartfac = atof(vbuff);
                     else if (strcmp(tbuff, "MPI_number_of_tasks_per_write")==0)
                         opt.mpinprocswritesize = atoi(vbuff);
+                    else if (strcmp(tbuff, "MPI_grid_halo_exchange")==0)
+                        opt.impigridhaloexchange = atoi(vbuff);
                     ///OpenMP related
                     else if (strcmp(tbuff, "OMP_run_fof")==0)
                         opt.iopenmpfof = atoi(vbuff);
@@ -1724,6 +1784,10 @@ void ConfigCheck(Options &opt)
         errormessage("Invalid read buf size (<1)");
         ConfigExit();
     }
+    if (opt.iSortInputMorton && opt.iwritefof){
+        errormessage("WARNING: Sorting input by Morton key would alter the order of the group array file. Not sorting input.");
+        opt.iSortInputMorton = 0;
+    }
     }
 
     if (opt.iBaryonSearch && !(opt.partsearchtype==PSTALL || opt.partsearchtype==PSTDARK))
@@ -1736,6 +1800,27 @@ void ConfigCheck(Options &opt)
         errormessage("Conflict in config file: Asking for Bound Field objects but also asking to keep the 3DFOF/then run 6DFOF. This is incompatible. Check config");
         ConfigExit();
     }
+    if (opt.uinfo.treepotentialtype!=POTTREEMONOPOLE && opt.uinfo.treepotentialtype!=POTTREEFMM)
+    {
+        errormessage("Invalid tree potential type, must be 0 (monopole tree) or 1 (fast multipole method). Check config");
+        ConfigExit();
+    }
+    if (opt.uinfo.TreeThetaOpen<=0)
+    {
+        errormessage("Invalid tree potential opening angle (<=0). Check config");
+        ConfigExit();
+    }
+    //the dual tree walk only accepts cells whose bounding spheres are separated if the opening angle is < 1
+    if ((opt.uinfo.treepotentialtype==POTTREEFMM || opt.uinfo.iincrementalpotential) && opt.uinfo.TreeThetaOpen>=1)
+    {
+        errormessage("Invalid tree potential opening angle (>=1) for the fast multipole method used by Tree_potential_type=1 and Unbinding_incremental_potential=1. Check config");
+        ConfigExit();
+    }
+    if (opt.uinfo.iincrementalpotential && opt.uinfo.bgpot!=0)
+    {
+        errormessage("Conflict in config file: Unbinding_incremental_potential cannot be used with Keep_background_potential as potentials are then not updated. Check config");
+        ConfigExit();
+    }
     if (opt.HaloMinSize==-1) opt.HaloMinSize=opt.MinSize;
 
     if (opt.lengthtokpc<=0){
@@ -1809,6 +1894,42 @@ void ConfigCheck(Options &opt)
     }
 #endif
 
+    if (opt.iLocalVelDenSinglePrecision &&
+        ((opt.iLocalVelDenApproxCalcFlag==0 && opt.iLocalVelDenBatchedNN==0) || (opt.iLocalVelDenApproxCalcFlag>0 && opt.iLocalVelDenLeafCandidates==0))) {
+        errormessage("WARNING: Single precision local velocity density only used when neighbours are found from leaf node candidates. Ignoring.");
+        opt.iLocalVelDenSinglePrecision = 0;
+    }
+
+#ifndef HALOONLYDEN
+    if (opt.iSubVelDenReuse) {
+        errormessage("WARNING: Reuse of substructure velocity densities only used when compiled with HALOONLYDEN. Ignoring.");
+        opt.iSubVelDenReuse = 0;
+    }
+#endif
+
+    if (opt.iFOF6DCachedNeighbours && opt.ellhalo6dxfac>1.0) {
+        errormessage("WARNING: 6DFOF physical linking length larger than 3DFOF, cannot use cached 3D neighbours. Disabling.");
+        opt.iFOF6DCachedNeighbours = 0;
+    }
+#ifdef USEMPI
+    if (opt.iFOF6DCachedNeighbours) {
+        errormessage("WARNING: Cached 3D neighbours for 6DFOF search not available with MPI. Disabling.");
+        opt.iFOF6DCachedNeighbours = 0;
+    }
+    if (opt.ellhalo3dsweepfacs.size()>0) {
+        errormessage("WARNING: Linking length sweep not available with MPI. Disabling.");
+        opt.ellhalo3dsweepfacs.clear();
+    }
+#endif
+    for (auto &x:opt.ellhalo3dsweepfacs) if (x<=0) {
+        errormessage("Linking length sweep factors must be > 0. Exiting.");
+        ConfigExit();
+    }
+    if (opt.iSortInputMorton && opt.ellhalo3dsweepfacs.size()>0){
+        errormessage("WARNING: Sorting input by Morton key would alter the order of the linking length sweep group array files. Not sorting input.");
+        opt.iSortInputMorton = 0;
+    }
+
 #ifndef USEHDF
     if (opt.ibinaryout==OUTHDF){
         errormessage("Code not compiled with HDF output enabled. Recompile with this enabled or change Binary_output.");
@@ -2205,6 +2326,8 @@ ConfigInfo::ConfigInfo(Options &opt){
     AddEntry("FoF_search_type", opt.foftype);
     AddEntry("FoF_Field_search_type", opt.fofbgtype);
     AddEntry("Search_for_substructure", opt.iSubSearch);
+    AddEntry("Substructure_search_lean_particle_copy", opt.iSubSearchLeanCopy);
+    AddEntry("Substructure_search_prescreen", opt.iSubSearchPrescreen);
     AddEntry("Keep_FOF", opt.iKeepFOF);
     AddEntry("Iterative_searchflag", opt.iiterflag);
     AddEntry("Baryon_searchflag", opt.iBaryonSearch);
@@ -2215,6 +2338,10 @@ ConfigInfo::ConfigInfo(Options &opt){
 
     //local field parameters
     AddEntry("Local_velocity_density_approximate_calculation", opt.iLocalVelDenApproxCalcFlag);
+    AddEntry("Local_velocity_density_batched_search", opt.iLocalVelDenBatchedNN);
+    AddEntry("Local_velocity_density_leaf_candidates", opt.iLocalVelDenLeafCandidates);
+    AddEntry("Local_velocity_density_single_precision", opt.iLocalVelDenSinglePrecision);
+    AddEntry("Local_velocity_density_substructure_reuse", opt.iSubVelDenReuse);
     AddEntry("Cell_fraction", opt.Ncellfac);
     AddEntry("Grid_type", opt.gridtype);
     AddEntry("Nsearch_velocity", opt.Nvel);
@@ -2241,6 +2368,8 @@ ConfigInfo::ConfigInfo(Options &opt){
     //specific to 6DFOF field search
     AddEntry("Halo_6D_linking_length_factor", opt.ellhalo6dxfac);
     AddEntry("Halo_6D_vel_linking_length_factor", opt.ellhalo6dvfac);
+    AddEntry("Halo_6D_use_cached_3D_neighbours", opt.iFOF6DCachedNeighbours);
+    AddEntry("Halo_3D_linking_length_sweep_factors", opt.ellhalo3dsweepfacs);
 
     //specific search for 6d fof core searches
     AddEntry("Halo_core_ellx_fac", opt.halocorexfac);
@@ -2321,6 +2450,11 @@ ConfigInfo::ConfigInfo(Options &opt){
     AddEntry("Unbinding_max_unbound_fraction", opt.uinfo.maxunboundfracforiterativeunbind);
     AddEntry("Unbinding_max_unbound_fraction_allowed", opt.uinfo.maxallowedunboundfrac);
     AddEntry("Softening_length", opt.uinfo.eps);
+    AddEntry("Tree_potential_opening_angle", opt.uinfo.TreeThetaOpen);
+    AddEntry("Tree_potential_type", opt.uinfo.treepotentialtype);
+    AddEntry("Tree_potential_fmm_min_size", opt.uinfo.fmmminsize);
+    AddEntry("Potential_PP_max_size", opt.uinfo.potppcalcnum);
+    AddEntry("Unbinding_incremental_potential", opt.uinfo.iincrementalpotential);
 
     //property related
     AddEntry("Inclusive_halo_masses", opt.iInclusiveHalo);
@@ -2471,6 +2605,7 @@ ConfigInfo::ConfigInfo(Options &opt){
     //io related
     AddEntry("Cosmological_input",opt.icosmologicalin);
     AddEntry("Input_chunk_size",opt.inputbufsize);
+    AddEntry("Input_sort_by_Morton_key",opt.iSortInputMorton);
     AddEntry("MPI_particle_total_buf_size",opt.mpiparticletotbufsize);
     AddEntry("Separate_output_files", opt.iseparatefiles);
     AddEntry("Binary_output", opt.ibinaryout);
@@ -2494,6 +2629,7 @@ ConfigInfo::ConfigInfo(Options &opt){
 
     //mpi related configuration
     AddEntry("MPI_part_allocation_fac", opt.mpipartfac);
+    AddEntry("MPI_grid_halo_exchange", opt.impigridhaloexchange);
 #endif
     AddEntry("#Compilation Info");
 #ifdef USEMPI
@@ -1,12 +1,15 @@
 /*! \file unbind.cxx
  *  \brief this file contains routines to check if groups are self-bound and if not unbind them as requried
 
-    \todo Need to improve the gravity calculation (ie: for tree potential use something other than just monopole and also apply corrections if necessary).
+    \todo Need to improve the gravity calculation (ie: apply corrections if necessary). Large groups can use quadrupole moments through the fast multipole method (see \ref PotentialFMM).
     \todo Need to clean up unbind proceedure, ensure its mpi compatible and can be combined with a pglist output easily
  */
 
 #include "stf.h"
 
+///scratch buffers of the potential calculations of each thread
+static thread_local PotentialScratch potscratch;
+
 ///\name Tree-Potential routines
 //@{
 ///subroutine that generates node list for tree gravity calculation
@@ -158,10 +161,13 @@ inline void UpdatePotentialForUnboundParticlesPP(Options &opt,
     }
 }
 
-/// Update the potential if necessary for large groups
+/// Update the potential if necessary for large groups. If fmm is passed, a persistent tree of the group (see \ref FMMBuildGroupTree) is
+/// built the first time potentials are refreshed rather than updated pairwise. From then on the removed particles are taken out of it
+/// and it is used to refresh the potentials instead of building a new tree.
 inline void UpdatePotentialForUnboundParticles(Options &opt,
     Int_t &nig, Particle *groupPart,
-    Int_t &nEplus, Int_t *&nEplusid, int *&Eplusflag)
+    Int_t &nEplus, Int_t *&nEplusid, int *&Eplusflag,
+    FMMTree **fmm=NULL, vector<Int_t> *treeslot=NULL)
 {
     int iunbindsizeflag;
     Double_t r2, pot, poti, eps2=opt.uinfo.eps*opt.uinfo.eps,mv2=opt.MassValue*opt.MassValue;
@@ -174,7 +180,36 @@ inline void UpdatePotentialForUnboundParticles(Options &opt,
     //from all others. The change in efficiency occurs at roughly nEplus>~log(numingroup[i]) particles.
     //we set the limit at 2*log(numingroup[i]) to account for overhead in producing tree and calculating new potential
     iunbindsizeflag=(nEplus<2.0*log((double)nig));
-    if (iunbindsizeflag==0) Potential(opt, nig, groupPart);
+    if (fmm!=NULL) {
+        //particles removed in earlier passes lie beyond nig, so the tree is built from the particles still in the group
+        if (*fmm==NULL && iunbindsizeflag==0) {
+            *fmm=new FMMTree;
+            FMMBuildGroupTree(opt, nig, groupPart, **fmm, *treeslot);
+        }
+        if (*fmm!=NULL) {
+            vector<Int_t> treeids(nEplus);
+            for (auto k=0;k<nEplus;k++) treeids[k]=(*treeslot)[groupPart[nEplusid[k]].GetID()];
+            FMMRemoveParticles(**fmm, nEplus, treeids.data());
+        }
+    }
+    if (iunbindsizeflag==0 && fmm!=NULL) {
+        vector<Double_t> psi;
+        bool runomp=false;
+#ifdef USEOPENMP
+        runomp=(nig>POTOMPCALCNUM);
+#endif
+        FMMPotential(opt, **fmm, psi, runomp);
+#ifdef USEOPENMP
+#pragma omp parallel for default(shared) schedule(static) if (runomp)
+#endif
+        for (auto j=0;j<nig;j++) {
+            groupPart[j].SetPotential(opt.G*groupPart[j].GetMass()*psi[(*treeslot)[groupPart[j].GetID()]]);
+#ifdef NOMASS
+            groupPart[j].SetPotential(groupPart[j].GetPotential()*mv2);
+#endif
+        }
+    }
+    else if (iunbindsizeflag==0) Potential(opt, nig, groupPart);
     else {
         for (auto k=0;k<nEplus;k++) {
 #ifdef USEOPENMP
@@ -269,7 +304,7 @@ inline void GetBoundFractionAndMaxE(Options &opt,
     This arrays may have been constructed prior to the unbinding call and so can be passed to the routine
     if this is called it uses Particle array then deletes it.
 */
-int CheckUnboundGroups(Options opt, const Int_t nbodies, Particle *Part, Int_t &ngroup, Int_t *&pfof, Int_t *numingroup, Int_t **pglist, int ireorder, Int_t *groupflag)
+int CheckUnboundGroups(Options &opt, const Int_t nbodies, Particle *Part, Int_t &ngroup, Int_t *&pfof, Int_t *numingroup, Int_t **pglist, int ireorder, Int_t *groupflag)
 {
     bool ningflag=false, pglistflag=false;
     int iflag;
@@ -400,8 +435,9 @@ inline void CalculatePotentials(Options &opt, Particle **gPart, Int_t &numgroups
 #endif
 
     //for each group calculate potential
-    //if group is small calculate potentials using PP
-    //here openmp is over groups since each group is small
+    //if group is small calculate potentials using PP, otherwise with a tree
+    //here openmp is over groups since each group is small. Groups below nompcalc use a single thread
+    Int_t nompcalc=max((Int_t)POTOMPCALCNUM,opt.uinfo.potppcalcnum+1);
 #ifdef USEOPENMP
 #pragma omp parallel default(shared)
 {
@@ -409,10 +445,9 @@ inline void CalculatePotentials(Options &opt, Particle **gPart, Int_t &numgroups
 #endif
     for (auto i=1;i<=numgroups;i++)
     {
-        if (numingroup[i]<=POTPPCALCNUM) {
-            if (numingroup[i]<0) continue;
-            PotentialPP(opt, numingroup[i], gPart[i]);
-        }
+        if (numingroup[i]<0 || numingroup[i]>=nompcalc) continue;
+        if (numingroup[i]<=opt.uinfo.potppcalcnum) PotentialPP(opt, numingroup[i], gPart[i]);
+        else Potential(opt, numingroup[i], gPart[i]);
     }
 #ifdef USEOPENMP
 }
@@ -425,12 +460,11 @@ inline void CalculatePotentials(Options &opt, Particle **gPart, Int_t &numgroups
     }
     nthreads=maxnthreads;
 #endif
+    //large groups use openmp within the tree calculation
     for (auto i=1;i<=numgroups;i++)
     {
-        if (numingroup[i]<0) continue;
-        if (numingroup[i]>POTPPCALCNUM) {
-            Potential(opt, numingroup[i], gPart[i]);
-        }
+        if (numingroup[i]<nompcalc) continue;
+        Potential(opt, numingroup[i], gPart[i]);
     }
 }
 
@@ -454,8 +488,9 @@ inline void CalculatePotentials(Options &opt, Particle *gPart, Int_t &numgroups,
 #endif
 
     //for each group calculate potential
-    //if group is small calculate potentials using PP
-    //here openmp is over groups since each group is small
+    //if group is small calculate potentials using PP, otherwise with a tree
+    //here openmp is over groups since each group is small. Groups below nompcalc use a single thread
+    Int_t nompcalc=max((Int_t)POTOMPCALCNUM,opt.uinfo.potppcalcnum+1);
 #ifdef USEOPENMP
 #pragma omp parallel default(shared)
 {
@@ -463,10 +498,9 @@ inline void CalculatePotentials(Options &opt, Particle *gPart, Int_t &numgroups,
 #endif
     for (auto i=1;i<=numgroups;i++)
     {
-        if (numingroup[i]<=POTPPCALCNUM) {
-            if (numingroup[i]<0) continue;
-            PotentialPP(opt, numingroup[i], &gPart[noffset[i]]);
-        }
+        if (numingroup[i]<0 || numingroup[i]>=nompcalc) continue;
+        if (numingroup[i]<=opt.uinfo.potppcalcnum) PotentialPP(opt, numingroup[i], &gPart[noffset[i]]);
+        else Potential(opt, numingroup[i], &gPart[noffset[i]]);
     }
 #ifdef USEOPENMP
 }
@@ -479,12 +513,11 @@ inline void CalculatePotentials(Options &opt, Particle *gPart, Int_t &numgroups,
     }
     nthreads=maxnthreads;
 #endif
+    //large groups use openmp within the tree calculation
     for (auto i=1;i<=numgroups;i++)
     {
-        if (numingroup[i]<0) continue;
-        if (numingroup[i]>POTPPCALCNUM) {
-            Potential(opt, numingroup[i], &gPart[noffset[i]]);
-        }
+        if (numingroup[i]<nompcalc) continue;
+        Potential(opt, numingroup[i], &gPart[noffset[i]]);
     }
 }
 
@@ -864,6 +897,10 @@ private(i,j,k,n,maxE,maxunbindsize,nEplus,nEplusid,Eplusflag,v2,Ti,unbindcheck,E
 #endif
     for (i=1;i<=numgroups;i++) if (numingroup[i]>=ompunbindnum)
     {
+        //persistent tree of the group used to update potentials if requested, built when first needed
+        FMMTree *fmm=NULL;
+        vector<Int_t> treeslot;
+        bool iincremental=(opt.uinfo.iincrementalpotential && opt.uinfo.icalculatepotential);
         unbindloops=0;
         oldnumingroup = numingroup[i];
         GetBoundFractionAndMaxE(opt, numingroup[i], gPart[i], cmvel[i], Efrac, maxE, nunbound);
@@ -888,7 +925,7 @@ private(i,j,k,n,maxE,maxunbindsize,nEplus,nEplusid,Eplusflag,v2,Ti,unbindcheck,E
                 UpdateCMForUnboundParticles(opt, gmass[i], cmvel[i],
                     numingroup[i], gPart[i], nEplus, nEplusid, Eplusflag);
                 UpdatePotentialForUnboundParticles(opt, numingroup[i], gPart[i],
-                    nEplus, nEplusid, Eplusflag);
+                    nEplus, nEplusid, Eplusflag, iincremental?&fmm:NULL, &treeslot);
                 RemoveUnboundParticles(i, pfof, numingroup[i], pglist[i], gPart[i], nEplus, nEplusid, Eplusflag);
                 //if number of particles remove with positive energy is near to the number allowed to be removed
                 //must recalculate kinetic energies and check if maxE>0
@@ -916,6 +953,7 @@ private(i,j,k,n,maxE,maxunbindsize,nEplus,nEplusid,Eplusflag,v2,Ti,unbindcheck,E
             delete[] nEplusid;
             delete[] Eplusflag;
         }
+        if (fmm!=NULL) delete fmm;
     }
 
     for (i=1;i<=numgroups;i++) if (numingroup[i]==0) ng--;
@@ -1068,14 +1106,22 @@ void Potential(Options &opt, Int_t nbodies, Particle *Part)
     //for tree code potential calculation
     Int_t ncell;
     Int_t *start,*end;
-    Double_t *cmtot,*cBmax,*cR2max, **r2val;
+    Double_t *cmtot,*cBmax,*cR2max, *r2val;
     Coordinate *cellcm;
     Node *root;
     Node **nodelist, **npomp;
-    Int_t **marktreecell,**markleafcell;
+    Int_t *marktreecell,*markleafcell;
     //Double_t **nnr2;
     KDTree *tree;
     bool runomp = false;
+    //scratch arrays of the calling thread
+    PotentialScratch &scratch=potscratch;
+
+    //large groups can use the fast multipole method instead
+    if (opt.uinfo.treepotentialtype==POTTREEFMM && nbodies>=opt.uinfo.fmmminsize) {
+        PotentialFMM(opt, nbodies, Part);
+        return;
+    }
 
     //for parallel environment store maximum number of threads
     nthreads=1;
@@ -1085,6 +1131,7 @@ void Potential(Options &opt, Int_t nbodies, Particle *Part)
     {
     if (omp_get_thread_num()==0) maxnthreads=nthreads=omp_get_num_threads();
     }
+    if (!runomp) nthreads=1;
 #endif
     //otherwise use tree tree gravity calculation
     //here openmp is per group since each group is large
@@ -1092,24 +1139,25 @@ void Potential(Options &opt, Int_t nbodies, Particle *Part)
     tree=new KDTree(Part,nbodies,opt.uinfo.BucketSize,tree->TPHYS, tree->KEPAN,100,0,0,0,NULL,NULL,runomp);
     ncell=tree->GetNumNodes();
     root=tree->GetRoot();
+    //arrays are taken from the scratch buffers, growing them if necessary
+    scratch.Reserve(ncell,nthreads);
     //to store particles in a given node
-    start=new Int_t[ncell];
-    end=new Int_t[ncell];
+    start=scratch.start.data();
+    end=scratch.end.data();
     //distance calculations used to determine when one uses cell or when one uses particles
-    cmtot=new Double_t[ncell];
-    cBmax=new Double_t[ncell];
-    cR2max=new Double_t[ncell];
-    cellcm=new Coordinate[ncell];
+    cmtot=scratch.cmtot.data();
+    cBmax=scratch.cBmax.data();
+    cR2max=scratch.cR2max.data();
+    cellcm=scratch.cellcm.data();
     //to store note list
-    nodelist=new Node*[ncell];
+    nodelist=scratch.nodelist.data();
 
-    //search tree
-    marktreecell=new Int_t*[nthreads];
-    markleafcell=new Int_t*[nthreads];
-    r2val=new Double_t*[nthreads];
-    npomp=new Node*[nthreads];
-    for (j=0;j<nthreads;j++) {marktreecell[j]=new Int_t[ncell];markleafcell[j]=new Int_t[ncell];}
-    for (j=0;j<nthreads;j++) {r2val[j]=new Double_t[ncell];}
+    //search tree, each thread using a block of ncell entries
+    Int_t nstride=ncell;
+    marktreecell=scratch.marktreecell.data();
+    markleafcell=scratch.markleafcell.data();
+    r2val=scratch.r2val.data();
+    npomp=scratch.npomp.data();
     //from root node calculate cm for each node
     //start at root node and recursively move through list
     ncell=0;
@@ -1164,12 +1212,14 @@ private(j,k,l,n,ntreecell,nleafcell,r2) if (runomp)
         Part[j].SetPotential(0.);
         ntreecell=nleafcell=0;
         Coordinate xpos(Part[j].GetPosition());
-        MarkCell(npomp[tid],marktreecell[tid], markleafcell[tid],ntreecell,nleafcell,r2val[tid],opt.uinfo.BucketSize, cR2max, cellcm, cmtot, xpos, eps2);
+        Int_t *marktree=&marktreecell[tid*nstride], *markleaf=&markleafcell[tid*nstride];
+        Double_t *r2tree=&r2val[tid*nstride];
+        MarkCell(npomp[tid],marktree, markleaf,ntreecell,nleafcell,r2tree,opt.uinfo.BucketSize, cR2max, cellcm, cmtot, xpos, eps2);
         for (k=0;k<ntreecell;k++) {
-          Part[j].SetPotential(Part[j].GetPotential()-Part[j].GetMass()*r2val[tid][k]);
+          Part[j].SetPotential(Part[j].GetPotential()-Part[j].GetMass()*r2tree[k]);
         }
         for (k=0;k<nleafcell;k++) {
-            for (l=start[markleafcell[tid][k]];l<end[markleafcell[tid][k]];l++) {
+            for (l=start[markleaf[k]];l<end[markleaf[k]];l++) {
                 if (j!=l) {
                     r2=0.;for (n=0;n<3;n++) r2+=pow(Part[j].GetPosition(n)-Part[l].GetPosition(n),(Double_t)2.0);
                     r2+=eps2;
@@ -1187,35 +1237,434 @@ private(j,k,l,n,ntreecell,nleafcell,r2) if (runomp)
 }
 #endif
     delete tree;
-    delete[] start;
-    delete[] end;
-    delete[] cmtot;
-    delete[] cBmax;
-    delete[] cR2max;
-    delete[] cellcm;
-    delete[] nodelist;
-    for (j=0;j<nthreads;j++) {delete[] marktreecell[j]; delete[] markleafcell[j]; delete[] r2val[j];}
-    delete[] marktreecell;
-    delete[] markleafcell;
-    delete[] r2val;
-    delete[] npomp;
+    //do not hold on to the memory used by large groups
+    if (nbodies>POTSCRATCHMAXNUM) scratch.Free();
+}
+
+///fast reciprocal square root, an estimate from the bits of the double precision value refined by Newton-Raphson iterations
+///to double precision. Unlike a call to sqrt, this is vectorised by the compiler regardless of whether the math library sets errno.
+inline double FastInvSqrt(double r2)
+{
+    long long i;
+    double y;
+    memcpy(&i,&r2,sizeof(double));
+    i=0x5fe6eb50c7b537a9LL-(i>>1);
+    memcpy(&y,&i,sizeof(double));
+    for (int n=0;n<4;n++) y*=1.5-0.5*r2*y*y;
+    return y;
 }
 
+/*!
+    Calculates the potential by direct summation. Positions and masses are copied to separate arrays, taken from the thread's
+    \ref PotentialScratch, and pairs are summed
+    in tiles of \ref POTPPTILESIZE particles so that the inner loop stays in cache and can be vectorised, with each pair
+    updating both particles.
+*/
 void PotentialPP(Options &opt, Int_t nbodies, Particle *Part)
 {
-    Double_t r2, pot, poti, eps2=opt.uinfo.eps*opt.uinfo.eps, mv2=opt.MassValue*opt.MassValue;
-    for (auto j=0;j<nbodies;j++) Part[j].SetPotential(0.);
+    Double_t eps2=opt.uinfo.eps*opt.uinfo.eps, mv2=opt.MassValue*opt.MassValue;
+    PotentialScratch &scratch=potscratch;
+    scratch.ReservePP(nbodies);
+    Double_t *px=scratch.ppdata.data(), *py=px+nbodies, *pz=py+nbodies, *pm=pz+nbodies, *ppsi=pm+nbodies;
     for (auto j=0;j<nbodies;j++) {
-        for (auto k=j+1;k<nbodies;k++) {
-            r2=0.;for (auto n=0;n<3;n++) r2+=pow(Part[j].GetPosition(n)-Part[k].GetPosition(n),2.0);
-            r2+=eps2;
-            r2=1.0/sqrt(r2);
-            pot=-opt.G*(Part[j].GetMass()*Part[k].GetMass())*r2;
-            poti=Part[j].GetPotential()+pot;Part[j].SetPotential(poti);
-            poti=Part[k].GetPotential()+pot;Part[k].SetPotential(poti);
+        px[j]=Part[j].GetPosition(0);
+        py[j]=Part[j].GetPosition(1);
+        pz[j]=Part[j].GetPosition(2);
+        pm[j]=Part[j].GetMass();
+        ppsi[j]=0;
+    }
+    for (Int_t jt=0;jt<nbodies;jt+=POTPPTILESIZE) {
+        Int_t jend=min(jt+(Int_t)POTPPTILESIZE,nbodies);
+        for (Int_t kt=jt;kt<nbodies;kt+=POTPPTILESIZE) {
+            Int_t kend=min(kt+(Int_t)POTPPTILESIZE,nbodies);
+            for (Int_t j=jt;j<jend;j++) {
+                Double_t xj=px[j], yj=py[j], zj=pz[j], mj=pm[j], psij=0;
+#ifdef USEOPENMP
+                #pragma omp simd reduction(+:psij)
+#endif
+                for (Int_t k=max(kt,j+1);k<kend;k++) {
+                    Double_t dx=xj-px[k], dy=yj-py[k], dz=zj-pz[k];
+                    Double_t rinv=FastInvSqrt(dx*dx+dy*dy+dz*dz+eps2);
+                    psij-=pm[k]*rinv;
+                    ppsi[k]-=mj*rinv;
+                }
+                ppsi[j]+=psij;
+            }
+        }
+    }
+    for (auto j=0;j<nbodies;j++) {
+        Part[j].SetPotential(opt.G*pm[j]*ppsi[j]);
+        #ifdef NOMASS
+        Part[j].SetPotential(Part[j].GetPotential()*mv2);
+        #endif
+    }
+    if (nbodies>POTSCRATCHMAXNUM) scratch.Free();
+}
+
+/*!
+    Sets the maximum size of groups whose potential is calculated by direct summation (\ref UnbindInfo.potppcalcnum) by timing
+    \ref PotentialPP and \ref Potential on random spherical distributions of increasing size up to \ref POTOMPCALCNUM particles,
+    the largest size at which a tree potential is calculated by a single thread. The crossover is the largest size before the tree
+    is faster. With MPI, the timings of the root task are used by all tasks.
+*/
+void CalibratePotentialPPCrossover(Options &opt)
+{
+#ifndef USEMPI
+    int ThisTask=0;
+#endif
+    Int_t ncross=POTOMPCALCNUM;
+    if (ThisTask==0) {
+        vector<Particle> Part(POTOMPCALCNUM);
+        vector<Int_t> sizes;
+        unsigned long long seed=1;
+        Double_t u[3], r2, time1, timepp, timetree;
+        int nrep;
+        for (Int_t n=32;n<POTOMPCALCNUM;n=n*3/2) sizes.push_back(n);
+        sizes.push_back(POTOMPCALCNUM);
+        for (auto isize=0;isize<sizes.size();isize++) {
+            Int_t n=sizes[isize];
+            for (Int_t j=0;j<n;j++) {
+                do {
+                    r2=0;
+                    for (int k=0;k<3;k++) {
+                        seed=seed*6364136223846793005ULL+1442695040888963407ULL;
+                        u[k]=2.0*(seed>>11)*(1.0/9007199254740992.0)-1.0;
+                        r2+=u[k]*u[k];
+                    }
+                } while (r2>1.0);
+                Part[j]=Particle(1.0,u[0],u[1],u[2],0,0,0,j);
+            }
+            nrep=max((Int_t)2,(Int_t)(1<<22)/(n*n));
+            time1=MyGetTime();
+            for (int i=0;i<nrep;i++) PotentialPP(opt,n,Part.data());
+            timepp=MyGetTime()-time1;
+            time1=MyGetTime();
+            for (int i=0;i<nrep;i++) Potential(opt,n,Part.data());
+            timetree=MyGetTime()-time1;
+            if (opt.iverbose) cout<<ThisTask<<" Potential of "<<n<<" particles takes "<<timepp/nrep<<" with direct summation and "<<timetree/nrep<<" with a tree"<<endl;
+            if (timepp>timetree) {
+                ncross=sizes[max(isize-1,0)];
+                break;
+            }
         }
     }
-    #ifdef NOMASS
-    for (auto j=0;j<nbodies;j++) Part[j].SetPotential(Part[j].GetPotential()*mv2);
-    #endif
+#ifdef USEMPI
+    MPI_Bcast(&ncross,1,MPI_Int_t,0,MPI_COMM_WORLD);
+#endif
+    opt.uinfo.potppcalcnum=ncross;
+    if (ThisTask==0) cout<<"Potentials of groups with up to "<<ncross<<" particles calculated by direct summation"<<endl;
 }
+
+///\name Fast multipole method potential routines
+//@{
+///returns \f$ y^T A y \f$ for a symmetric tensor A stored as xx,xy,xz,yy,yz,zz
+inline Double_t FMMSymContract(const Double_t *a, const Double_t *y)
+{
+    return a[0]*y[0]*y[0]+a[3]*y[1]*y[1]+a[5]*y[2]*y[2]+2.0*(a[1]*y[0]*y[1]+a[2]*y[0]*y[2]+a[4]*y[1]*y[2]);
+}
+
+///Builds the cells of a \ref FMMTree from a kd-tree of the particles, which are copied in tree order
+void FMMBuildTree(Options &opt, KDTree *tree, Int_t nbodies, Particle *Part, FMMTree &fmm, bool runomp)
+{
+    Int_t ncell=tree->GetNumNodes();
+    Node **nodelist=new Node*[ncell];
+    fmm.nbodies=nbodies;
+    fmm.pos.resize(3*nbodies);
+    fmm.mass.resize(nbodies);
+    fmm.index.resize(nbodies);
+#ifdef USEOPENMP
+#pragma omp parallel for default(shared) schedule(static) if (runomp)
+#endif
+    for (Int_t j=0;j<nbodies;j++) {
+        for (int n=0;n<3;n++) fmm.pos[3*j+n]=Part[j].GetPosition(n);
+        fmm.mass[j]=Part[j].GetMass();
+        fmm.index[j]=Part[j].GetID();
+    }
+    ncell=0;
+    GetNodeList(tree->GetRoot(),ncell,nodelist,opt.uinfo.BucketSize);
+    ncell++;
+    fmm.ncell=ncell;
+    fmm.start.resize(ncell);
+    fmm.end.resize(ncell);
+    fmm.left.resize(ncell);
+    fmm.right.resize(ncell);
+    for (Int_t j=0;j<ncell;j++) {
+        fmm.start[j]=nodelist[j]->GetStart();
+        fmm.end[j]=nodelist[j]->GetEnd();
+        if (nodelist[j]->GetCount()>opt.uinfo.BucketSize) {
+            fmm.left[j]=((SplitNode*)nodelist[j])->GetLeft()->GetID();
+            fmm.right[j]=((SplitNode*)nodelist[j])->GetRight()->GetID();
+        }
+        else fmm.left[j]=fmm.right[j]=-1;
+    }
+    delete[] nodelist;
+    fmm.cmass.resize(ncell);
+    fmm.crmax.resize(ncell);
+    fmm.cquad.resize(6*ncell);
+    fmm.ccm.resize(ncell);
+}
+
+///Calculates the moments of a leaf cell of a \ref FMMTree directly from its particles. Cells without mass use their geometric centre
+inline void FMMLeafMoments(FMMTree &fmm, Int_t j)
+{
+    Double_t m=0, cm[3]={0,0,0}, d[3], d2, r2max=0, *q=&fmm.cquad[6*j];
+    Int_t nin=fmm.end[j]-fmm.start[j];
+    for (Int_t k=fmm.start[j];k<fmm.end[j];k++) {
+        m+=fmm.mass[k];
+        for (int n=0;n<3;n++) cm[n]+=fmm.mass[k]*fmm.pos[3*k+n];
+    }
+    if (m>0) for (int n=0;n<3;n++) cm[n]/=m;
+    else {
+        for (int n=0;n<3;n++) cm[n]=0;
+        for (Int_t k=fmm.start[j];k<fmm.end[j];k++) for (int n=0;n<3;n++) cm[n]+=fmm.pos[3*k+n]/(Double_t)nin;
+    }
+    for (int n=0;n<6;n++) q[n]=0;
+    for (Int_t k=fmm.start[j];k<fmm.end[j];k++) {
+        d2=0;
+        for (int n=0;n<3;n++) {d[n]=fmm.pos[3*k+n]-cm[n];d2+=d[n]*d[n];}
+        if (d2>r2max) r2max=d2;
+        q[0]+=fmm.mass[k]*(3.0*d[0]*d[0]-d2);
+        q[1]+=fmm.mass[k]*3.0*d[0]*d[1];
+        q[2]+=fmm.mass[k]*3.0*d[0]*d[2];
+        q[3]+=fmm.mass[k]*(3.0*d[1]*d[1]-d2);
+        q[4]+=fmm.mass[k]*3.0*d[1]*d[2];
+        q[5]+=fmm.mass[k]*(3.0*d[2]*d[2]-d2);
+    }
+    fmm.cmass[j]=m;
+    for (int n=0;n<3;n++) fmm.ccm[j][n]=cm[n];
+    fmm.crmax[j]=sqrt(r2max);
+}
+
+///Calculates the moments of a split cell of a \ref FMMTree from those of its children (which must already be calculated),
+///shifting the quadrupoles to the new centre of mass. The radius is an upper bound given by the children's spheres.
+inline void FMMSplitMoments(FMMTree &fmm, Int_t j)
+{
+    Int_t child[2]={fmm.left[j],fmm.right[j]};
+    Double_t m=fmm.cmass[child[0]]+fmm.cmass[child[1]], mc, cm[3], s[3], s2, rmax=0, *q=&fmm.cquad[6*j], *qc;
+    for (int n=0;n<3;n++) {
+        if (m>0) cm[n]=(fmm.cmass[child[0]]*fmm.ccm[child[0]][n]+fmm.cmass[child[1]]*fmm.ccm[child[1]][n])/m;
+        else cm[n]=0.5*(fmm.ccm[child[0]][n]+fmm.ccm[child[1]][n]);
+    }
+    for (int n=0;n<6;n++) q[n]=0;
+    for (int c=0;c<2;c++) {
+        mc=fmm.cmass[child[c]];
+        qc=&fmm.cquad[6*child[c]];
+        s2=0;
+        for (int n=0;n<3;n++) {s[n]=fmm.ccm[child[c]][n]-cm[n];s2+=s[n]*s[n];}
+        q[0]+=qc[0]+mc*(3.0*s[0]*s[0]-s2);
+        q[1]+=qc[1]+mc*3.0*s[0]*s[1];
+        q[2]+=qc[2]+mc*3.0*s[0]*s[2];
+        q[3]+=qc[3]+mc*(3.0*s[1]*s[1]-s2);
+        q[4]+=qc[4]+mc*3.0*s[1]*s[2];
+        q[5]+=qc[5]+mc*(3.0*s[2]*s[2]-s2);
+        rmax=max(rmax,sqrt(s2)+fmm.crmax[child[c]]);
+    }
+    fmm.cmass[j]=m;
+    for (int n=0;n<3;n++) fmm.ccm[j][n]=cm[n];
+    fmm.crmax[j]=rmax;
+}
+
+///Calculates the moments of all cells of a \ref FMMTree, leaf cells first and then split cells from the bottom up
+void FMMMoments(FMMTree &fmm, bool runomp)
+{
+#ifdef USEOPENMP
+#pragma omp parallel for default(shared) schedule(dynamic,64) if (runomp)
+#endif
+    for (Int_t j=0;j<fmm.ncell;j++) if (fmm.left[j]<0) FMMLeafMoments(fmm,j);
+    for (Int_t j=fmm.ncell-1;j>=0;j--) if (fmm.left[j]>=0) FMMSplitMoments(fmm,j);
+}
+
+///Adds the far field of cell b to the local expansion of cell a. The quadrupole of b only contributes to the value of the expansion
+///so that terms are kept to second order overall. Monopole terms use the plummer softened potential.
+inline void FMMCellCell(FMMTree &fmm, Int_t a, Int_t b, Double_t eps2)
+{
+    Double_t r[3], r2=0, rinv, rinv3, rinv5, mb=fmm.cmass[b], *l2=&fmm.l2[6*a];
+    for (int n=0;n<3;n++) {r[n]=fmm.ccm[a][n]-fmm.ccm[b][n];r2+=r[n]*r[n];}
+    rinv=1.0/sqrt(r2+eps2);
+    rinv3=rinv*rinv*rinv;
+    rinv5=rinv3*rinv*rinv;
+    fmm.l0[a]-=mb*rinv+0.5*rinv5*FMMSymContract(&fmm.cquad[6*b],r);
+    for (int n=0;n<3;n++) fmm.l1[a][n]+=mb*rinv3*r[n];
+    l2[0]-=mb*(3.0*r[0]*r[0]*rinv5-rinv3);
+    l2[1]-=mb*3.0*r[0]*r[1]*rinv5;
+    l2[2]-=mb*3.0*r[0]*r[2]*rinv5;
+    l2[3]-=mb*(3.0*r[1]*r[1]*rinv5-rinv3);
+    l2[4]-=mb*3.0*r[1]*r[2]*rinv5;
+    l2[5]-=mb*(3.0*r[2]*r[2]*rinv5-rinv3);
+}
+
+///Adds the direct potential of the particles in cell b to the particles in cell a
+inline void FMMLeafLeaf(FMMTree &fmm, Int_t a, Int_t b, Double_t eps2, Double_t *psi)
+{
+    Double_t r2, dx;
+    for (Int_t k=fmm.start[a];k<fmm.end[a];k++) {
+        Double_t psik=0;
+        for (Int_t l=fmm.start[b];l<fmm.end[b];l++) {
+            if (k==l) continue;
+            r2=eps2;
+            for (int n=0;n<3;n++) {dx=fmm.pos[3*k+n]-fmm.pos[3*l+n];r2+=dx*dx;}
+            psik-=fmm.mass[l]/sqrt(r2);
+        }
+        psi[k]+=psik;
+    }
+}
+
+///Dual tree walk calculating the potential in cell a due to the particles in cell b. Well separated pairs of cells, where the distance between
+///their centres of mass exceeds the sum of their radii divided by the opening angle, interact through the local expansion of a. Otherwise the larger
+///cell is split, with pairs of leaf cells interacting directly. Only the expansions and particles of a and its children are updated
+///so walks of different cells a that do not contain one another can proceed in parallel.
+void FMMInteract(FMMTree &fmm, Int_t a, Int_t b, Double_t theta2, Double_t eps2, Double_t *psi)
+{
+    if (fmm.cmass[b]==0) return;
+    if (a!=b) {
+        Double_t r2=0, rsum=fmm.crmax[a]+fmm.crmax[b];
+        for (int n=0;n<3;n++) r2+=(fmm.ccm[a][n]-fmm.ccm[b][n])*(fmm.ccm[a][n]-fmm.ccm[b][n]);
+        if (r2*theta2>rsum*rsum) {
+            FMMCellCell(fmm,a,b,eps2);
+            return;
+        }
+    }
+    if (fmm.left[a]<0 && fmm.left[b]<0) FMMLeafLeaf(fmm,a,b,eps2,psi);
+    else if (fmm.left[b]<0 || (fmm.left[a]>=0 && fmm.crmax[a]>fmm.crmax[b])) {
+        FMMInteract(fmm,fmm.left[a],b,theta2,eps2,psi);
+        FMMInteract(fmm,fmm.right[a],b,theta2,eps2,psi);
+    }
+    else {
+        FMMInteract(fmm,a,fmm.left[b],theta2,eps2,psi);
+        FMMInteract(fmm,a,fmm.right[b],theta2,eps2,psi);
+    }
+}
+
+/*!
+    Calculates the potential per unit mass of each particle in a \ref FMMTree, psi (in tree order), whose moments have been calculated (see \ref FMMMoments).
+    The dual tree walk (see \ref FMMInteract) is run in parallel over a set of cells that together contain all particles, each walking
+    the full tree. The local expansions are then passed from each cell to its children and evaluated at the particles in leaf cells.
+    The accuracy is set by the opening angle \ref UnbindInfo.TreeThetaOpen with errors scaling as the cube of the opening angle.
+*/
+void FMMPotential(Options &opt, FMMTree &fmm, vector<Double_t> &psi, bool runomp)
+{
+    Double_t theta2=opt.uinfo.TreeThetaOpen*opt.uinfo.TreeThetaOpen, eps2=opt.uinfo.eps*opt.uinfo.eps;
+    Int_t ntaskmax=fmm.nbodies;
+    vector<Int_t> taskcells, cellstack(1,0);
+    psi.assign(fmm.nbodies,0);
+    fmm.l0.assign(fmm.ncell,0);
+    fmm.l1.assign(fmm.ncell,Coordinate(0.));
+    fmm.l2.assign(6*fmm.ncell,0);
+#ifdef USEOPENMP
+    if (runomp) ntaskmax=max((Int_t)(fmm.nbodies/(16*omp_get_max_threads())),(Int_t)opt.uinfo.BucketSize);
+#endif
+    //split the tree into cells that are walked independently
+    while (cellstack.size()>0) {
+        Int_t j=cellstack.back();
+        cellstack.pop_back();
+        if (fmm.left[j]<0 || fmm.end[j]-fmm.start[j]<=ntaskmax) taskcells.push_back(j);
+        else {
+            cellstack.push_back(fmm.left[j]);
+            cellstack.push_back(fmm.right[j]);
+        }
+    }
+#ifdef USEOPENMP
+#pragma omp parallel for default(shared) schedule(dynamic,1) if (runomp)
+#endif
+    for (Int_t i=0;i<(Int_t)taskcells.size();i++) FMMInteract(fmm,taskcells[i],0,theta2,eps2,psi.data());
+
+    //pass local expansions down the tree
+    for (Int_t j=0;j<fmm.ncell;j++) {
+        if (fmm.left[j]<0) continue;
+        Int_t child[2]={fmm.left[j],fmm.right[j]};
+        Double_t *l2=&fmm.l2[6*j];
+        for (int c=0;c<2;c++) {
+            Double_t s[3], l2s[3];
+            for (int n=0;n<3;n++) s[n]=fmm.ccm[child[c]][n]-fmm.ccm[j][n];
+            l2s[0]=l2[0]*s[0]+l2[1]*s[1]+l2[2]*s[2];
+            l2s[1]=l2[1]*s[0]+l2[3]*s[1]+l2[4]*s[2];
+            l2s[2]=l2[2]*s[0]+l2[4]*s[1]+l2[5]*s[2];
+            for (int n=0;n<3;n++) {
+                fmm.l0[child[c]]+=(fmm.l1[j][n]+0.5*l2s[n])*s[n];
+                fmm.l1[child[c]][n]+=fmm.l1[j][n]+l2s[n];
+            }
+            for (int n=0;n<6;n++) fmm.l2[6*child[c]+n]+=l2[n];
+        }
+    }
+    //and evaluate them at the particles
+#ifdef USEOPENMP
+#pragma omp parallel for default(shared) schedule(dynamic,64) if (runomp)
+#endif
+    for (Int_t j=0;j<fmm.ncell;j++) {
+        if (fmm.left[j]>=0) continue;
+        for (Int_t k=fmm.start[j];k<fmm.end[j];k++) {
+            Double_t y[3];
+            for (int n=0;n<3;n++) y[n]=fmm.pos[3*k+n]-fmm.ccm[j][n];
+            psi[k]+=fmm.l0[j]+0.5*FMMSymContract(&fmm.l2[6*j],y);
+            for (int n=0;n<3;n++) psi[k]+=fmm.l1[j][n]*y[n];
+        }
+    }
+}
+
+///Builds a \ref FMMTree of a group that is kept while the group is unbound. The IDs of the particles are set to their current index, which
+///is used as a key to find a particle in the tree, treeslot, as the particles are reordered by energy during unbinding.
+void FMMBuildGroupTree(Options &opt, Int_t nbodies, Particle *Part, FMMTree &fmm, vector<Int_t> &treeslot)
+{
+    KDTree *tree;
+    bool runomp = false;
+#ifdef USEOPENMP
+    runomp = (nbodies > POTOMPCALCNUM);
+#endif
+    for (Int_t j=0;j<nbodies;j++) Part[j].SetID(j);
+    tree=new KDTree(Part,nbodies,opt.uinfo.BucketSize,tree->TPHYS, tree->KEPAN,100,0,0,0,NULL,NULL,runomp);
+    FMMBuildTree(opt, tree, nbodies, Part, fmm, runomp);
+    delete tree;
+    FMMMoments(fmm, runomp);
+    treeslot.resize(nbodies);
+    for (Int_t k=0;k<nbodies;k++) treeslot[fmm.index[k]]=k;
+}
+
+///Removes particles, given by their location in the tree, from a \ref FMMTree by setting their masses to zero.
+///Only the moments of the cells containing them are recalculated.
+void FMMRemoveParticles(FMMTree &fmm, Int_t nremove, Int_t *treeids)
+{
+    vector<char> iupdate(fmm.ncell,0);
+    for (Int_t i=0;i<nremove;i++) {
+        Int_t k=treeids[i], j=0;
+        fmm.mass[k]=0;
+        while (true) {
+            iupdate[j]=1;
+            if (fmm.left[j]<0) break;
+            j=(k<fmm.end[fmm.left[j]])?fmm.left[j]:fmm.right[j];
+        }
+    }
+    for (Int_t j=fmm.ncell-1;j>=0;j--) {
+        if (!iupdate[j]) continue;
+        if (fmm.left[j]<0) FMMLeafMoments(fmm,j);
+        else FMMSplitMoments(fmm,j);
+    }
+}
+
+/// Calculates the gravitational potential using a dual tree walk with quadrupole moments (fast multipole method), see \ref FMMPotential.
+/// Selected for large groups by \ref UnbindInfo.treepotentialtype and \ref UnbindInfo.fmmminsize.
+void PotentialFMM(Options &opt, Int_t nbodies, Particle *Part)
+{
+    Double_t mv2=opt.MassValue*opt.MassValue;
+    KDTree *tree;
+    FMMTree fmm;
+    vector<Double_t> psi;
+    bool runomp = false;
+#ifdef USEOPENMP
+    runomp = (nbodies > POTOMPCALCNUM);
+#endif
+    tree=new KDTree(Part,nbodies,opt.uinfo.BucketSize,tree->TPHYS, tree->KEPAN,100,0,0,0,NULL,NULL,runomp);
+    FMMBuildTree(opt, tree, nbodies, Part, fmm, runomp);
+    FMMMoments(fmm, runomp);
+    FMMPotential(opt, fmm, psi, runomp);
+#ifdef USEOPENMP
+#pragma omp parallel for default(shared) schedule(static) if (runomp)
+#endif
+    for (Int_t j=0;j<nbodies;j++) {
+        Part[j].SetPotential(opt.G*Part[j].GetMass()*psi[j]);
+#ifdef NOMASS
+        Part[j].SetPotential(Part[j].GetPotential()*mv2);
+#endif
+    }
+    delete tree;
+}
+//@}